@@ -0,0 +1,62 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Retry backoff source file
+ *
+ *  Exponential backoff with full jitter: each delay is drawn uniformly
+ *  between zero and a bound that starts at the initial delay and grows by
+ *  the multiplier up to the maximum. Things retrying the same slave spread
+ *  out instead of reconnecting in lockstep.
+ */
+
+#include <stdint.h>
+#include <ell/ell.h>
+
+#include "backoff.h"
+
+void backoff_init(struct backoff *backoff, unsigned int initial_ms,
+		  unsigned int max_ms, float multiplier)
+{
+	backoff->initial_ms = initial_ms;
+	backoff->max_ms = max_ms;
+	backoff->multiplier = multiplier;
+
+	backoff_reset(backoff);
+}
+
+unsigned int backoff_next(struct backoff *backoff)
+{
+	unsigned int delay_ms;
+	double ceiling;
+
+	delay_ms = l_getrandom_uint32() % ((uint64_t) backoff->ceiling_ms + 1);
+
+	ceiling = (double) backoff->ceiling_ms * backoff->multiplier;
+	backoff->ceiling_ms = ceiling < backoff->max_ms ?
+				(unsigned int) ceiling : backoff->max_ms;
+	backoff->attempts++;
+
+	/* A timeout of zero is never armed */
+	return delay_ms ? delay_ms : 1;
+}
+
+void backoff_reset(struct backoff *backoff)
+{
+	backoff->ceiling_ms = backoff->initial_ms < backoff->max_ms ?
+				backoff->initial_ms : backoff->max_ms;
+	backoff->attempts = 0;
+}
@@ -0,0 +1,34 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Retry backoff header file
+ */
+
+struct backoff {
+	unsigned int initial_ms;
+	unsigned int max_ms;
+	float multiplier;
+	/* Upper bound of the next delay */
+	unsigned int ceiling_ms;
+	/* Delays handed out since the last reset */
+	unsigned int attempts;
+};
+
+void backoff_init(struct backoff *backoff, unsigned int initial_ms,
+		  unsigned int max_ms, float multiplier);
+unsigned int backoff_next(struct backoff *backoff);
+void backoff_reset(struct backoff *backoff);
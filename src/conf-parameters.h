@@ -21,6 +21,7 @@
 #define CREDENTIALS_GROUP		"Credentials"
 #define CREDENTIALS_THING_ID		"ThingId"
 #define CREDENTIALS_THING_TOKEN		"ThingToken"
+#define CREDENTIALS_SCHEMA_HASH		"SchemaHash"
 
 #define CLOUD_GROUP			"Cloud"
 #define RABBIT_URL			"Url"
@@ -32,10 +33,30 @@
 #define THING_USER_TOKEN		"UserToken"
 #define THING_MODBUS_SLAVE_ID		"ModbusSlaveId"
 #define THING_MODBUS_URL		"ModbusURL"
+#define THING_MODBUS_READ_MAX_GAP	"ModbusReadMaxGap"
+#define THING_MODBUS_TCP_WINDOW		"ModbusTcpWindow"
+#define MODBUS_TCP_WINDOW_MAX		32
+#define THING_MODBUS_RECONNECT_INITIAL_MS	"ModbusReconnectInitialMs"
+#define THING_MODBUS_RECONNECT_MAX_MS		"ModbusReconnectMaxMs"
+#define THING_MODBUS_RECONNECT_MULTIPLIER	"ModbusReconnectMultiplier"
+#define RECONNECT_DEFAULT_INITIAL_MS		1000
+#define RECONNECT_DEFAULT_MAX_MS		60000
+#define RECONNECT_DEFAULT_MULTIPLIER		2
+#define THING_PUBLISH_WINDOW_MS		"PublishWindowMs"
+#define PUBLISH_WINDOW_DEFAULT_MS	50
+#define THING_OFFLINE_STORE_PATH	"OfflineStorePath"
+#define THING_OFFLINE_STORE_SIZE	"OfflineStoreSize"
+#define THING_OFFLINE_REPLAY_RATE	"OfflineReplayRate"
+#define OFFLINE_STORE_DEFAULT_FILE	"offline-store.bin"
+#define OFFLINE_STORE_DEFAULT_SIZE	10000
+#define OFFLINE_REPLAY_DEFAULT_RATE	100
 #define MODBUS_MIN_SLAVE_ID		0
 #define MODBUS_MAX_SLAVE_ID		255
 
 #define SCHEMA_SENSOR_ID		"SchemaSensorId"
+/* Sent as one byte by the KNoT protocol */
+#define SCHEMA_MIN_SENSOR_ID		0
+#define SCHEMA_MAX_SENSOR_ID		255
 #define SCHEMA_SENSOR_NAME		"SchemaSensorName"
 #define SCHEMA_VALUE_TYPE		"SchemaValueType"
 #define SCHEMA_UNIT			"SchemaUnit"
@@ -46,10 +67,21 @@
 #define EVENT_TIME_SEC			"EventTimeSec"
 #define EVENT_CHANGE			"EventChange"
 #define EVENT_CHANGE_TRUE		1
+#define EVENT_HYSTERESIS		"EventHysteresis"
+/* Wider than the range of any value type */
+#define EVENT_HYSTERESIS_MAX		((float) UINT64_MAX)
+#define EVENT_DEADBAND_ABS		"EventDeadbandAbs"
+#define EVENT_DEADBAND_PCT		"EventDeadbandPct"
 
 #define MODBUS_REG_ADDRESS		"ModbusRegisterAddress"
 #define MODBUS_BIT_OFFSET		"ModbusBitOffset"
 #define MODBUS_TYPE_ENDIANNESS		"ModbusTypeEndianness"
+#define MODBUS_REGISTER_COUNT		"ModbusRegisterCount"
+#define MODBUS_SLAVE			"ModbusSlave"
+
+#define POLLING_INTERVAL_MS		"PollingIntervalMs"
+#define POLLING_INTERVAL_DEFAULT_MS	1000
+#define POLLING_INTERVAL_MIN_MS		10
 
 // definition of endianness type
 #define MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN		0x01
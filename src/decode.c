@@ -0,0 +1,470 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Modbus value decoders source file
+ *
+ *  One decoder per (width, endianness) combination, picked once when the
+ *  data item is loaded, so reading a value doesn't branch on its layout.
+ *  Registers are in host order as returned by libmodbus, and the first
+ *  register is the least significant word of a little endian host load.
+ *
+ *  Whole register images holding values of the same layout are converted
+ *  at once by a byte shuffle, using SSSE3 or AVX2 when the CPU has them.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <knot/knot_protocol.h>
+#include <knot/knot_types.h>
+
+#include "iface-modbus.h"
+#include "conf-parameters.h"
+#include "decode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+typedef size_t (*shuffle_func_t) (const uint8_t *mask, const uint8_t *src,
+				  uint8_t *dst, size_t len);
+
+/*
+ * Byte shuffle of one 16 bytes lane per endianness, indexed by the
+ * MODBUS_ENDIANNESS_TYPE_* value. Mid little endian is the host order.
+ */
+static const uint8_t shuffle_masks_32[][16] = {
+	[MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN] = {
+		2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13
+	},
+	[MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN] = {
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+	},
+	[MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN] = {
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+	}
+};
+
+static const uint8_t shuffle_masks_64[][16] = {
+	[MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN] = {
+		6, 7, 4, 5, 2, 3, 0, 1, 14, 15, 12, 13, 10, 11, 8, 9
+	},
+	[MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN] = {
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+	},
+	[MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN] = {
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+	}
+};
+
+static enum decode_isa isa;
+static shuffle_func_t shuffle;
+
+static inline uint32_t load_u32(const void *src)
+{
+	uint32_t val;
+
+	memcpy(&val, src, sizeof(val));
+
+	return val;
+}
+
+static inline uint64_t load_u64(const void *src)
+{
+	uint64_t val;
+
+	memcpy(&val, src, sizeof(val));
+
+	return val;
+}
+
+static inline uint32_t swap_words_32(uint32_t val)
+{
+	return (val >> 16) | (val << 16);
+}
+
+static inline uint32_t swap_halfword_bytes_32(uint32_t val)
+{
+	return ((val >> 8) & 0x00ff00ffu) | ((val & 0x00ff00ffu) << 8);
+}
+
+static inline uint64_t swap_words_64(uint64_t val)
+{
+	val = (val >> 32) | (val << 32);
+
+	return ((val >> 16) & 0x0000ffff0000ffffu) |
+		((val & 0x0000ffff0000ffffu) << 16);
+}
+
+static inline uint64_t swap_halfword_bytes_64(uint64_t val)
+{
+	return ((val >> 8) & 0x00ff00ff00ff00ffu) |
+		((val & 0x00ff00ff00ff00ffu) << 8);
+}
+
+/*
+ * Narrower values are zero extended, so the union is always written by two
+ * full width stores that a later load of any member can be forwarded from.
+ */
+static inline void store_value(knot_value_type *out, uint64_t val)
+{
+	out->val_u64 = val;
+	memset(out->raw + sizeof(uint64_t), 0,
+	       sizeof(*out) - sizeof(uint64_t));
+}
+
+static void decode_bool(const void *src, knot_value_type *out)
+{
+	const uint8_t *bits = src;
+
+	store_value(out, bits[0]);
+}
+
+static void decode_byte(const void *src, knot_value_type *out)
+{
+	const uint8_t *bits = src;
+
+	store_value(out, bits[0] | bits[1] << 1 | bits[2] << 2 | bits[3] << 3 |
+		  bits[4] << 4 | bits[5] << 5 | bits[6] << 6 | bits[7] << 7);
+}
+
+static void decode_u16(const void *src, knot_value_type *out)
+{
+	uint16_t val;
+
+	memcpy(&val, src, sizeof(val));
+	store_value(out, val);
+}
+
+static void decode_u32_big(const void *src, knot_value_type *out)
+{
+	store_value(out, swap_words_32(load_u32(src)));
+}
+
+static void decode_u32_mid_big(const void *src, knot_value_type *out)
+{
+	store_value(out, __builtin_bswap32(load_u32(src)));
+}
+
+static void decode_u32_little(const void *src, knot_value_type *out)
+{
+	store_value(out, swap_halfword_bytes_32(load_u32(src)));
+}
+
+static void decode_u32_mid_little(const void *src, knot_value_type *out)
+{
+	store_value(out, load_u32(src));
+}
+
+static void decode_u64_big(const void *src, knot_value_type *out)
+{
+	store_value(out, swap_words_64(load_u64(src)));
+}
+
+static void decode_u64_mid_big(const void *src, knot_value_type *out)
+{
+	store_value(out, __builtin_bswap64(load_u64(src)));
+}
+
+static void decode_u64_little(const void *src, knot_value_type *out)
+{
+	store_value(out, swap_halfword_bytes_64(load_u64(src)));
+}
+
+static void decode_u64_mid_little(const void *src, knot_value_type *out)
+{
+	store_value(out, load_u64(src));
+}
+
+/* RAW values keep the on-wire (big endian) byte order of each register */
+static inline void decode_raw(const uint16_t *regs, int count,
+			      knot_value_type *out)
+{
+	int i;
+
+	memset(out, 0, sizeof(*out));
+
+	for (i = 0; i < count; i++) {
+		out->raw[2 * i] = regs[i] >> 8;
+		out->raw[2 * i + 1] = regs[i] & 0xff;
+	}
+}
+
+#define DEFINE_DECODE_RAW(n)						\
+static void decode_raw_##n(const void *src, knot_value_type *out)	\
+{									\
+	decode_raw(src, n, out);					\
+}
+
+DEFINE_DECODE_RAW(1)
+DEFINE_DECODE_RAW(2)
+DEFINE_DECODE_RAW(3)
+DEFINE_DECODE_RAW(4)
+DEFINE_DECODE_RAW(5)
+DEFINE_DECODE_RAW(6)
+DEFINE_DECODE_RAW(7)
+DEFINE_DECODE_RAW(8)
+
+static const decode_func_t raw_decoders[] = {
+	decode_raw_1, decode_raw_2, decode_raw_3, decode_raw_4,
+	decode_raw_5, decode_raw_6, decode_raw_7, decode_raw_8
+};
+
+static decode_func_t get_u32_func(int endianness_type)
+{
+	switch (endianness_type) {
+	case MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN:
+		return decode_u32_big;
+	case MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN:
+		return decode_u32_mid_big;
+	case MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN:
+		return decode_u32_little;
+	case MODBUS_ENDIANNESS_TYPE_MID_LITTLE_ENDIAN:
+	default:
+		return decode_u32_mid_little;
+	}
+}
+
+static decode_func_t get_u64_func(int endianness_type)
+{
+	switch (endianness_type) {
+	case MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN:
+		return decode_u64_big;
+	case MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN:
+		return decode_u64_mid_big;
+	case MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN:
+		return decode_u64_little;
+	case MODBUS_ENDIANNESS_TYPE_MID_LITTLE_ENDIAN:
+	default:
+		return decode_u64_mid_little;
+	}
+}
+
+decode_func_t decode_get_func(int bit_offset, int endianness_type,
+			      int value_type)
+{
+	if (value_type == KNOT_VALUE_TYPE_RAW) {
+		if (bit_offset <= 0 || bit_offset % TYPE_U16 ||
+				bit_offset > TYPE_RAW_MAX)
+			return NULL;
+
+		return raw_decoders[bit_offset / TYPE_U16 - 1];
+	}
+
+	switch (bit_offset) {
+	case TYPE_BOOL:
+		return decode_bool;
+	case TYPE_BYTE:
+		return decode_byte;
+	case TYPE_U16:
+		return decode_u16;
+	case TYPE_U32:
+		return get_u32_func(endianness_type);
+	case TYPE_U64:
+		return get_u64_func(endianness_type);
+	default:
+		return NULL;
+	}
+}
+
+static size_t shuffle_scalar(const uint8_t *mask, const uint8_t *src,
+			     uint8_t *dst, size_t len)
+{
+	return 0;
+}
+
+#ifdef DECODE_X86_SIMD
+__attribute__((target("ssse3")))
+static size_t shuffle_ssse3(const uint8_t *mask, const uint8_t *src,
+			    uint8_t *dst, size_t len)
+{
+	__m128i m = _mm_loadu_si128((const __m128i *) mask);
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_shuffle_epi8(v, m));
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t shuffle_avx2(const uint8_t *mask, const uint8_t *src,
+			   uint8_t *dst, size_t len)
+{
+	/* vpshufb shuffles each 128 bits lane on its own */
+	__m256i m = _mm256_broadcastsi128_si256(
+				_mm_loadu_si128((const __m128i *) mask));
+	__m256i v;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (src + i));
+		_mm256_storeu_si256((__m256i *) (dst + i),
+				    _mm256_shuffle_epi8(v, m));
+	}
+
+	return i;
+}
+#endif
+
+static bool is_isa_supported(enum decode_isa new_isa)
+{
+	switch (new_isa) {
+	case DECODE_ISA_SCALAR:
+		return true;
+#ifdef DECODE_X86_SIMD
+	case DECODE_ISA_SSSE3:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("ssse3");
+	case DECODE_ISA_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#else
+	case DECODE_ISA_SSSE3:
+	case DECODE_ISA_AVX2:
+#endif
+	default:
+		return false;
+	}
+}
+
+int decode_set_isa(enum decode_isa new_isa)
+{
+	if (!is_isa_supported(new_isa))
+		return -ENOTSUP;
+
+	switch (new_isa) {
+#ifdef DECODE_X86_SIMD
+	case DECODE_ISA_SSSE3:
+		shuffle = shuffle_ssse3;
+		break;
+	case DECODE_ISA_AVX2:
+		shuffle = shuffle_avx2;
+		break;
+#else
+	case DECODE_ISA_SSSE3:
+	case DECODE_ISA_AVX2:
+#endif
+	case DECODE_ISA_SCALAR:
+	default:
+		shuffle = shuffle_scalar;
+	}
+
+	isa = new_isa;
+
+	return 0;
+}
+
+enum decode_isa decode_get_isa(void)
+{
+	if (!shuffle && decode_set_isa(DECODE_ISA_AVX2) < 0 &&
+			decode_set_isa(DECODE_ISA_SSSE3) < 0)
+		decode_set_isa(DECODE_ISA_SCALAR);
+
+	return isa;
+}
+
+static void convert_32(int endianness_type, const uint8_t *src,
+		       uint32_t *out, size_t count)
+{
+	size_t i;
+
+	switch (endianness_type) {
+	case MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN:
+		for (i = 0; i < count; i++)
+			out[i] = swap_words_32(load_u32(src + 4 * i));
+		break;
+	case MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN:
+		for (i = 0; i < count; i++)
+			out[i] = __builtin_bswap32(load_u32(src + 4 * i));
+		break;
+	case MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN:
+		for (i = 0; i < count; i++)
+			out[i] = swap_halfword_bytes_32(load_u32(src + 4 * i));
+		break;
+	case MODBUS_ENDIANNESS_TYPE_MID_LITTLE_ENDIAN:
+	default:
+		memcpy(out, src, count * sizeof(*out));
+	}
+}
+
+static void convert_64(int endianness_type, const uint8_t *src,
+		       uint64_t *out, size_t count)
+{
+	size_t i;
+
+	switch (endianness_type) {
+	case MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN:
+		for (i = 0; i < count; i++)
+			out[i] = swap_words_64(load_u64(src + 8 * i));
+		break;
+	case MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN:
+		for (i = 0; i < count; i++)
+			out[i] = __builtin_bswap64(load_u64(src + 8 * i));
+		break;
+	case MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN:
+		for (i = 0; i < count; i++)
+			out[i] = swap_halfword_bytes_64(load_u64(src + 8 * i));
+		break;
+	case MODBUS_ENDIANNESS_TYPE_MID_LITTLE_ENDIAN:
+	default:
+		memcpy(out, src, count * sizeof(*out));
+	}
+}
+
+int decode_registers(int bit_offset, int endianness_type,
+		     const uint16_t *regs, size_t count, void *out)
+{
+	const uint8_t (*masks)[16];
+	size_t len = count * (bit_offset / 8);
+	size_t done;
+
+	if (bit_offset == TYPE_U32)
+		masks = shuffle_masks_32;
+	else if (bit_offset == TYPE_U64)
+		masks = shuffle_masks_64;
+	else
+		return -EINVAL;
+
+	if (endianness_type < MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN ||
+	    endianness_type > MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN) {
+		/* Already in host order */
+		memcpy(out, regs, len);
+		return 0;
+	}
+
+	decode_get_isa();
+	done = shuffle(masks[endianness_type], (const uint8_t *) regs, out,
+		       len);
+
+	/* The tail that doesn't fill a vector */
+	if (bit_offset == TYPE_U32)
+		convert_32(endianness_type, (const uint8_t *) regs + done,
+			   (uint32_t *) out + done / 4, (len - done) / 4);
+	else
+		convert_64(endianness_type, (const uint8_t *) regs + done,
+			   (uint64_t *) out + done / 8, (len - done) / 8);
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Modbus value decoders header file
+ */
+
+/*
+ * Converts the bits (one uint8_t per bit) or registers (uint16_t in host
+ * order) of a data item into its KNoT value.
+ */
+typedef void (*decode_func_t)(const void *src, knot_value_type *out);
+
+decode_func_t decode_get_func(int bit_offset, int endianness_type,
+			      int value_type);
+
+enum decode_isa {
+	DECODE_ISA_SCALAR,
+	DECODE_ISA_SSSE3,
+	DECODE_ISA_AVX2
+};
+
+/*
+ * Converts count consecutive 32 or 64 bits values from a register image
+ * into host order, out being an array of uint32_t or uint64_t.
+ */
+int decode_registers(int bit_offset, int endianness_type,
+		     const uint16_t *regs, size_t count, void *out);
+/* The best instruction set supported by the CPU is used by default */
+int decode_set_isa(enum decode_isa isa);
+enum decode_isa decode_get_isa(void);
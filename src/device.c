@@ -33,14 +33,20 @@
 #include "device.h"
 #include "device-pvt.h"
 #include "iface-modbus.h"
+#include "decode.h"
 #include "sm.h"
 #include "event.h"
+#include "event-batch.h"
 #include "poll.h"
+#include "read-plan.h"
+#include "offline-store.h"
 #include "properties.h"
+#include "hash.h"
 
 #define CONNECTED_MASK		0xFF
+#define OFFLINE_REPLAY_PERIOD_MS	100
+
 #define set_conn_bitmask(a, b1, b2) (a) ? (b1) | (b2) : (b1) & ~(b2)
-#define DEFAULT_POLLING_INTERVAL 1
 
 enum CONN_TYPE {
 	MODBUS = 0x0F,
@@ -50,21 +56,34 @@ enum CONN_TYPE {
 struct modbus_slave {
 	int id;
 	char *url;
+	/* Filled on start: the connection shared by the slaves of the url */
+	int bus;
 };
 
 struct modbus_source {
+	/* Index in the thing's modbus_slaves */
+	int slave;
 	int reg_addr;
 	int bit_offset;
 	int endianness_type_sensor;
 };
 
+/*
+ * Only the fields used on every poll, event check and publish. The schema
+ * lives in a parallel array as it is only needed to build config messages.
+ */
 struct knot_data_item {
 	int sensor_id;
-	knot_schema schema;
-	knot_event event;
+	uint8_t value_type;
+	bool publish_pending;
+	/* Value that passed the event check, sent on the window flush */
+	knot_value_type publish_val;
 	knot_value_type current_val;
-	knot_value_type sent_val;
+	knot_event event;
+	struct event_filter event_filter;
+	decode_func_t decode;
 	struct modbus_source modbus_source;
+	int polling_interval_ms;
 };
 
 struct knot_thing {
@@ -72,105 +91,373 @@ struct knot_thing {
 	char id[KNOT_PROTOCOL_UUID_LEN + 1];
 	char name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
 	char *user_token;
-
-	struct modbus_slave modbus_slave;
+	/* Hash of the config last accepted by the cloud, 0 if unknown */
+	uint64_t schema_hash;
+
+	/* The first one is the KNoTThing slave, the default of data items */
+	struct modbus_slave *modbus_slaves;
+	int modbus_slaves_len;
+	int read_max_gap;
+	/* Requests in flight per Modbus TCP connection, 0 uses libmodbus */
+	int modbus_tcp_window;
+	/* Backoff between connect attempts of each Modbus bus */
+	int reconnect_initial_ms;
+	int reconnect_max_ms;
+	float reconnect_multiplier;
+	int publish_window_ms;
 	char *rabbitmq_url;
 	struct device_settings conf_files;
 
-	struct l_hashmap *data_items;
+	/*
+	 * Data items are only added while loading the properties, so pointers
+	 * into data_items stay valid once the device has started.
+	 */
+	struct knot_data_item *data_items;
+	knot_schema *data_item_schemas;
+	int data_items_len;
+	/* Indexed by sensor id: slot in data_items, or -1 */
+	int *data_item_slots;
+	int data_item_slots_len;
 
 	struct l_timeout *msg_to;
+
+	/* Checks the events of the items read on this main loop iteration */
+	struct l_idle *evaluate_idle;
+
+	/* Data items waiting for the publish window to expire */
+	struct l_queue *publish_queue;
+	struct l_timeout *publish_to;
+
+	/* Readings kept while the cloud is unreachable */
+	char *offline_path;
+	int offline_capacity;
+	int offline_replay_rate;
+	bool replay_enabled;
+	struct l_timeout *replay_to;
 };
 
+typedef void (*foreach_data_item_t)(struct knot_data_item *data_item,
+				    void *user_data);
+
 struct knot_thing thing;
 
 static void knot_thing_destroy(struct knot_thing *thing)
 {
+	int i;
+
 	if (thing->msg_to)
 		l_timeout_remove(thing->msg_to);
 
+	if (thing->publish_to)
+		l_timeout_remove(thing->publish_to);
+
+	if (thing->evaluate_idle)
+		l_idle_remove(thing->evaluate_idle);
+
+	event_batch_destroy();
+
+	l_queue_destroy(thing->publish_queue, NULL);
+
+	if (thing->replay_to)
+		l_timeout_remove(thing->replay_to);
+
+	offline_store_close();
+	l_free(thing->offline_path);
+
 	l_free(thing->user_token);
 	l_free(thing->rabbitmq_url);
-	l_free(thing->modbus_slave.url);
+	for (i = 0; i < thing->modbus_slaves_len; i++)
+		l_free(thing->modbus_slaves[i].url);
+	l_free(thing->modbus_slaves);
 	l_free(thing->conf_files.credentials_path);
 	l_free(thing->conf_files.device_path);
 	l_free(thing->conf_files.cloud_path);
 
-	l_hashmap_destroy(thing->data_items, l_free);
+	l_free(thing->data_items);
+	l_free(thing->data_item_schemas);
+	l_free(thing->data_item_slots);
 }
 
-static void foreach_event_add_data_item(const void *key, void *value,
-					void *user_data)
+static struct knot_data_item *data_item_lookup(int sensor_id)
 {
-	struct knot_data_item *data_item = value;
+	int slot;
 
-	event_add_data_item(data_item->sensor_id, data_item->event);
+	if (sensor_id < 0 || sensor_id >= thing.data_item_slots_len)
+		return NULL;
+
+	slot = thing.data_item_slots[sensor_id];
+
+	return slot < 0 ? NULL : &thing.data_items[slot];
 }
 
-static void foreach_update_config(void *data, void *user_data)
+static knot_schema *data_item_get_schema(struct knot_data_item *data_item)
 {
-	knot_msg_config *config = data;
+	return &thing.data_item_schemas[data_item - thing.data_items];
+}
 
-	properties_update_data_item(&thing, thing.conf_files.device_path,
-				    config);
+static void foreach_data_item(foreach_data_item_t func, void *user_data)
+{
+	int i;
+
+	for (i = 0; i < thing.data_items_len; i++)
+		func(&thing.data_items[i], user_data);
+}
+
+static void foreach_event_add_data_item(struct knot_data_item *data_item,
+					void *user_data)
+{
+	event_add_data_item(data_item->sensor_id, data_item->event);
 }
 
-static void foreach_send_config(const void *key, void *value, void *user_data)
+static void foreach_send_config(struct knot_data_item *data_item,
+				void *user_data)
 {
-	struct knot_data_item *data_item = value;
 	struct l_queue *config_queue = user_data;
 	knot_msg_config config_aux;
 
 	config_aux.sensor_id = data_item->sensor_id;
-	config_aux.schema = data_item->schema;
+	config_aux.schema = *data_item_get_schema(data_item);
 	config_aux.event = data_item->event;
 	l_queue_push_head(config_queue, l_memdup(&config_aux,
 						 sizeof(knot_msg_config)));
 }
 
-static void on_publish_data(void *data, void *user_data)
+static int on_replay_record(const struct offline_record *record,
+			    void *user_data)
+{
+	return knot_cloud_publish_data(thing.id, record->sensor_id,
+				       record->value_type, &record->value,
+				       record->value_len);
+}
+
+static void on_replay_timeout(struct l_timeout *timeout, void *user_data)
+{
+	int burst;
+
+	burst = thing.offline_replay_rate * OFFLINE_REPLAY_PERIOD_MS / 1000;
+	offline_store_drain(burst > 0 ? burst : 1, on_replay_record, NULL);
+
+	if (offline_store_count()) {
+		l_timeout_modify_ms(timeout, OFFLINE_REPLAY_PERIOD_MS);
+		return;
+	}
+
+	l_info("Offline readings replayed");
+	l_timeout_remove(thing.replay_to);
+	thing.replay_to = NULL;
+}
+
+static void replay_schedule(void)
+{
+	if (!thing.replay_enabled || thing.replay_to || !offline_store_count())
+		return;
+
+	thing.replay_to = l_timeout_create_ms(OFFLINE_REPLAY_PERIOD_MS,
+					      on_replay_timeout, NULL, NULL);
+}
+
+static uint8_t data_item_value_len(struct knot_data_item *data_item)
+{
+	/* Only RAW values need their length, keep the old value otherwise */
+	if (data_item->value_type == KNOT_VALUE_TYPE_RAW)
+		return data_item->modbus_source.bit_offset / 8;
+
+	return sizeof(data_item->value_type);
+}
+
+static int store_data_item(struct knot_data_item *data_item,
+			   const knot_value_type *value)
+{
+	int rc;
+
+	rc = offline_store_push(data_item->sensor_id,
+				data_item->value_type,
+				data_item_value_len(data_item), value);
+	if (rc < 0)
+		return rc;
+
+	replay_schedule();
+
+	return 0;
+}
+
+static void on_store_data(void *data, void *user_data)
 {
 	struct knot_data_item *data_item;
 	int *sensor_id = data;
-	int rc;
 
-	data_item = l_hashmap_lookup(thing.data_items,
-				     L_INT_TO_PTR(*sensor_id));
+	data_item = data_item_lookup(*sensor_id);
 	if (!data_item)
 		return;
 
+	store_data_item(data_item, &data_item->current_val);
+}
+
+static void on_publish_data(void *data, void *user_data)
+{
+	struct knot_data_item *data_item = data;
+	int rc;
+
+	data_item->publish_pending = false;
+
+	/* Queue behind older readings so the cloud gets them in order */
+	if (offline_store_count() &&
+			!store_data_item(data_item, &data_item->publish_val))
+		return;
+
 	rc = knot_cloud_publish_data(thing.id, data_item->sensor_id,
-				     data_item->schema.value_type,
-				     &data_item->current_val,
-				     sizeof(data_item->schema.value_type));
-	if (rc < 0)
+				     data_item->value_type,
+				     &data_item->publish_val,
+				     data_item_value_len(data_item));
+	if (rc < 0 && store_data_item(data_item, &data_item->publish_val) < 0)
 		l_error("Couldn't send data_update for data_item #%d",
-			*sensor_id);
+			data_item->sensor_id);
 }
 
-static void foreach_publish_all_data(const void *key, void *value,
+static void publish_flush(void)
+{
+	struct l_queue *queue;
+
+	if (thing.publish_to) {
+		l_timeout_remove(thing.publish_to);
+		thing.publish_to = NULL;
+	}
+
+	if (l_queue_isempty(thing.publish_queue))
+		return;
+
+	queue = thing.publish_queue;
+	thing.publish_queue = l_queue_new();
+
+	l_info("Publishing %u data items", l_queue_length(queue));
+
+	l_queue_foreach(queue, on_publish_data, NULL);
+	l_queue_destroy(queue, NULL);
+}
+
+static void on_publish_timeout(struct l_timeout *timeout, void *user_data)
+{
+	publish_flush();
+}
+
+static void publish_enqueue(struct knot_data_item *data_item)
+{
+	/*
+	 * Only the latest value of each data item is sent on the flush. It is
+	 * the one the event engine kept as sent, not whatever is read later
+	 * on in the window.
+	 */
+	data_item->publish_val = data_item->current_val;
+	if (data_item->publish_pending)
+		return;
+
+	data_item->publish_pending = true;
+	l_queue_push_tail(thing.publish_queue, data_item);
+}
+
+static void on_publish_enqueue(void *data, void *user_data)
+{
+	struct knot_data_item *data_item;
+	int *sensor_id = data;
+
+	data_item = data_item_lookup(*sensor_id);
+	if (!data_item)
+		return;
+
+	publish_enqueue(data_item);
+}
+
+static void foreach_publish_all_data(struct knot_data_item *data_item,
 				     void *user_data)
 {
-	struct knot_data_item *data_item = value;
+	publish_enqueue(data_item);
+}
+
+static void publish_schedule(void)
+{
+	if (!thing.publish_window_ms) {
+		publish_flush();
+		return;
+	}
+
+	if (thing.publish_to || l_queue_isempty(thing.publish_queue))
+		return;
 
-	on_publish_data(&data_item->sensor_id, NULL);
+	thing.publish_to = l_timeout_create_ms(thing.publish_window_ms,
+					       on_publish_timeout, NULL, NULL);
+	if (!thing.publish_to)
+		publish_flush();
 }
 
-static void on_msg_timeout(struct l_timeout *timeout, void *user_data)
+static size_t get_value_len(int value_type)
 {
-	sm_input_event(EVT_TIMEOUT, user_data);
+	knot_value_type value;
+
+	/* Bytes past the value type width are not meaningful */
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		return sizeof(value.val_i);
+	case KNOT_VALUE_TYPE_UINT:
+		return sizeof(value.val_u);
+	case KNOT_VALUE_TYPE_INT64:
+		return sizeof(value.val_i64);
+	case KNOT_VALUE_TYPE_UINT64:
+		return sizeof(value.val_u64);
+	case KNOT_VALUE_TYPE_FLOAT:
+		return sizeof(value.val_f);
+	case KNOT_VALUE_TYPE_BOOL:
+		return sizeof(value.val_b);
+	default:
+		return sizeof(value);
+	}
 }
 
-static void on_event_timeout(int id)
+static uint64_t hash_data_item(uint64_t hash, struct knot_data_item *data_item)
 {
-	struct l_queue *list;
+	knot_schema schema = *data_item_get_schema(data_item);
+	knot_event event = data_item->event;
+	size_t value_len = get_value_len(schema.value_type);
+
+	hash = hash_bytes(hash, &data_item->sensor_id,
+			  sizeof(data_item->sensor_id));
+	hash = hash_bytes(hash, &schema.type_id, sizeof(schema.type_id));
+	hash = hash_bytes(hash, &schema.unit, sizeof(schema.unit));
+	hash = hash_bytes(hash, &schema.value_type, sizeof(schema.value_type));
+	hash = hash_bytes(hash, schema.name,
+			  strnlen(schema.name, KNOT_PROTOCOL_DATA_NAME_LEN));
+	hash = hash_bytes(hash, &event.event_flags, sizeof(event.event_flags));
+	hash = hash_bytes(hash, &event.time_sec, sizeof(event.time_sec));
+	hash = hash_bytes(hash, &event.lower_limit, value_len);
+	hash = hash_bytes(hash, &event.upper_limit, value_len);
+
+	return hash;
+}
 
-	list = l_queue_new();
-	l_queue_push_head(list, &id);
+/* Stable across restarts: data items are hashed in sensor id order */
+static uint64_t get_schema_hash(void)
+{
+	struct knot_data_item *data_item;
+	uint64_t hash = HASH_INIT;
+	int id;
 
-	sm_input_event(EVT_PUB_DATA, list);
+	for (id = 0; id < thing.data_item_slots_len; id++) {
+		data_item = data_item_lookup(id);
+		if (data_item)
+			hash = hash_data_item(hash, data_item);
+	}
+
+	/* 0 means "no hash stored" */
+	return hash ? hash : 1;
+}
+
+static void on_msg_timeout(struct l_timeout *timeout, void *user_data)
+{
+	sm_input_event(EVT_TIMEOUT, user_data);
+}
 
-	l_queue_destroy(list, NULL);
+static void on_event_timeout(struct l_queue *ids)
+{
+	sm_input_event(EVT_PUB_DATA, ids);
 }
 
 static bool on_cloud_receive(const struct knot_cloud_msg *msg, void *user_data)
@@ -243,74 +530,271 @@ static void on_cloud_connected(void *user_data)
 	conn_handler(CLOUD, true);
 }
 
+/* Called once the last bus is down, each bus logs its own state */
 static void on_modbus_disconnected(void *user_data)
 {
-	l_info("Disconnected from Modbus");
-
 	poll_stop();
 	conn_handler(MODBUS, false);
 }
 
+/* Called once the first bus is up */
 static void on_modbus_connected(void *user_data)
 {
-	l_info("Connected to Modbus %s", thing.modbus_slave.url);
-
 	poll_start();
 	conn_handler(MODBUS, true);
 }
 
-static int on_modbus_poll_receive(int id)
+static void on_evaluate_idle(struct l_idle *idle, void *user_data)
+{
+	struct l_queue *publish_list;
+	uint64_t *publish;
+	uint64_t word;
+	int len = EVENT_BATCH_BITMAP_LEN(thing.data_items_len);
+	int slot;
+	int i;
+
+	l_idle_remove(thing.evaluate_idle);
+	thing.evaluate_idle = NULL;
+
+	publish = l_new(uint64_t, len);
+	if (event_batch_evaluate(publish) <= 0)
+		goto done;
+
+	publish_list = l_queue_new();
+	for (i = 0; i < len; i++) {
+		for (word = publish[i]; word; word &= word - 1) {
+			slot = i * 64 + __builtin_ctzll(word);
+			l_queue_push_tail(publish_list,
+					  &thing.data_items[slot].sensor_id);
+		}
+	}
+
+	sm_input_event(EVT_PUB_DATA, publish_list);
+	l_queue_destroy(publish_list, NULL);
+
+done:
+	l_free(publish);
+}
+
+/* Data items of a block whose values are decoded by a single call */
+#define DECODE_RUN_MAX		32
+
+struct decode_run {
+	const uint16_t *regs;
+	int bit_offset;
+	int endianness_type;
+	int len;
+	struct knot_data_item *items[DECODE_RUN_MAX];
+};
+
+static void data_item_set_value(struct knot_data_item *data_item)
+{
+	event_batch_set_value(data_item - thing.data_items,
+			      &data_item->current_val);
+}
+
+static void decode_run_flush(struct decode_run *run)
+{
+	struct knot_data_item *data_item;
+	union {
+		uint32_t u32[DECODE_RUN_MAX];
+		uint64_t u64[DECODE_RUN_MAX];
+	} vals;
+	int i;
+
+	if (run->len == 1) {
+		run->items[0]->decode(run->regs, &run->items[0]->current_val);
+		data_item_set_value(run->items[0]);
+	} else if (run->len > 1) {
+		decode_registers(run->bit_offset, run->endianness_type,
+				 run->regs, run->len, &vals);
+
+		for (i = 0; i < run->len; i++) {
+			data_item = run->items[i];
+			/* Zero extended, as done by the decode functions */
+			memset(&data_item->current_val, 0,
+			       sizeof(data_item->current_val));
+			if (run->bit_offset == TYPE_U32)
+				data_item->current_val.val_u64 = vals.u32[i];
+			else
+				data_item->current_val.val_u64 = vals.u64[i];
+			data_item_set_value(data_item);
+		}
+	}
+
+	run->len = 0;
+}
+
+/*
+ * Whether the value of the data item at regs follows the run: same layout
+ * and the next registers of the block.
+ */
+static bool decode_run_extends(const struct decode_run *run,
+			       const struct knot_data_item *data_item,
+			       const uint16_t *regs)
 {
+	const struct modbus_source *source = &data_item->modbus_source;
+
+	return run->len && run->len < DECODE_RUN_MAX &&
+		source->bit_offset == run->bit_offset &&
+		source->endianness_type_sensor == run->endianness_type &&
+		data_item->value_type != KNOT_VALUE_TYPE_RAW &&
+		regs == run->regs + run->len * (run->bit_offset / TYPE_U16);
+}
+
+static void decode_block(struct read_plan_block *block)
+{
+	const struct read_plan_entry *entry;
+	const struct l_queue_entry *qentry;
 	struct knot_data_item *data_item;
-	struct l_queue *list;
+	struct decode_run run = { .len = 0 };
+	const uint16_t *regs;
+	int bit_offset;
+
+	for (qentry = l_queue_get_entries(block->entries); qentry;
+			qentry = qentry->next) {
+		entry = qentry->data;
+
+		data_item = data_item_lookup(entry->id);
+		if (!data_item)
+			continue;
+
+		if (block->space == READ_PLAN_SPACE_BITS) {
+			data_item->decode((uint8_t *) block->buf +
+					  entry->offset,
+					  &data_item->current_val);
+			data_item_set_value(data_item);
+			continue;
+		}
+
+		regs = (uint16_t *) block->buf + entry->offset;
+		if (decode_run_extends(&run, data_item, regs)) {
+			run.items[run.len++] = data_item;
+			continue;
+		}
+
+		decode_run_flush(&run);
+
+		/* Runs of 32 and 64 bits values use decode_registers() */
+		bit_offset = data_item->modbus_source.bit_offset;
+		run.regs = regs;
+		run.bit_offset = bit_offset;
+		run.endianness_type =
+			data_item->modbus_source.endianness_type_sensor;
+		run.items[run.len++] = data_item;
+
+		if ((bit_offset != TYPE_U32 && bit_offset != TYPE_U64) ||
+				data_item->value_type == KNOT_VALUE_TYPE_RAW)
+			decode_run_flush(&run);
+	}
+
+	decode_run_flush(&run);
+}
+
+static void on_block_read(int rc, void *user_data)
+{
+	struct read_plan_block *block = user_data;
+
+	block->in_flight = false;
+
+	if (rc < 0)
+		return;
+
+	decode_block(block);
+
+	/* Blocks completed together are checked in a single pass */
+	if (!thing.evaluate_idle)
+		thing.evaluate_idle = l_idle_create(on_evaluate_idle, NULL,
+						    NULL);
+}
+
+static int on_modbus_poll_receive(int id)
+{
+	struct read_plan_block *block;
+	struct modbus_slave *slave;
 	int rc;
 
-	data_item = l_hashmap_lookup(thing.data_items, L_INT_TO_PTR(id));
-	if (!data_item)
+	block = read_plan_get_block(id);
+	if (!block)
 		return -EINVAL;
 
-	rc = iface_modbus_read_data(data_item->modbus_source.reg_addr,
-		data_item->modbus_source.bit_offset,
-		&data_item->current_val,
-		data_item->modbus_source.endianness_type_sensor);
-	if (event_check_value(data_item->event,
-			      data_item->current_val,
-			      data_item->sent_val,
-			      data_item->schema.value_type) > 0) {
-		data_item->sent_val = data_item->current_val;
-		list = l_queue_new();
-		l_queue_push_head(list, &id);
-
-		sm_input_event(EVT_PUB_DATA, list);
-
-		l_queue_destroy(list, NULL);
-	}
+	/* Slow slave: the previous read of this block is still pending */
+	if (block->in_flight)
+		return -EBUSY;
+
+	slave = &thing.modbus_slaves[block->slave];
+	if (block->space == READ_PLAN_SPACE_BITS)
+		rc = iface_modbus_read_bits(slave->bus, slave->id, block->addr,
+					    block->count, block->buf,
+					    on_block_read, block);
+	else
+		rc = iface_modbus_read_registers(slave->bus, slave->id,
+						 block->addr, block->count,
+						 block->buf, on_block_read,
+						 block);
+	if (rc < 0)
+		return rc;
 
-	return rc;
+	block->in_flight = true;
+
+	return 0;
 }
 
-static void foreach_data_item_polling(const void *key, void *value,
-				      void *user_data)
+static void foreach_data_item_plan(struct knot_data_item *data_item,
+				   void *user_data)
 {
-	struct knot_data_item *data_item = value;
 	int *rc = user_data;
 
-	if (poll_create(DEFAULT_POLLING_INTERVAL, data_item->sensor_id,
-			on_modbus_poll_receive)) {
-		l_error("Fail on create poll to read data item with id: %d",
+	if (read_plan_add_item(data_item->sensor_id,
+			       data_item->modbus_source.slave,
+			       data_item->modbus_source.reg_addr,
+			       data_item->modbus_source.bit_offset,
+			       data_item->polling_interval_ms)) {
+		l_error("Fail on planning the read of data item with id: %d",
 			data_item->sensor_id);
 		*rc = -1;
 	}
 }
 
+static void foreach_block_polling(int block_id, struct read_plan_block *block,
+				  void *user_data)
+{
+	int *rc = user_data;
+
+	if (poll_create(block->interval_ms, block_id, on_modbus_poll_receive)) {
+		l_error("Fail on create poll to read block at address: %d",
+			block->addr);
+		*rc = -1;
+	}
+}
+
 static int create_data_item_polling(void)
 {
+	int n_blocks;
 	int rc = 0;
 
-	l_hashmap_foreach(thing.data_items, foreach_data_item_polling,
-			  &rc);
+	foreach_data_item(foreach_data_item_plan, &rc);
 	if (rc)
-		poll_destroy();
+		goto error;
+
+	n_blocks = read_plan_build(thing.read_max_gap);
+	if (n_blocks < 0) {
+		rc = n_blocks;
+		goto error;
+	}
+
+	l_info("Polling %d data items with %d Modbus requests",
+	       thing.data_items_len, n_blocks);
+
+	read_plan_foreach_block(foreach_block_polling, &rc);
+	if (rc)
+		goto error;
+
+	return 0;
+
+error:
+	poll_destroy();
+	read_plan_destroy();
 
 	return rc;
 }
@@ -320,6 +804,21 @@ void device_set_log_priority(int priority)
 	knot_cloud_set_log_priority(priority);
 }
 
+/* One line per Modbus bus, with its connection counters */
+void device_log_stats(void)
+{
+	struct iface_modbus_stats stats;
+	int bus;
+
+	for (bus = 0; iface_modbus_get_stats(bus, &stats) == 0; bus++)
+		l_info("Modbus bus %d: %s, %u attempts, %u failures, "
+		       "%u disconnections, %u retries, next in %u ms", bus,
+		       stats.connected ? "connected" : "disconnected",
+		       stats.connect_attempts, stats.connect_failures,
+		       stats.disconnections, stats.retries,
+		       stats.retry_delay_ms);
+}
+
 char *device_get_id(void)
 {
 	return thing.id;
@@ -335,47 +834,193 @@ void device_set_thing_user_token(struct knot_thing *thing, char *token)
 	thing->user_token = token;
 }
 
-void device_set_thing_modbus_slave(struct knot_thing *thing, int slave_id,
-				   char *url)
+/* Returns the index data items refer to the slave with */
+int device_add_thing_modbus_slave(struct knot_thing *thing, int slave_id,
+				  char *url)
+{
+	struct modbus_slave *slave;
+
+	thing->modbus_slaves = l_realloc(thing->modbus_slaves,
+					 sizeof(*thing->modbus_slaves) *
+					 (thing->modbus_slaves_len + 1));
+	slave = &thing->modbus_slaves[thing->modbus_slaves_len];
+	slave->id = slave_id;
+	slave->url = url;
+	slave->bus = -1;
+
+	return thing->modbus_slaves_len++;
+}
+
+void device_set_thing_read_max_gap(struct knot_thing *thing, int max_gap)
+{
+	thing->read_max_gap = max_gap;
+}
+
+void device_set_thing_modbus_tcp_window(struct knot_thing *thing, int window)
+{
+	thing->modbus_tcp_window = window;
+}
+
+void device_set_thing_modbus_reconnect(struct knot_thing *thing,
+				       int initial_ms, int max_ms,
+				       float multiplier)
+{
+	thing->reconnect_initial_ms = initial_ms;
+	thing->reconnect_max_ms = max_ms;
+	thing->reconnect_multiplier = multiplier;
+}
+
+void device_set_thing_publish_window(struct knot_thing *thing, int window_ms)
+{
+	thing->publish_window_ms = window_ms;
+}
+
+void device_set_thing_offline_store(struct knot_thing *thing, char *path,
+				    int capacity, int replay_rate)
 {
-	thing->modbus_slave.id = slave_id;
-	thing->modbus_slave.url = url;
+	thing->offline_path = path;
+	thing->offline_capacity = capacity;
+	thing->offline_replay_rate = replay_rate;
+}
+
+/* Drops the slaves, data items and offline path read from the device file */
+void device_clear_thing_items(struct knot_thing *thing)
+{
+	int i;
+
+	event_batch_destroy();
+
+	for (i = 0; i < thing->modbus_slaves_len; i++)
+		l_free(thing->modbus_slaves[i].url);
+	l_free(thing->modbus_slaves);
+	thing->modbus_slaves = NULL;
+	thing->modbus_slaves_len = 0;
+
+	l_free(thing->data_items);
+	thing->data_items = NULL;
+	l_free(thing->data_item_schemas);
+	thing->data_item_schemas = NULL;
+	thing->data_items_len = 0;
+
+	l_free(thing->data_item_slots);
+	thing->data_item_slots = NULL;
+	thing->data_item_slots_len = 0;
+
+	l_free(thing->offline_path);
+	thing->offline_path = NULL;
 }
 
-void device_set_new_data_item(struct knot_thing *thing, int sensor_id,
-			      knot_schema schema, knot_event event,
-			      int reg_addr, int bit_offset, int endianness_type)
+static void data_item_slots_grow(struct knot_thing *thing, int sensor_id)
+{
+	int len = sensor_id + 1;
+	int i;
+
+	if (len <= thing->data_item_slots_len)
+		return;
+
+	thing->data_item_slots = l_realloc(thing->data_item_slots,
+					   sizeof(int) * len);
+	for (i = thing->data_item_slots_len; i < len; i++)
+		thing->data_item_slots[i] = -1;
+
+	thing->data_item_slots_len = len;
+}
+
+int device_set_new_data_item(struct knot_thing *thing, int sensor_id,
+			     knot_schema schema, knot_event event,
+			     const struct event_filter *filter, int slave,
+			     int reg_addr, int bit_offset, int endianness_type,
+			     int polling_interval_ms)
 {
 	struct knot_data_item *data_item_aux;
+	struct event_filter item_filter = *filter;
+	int slot = thing->data_items_len;
+	decode_func_t decode;
+
+	/* Bounds the slot table, snapshots are not checked by properties */
+	if (sensor_id < SCHEMA_MIN_SENSOR_ID ||
+			sensor_id > SCHEMA_MAX_SENSOR_ID) {
+		l_error("Data item %d: invalid sensor id", sensor_id);
+		return -EINVAL;
+	}
+
+	if (slave < 0 || slave >= thing->modbus_slaves_len) {
+		l_error("Data item %d: unknown Modbus slave", sensor_id);
+		return -EINVAL;
+	}
+
+	decode = decode_get_func(bit_offset, endianness_type,
+				 schema.value_type);
+	if (!decode) {
+		l_error("Data item %d: no decoder for %d bits of value type %d",
+			sensor_id, bit_offset, schema.value_type);
+		return -EINVAL;
+	}
+
+	if (schema.value_type == KNOT_VALUE_TYPE_RAW)
+		item_filter.raw_len = bit_offset / 8;
+
+	/* Both are appended in the same order: the batch slot is the slot */
+	if (event_batch_add(schema.value_type, &event, &item_filter) < 0) {
+		l_error("Data item %d: invalid value type %d", sensor_id,
+			schema.value_type);
+		return -EINVAL;
+	}
+
+	thing->data_items = l_realloc(thing->data_items,
+				      sizeof(*thing->data_items) * (slot + 1));
+	thing->data_item_schemas = l_realloc(thing->data_item_schemas,
+					     sizeof(knot_schema) * (slot + 1));
+	thing->data_items_len++;
 
-	data_item_aux = l_new(struct knot_data_item, 1);
+	data_item_aux = &thing->data_items[slot];
+	memset(data_item_aux, 0, sizeof(*data_item_aux));
 	data_item_aux->sensor_id = sensor_id;
-	data_item_aux->schema = schema;
+	data_item_aux->value_type = schema.value_type;
 	data_item_aux->event = event;
+	data_item_aux->event_filter = item_filter;
+	data_item_aux->decode = decode;
+	data_item_aux->modbus_source.slave = slave;
 	data_item_aux->modbus_source.reg_addr = reg_addr;
 	data_item_aux->modbus_source.bit_offset = bit_offset;
 	data_item_aux->modbus_source.endianness_type_sensor = endianness_type;
+	data_item_aux->polling_interval_ms = polling_interval_ms;
+	thing->data_item_schemas[slot] = schema;
+
+	data_item_slots_grow(thing, sensor_id);
+	thing->data_item_slots[sensor_id] = slot;
 
-	l_hashmap_insert(thing->data_items,
-			 L_INT_TO_PTR(data_item_aux->sensor_id),
-			 data_item_aux);
+	return 0;
 }
 
 void device_update_config_data_item(struct knot_thing *thing,
 				    knot_msg_config *config)
 {
 	struct knot_data_item *data_item;
+	knot_schema *schema;
+	decode_func_t decode;
 
-	data_item = l_hashmap_lookup(thing->data_items,
-				     L_INT_TO_PTR(config->sensor_id));
+	data_item = data_item_lookup(config->sensor_id);
 	if (!data_item)
 		return;
 
-	data_item->schema.type_id = config->schema.type_id;
-	data_item->schema.unit = config->schema.unit;
-	data_item->schema.value_type = config->schema.value_type;
-	strncpy(data_item->schema.name, config->schema.name,
+	decode = decode_get_func(data_item->modbus_source.bit_offset,
+			data_item->modbus_source.endianness_type_sensor,
+			config->schema.value_type);
+	if (!decode) {
+		l_error("Data item %d: no decoder for value type %d",
+			config->sensor_id, config->schema.value_type);
+		return;
+	}
+
+	schema = data_item_get_schema(data_item);
+	schema->type_id = config->schema.type_id;
+	schema->unit = config->schema.unit;
+	schema->value_type = config->schema.value_type;
+	strncpy(schema->name, config->schema.name,
 		KNOT_PROTOCOL_DATA_NAME_LEN);
+	data_item->value_type = config->schema.value_type;
+	data_item->decode = decode;
 
 	if (!(config->event.event_flags & KNOT_EVT_FLAG_UNREGISTERED)) {
 		data_item->event.event_flags = config->event.event_flags;
@@ -387,11 +1032,17 @@ void device_update_config_data_item(struct knot_thing *thing,
 					config->event.upper_limit,
 					&data_item->event.upper_limit);
 	}
+
+	/* Limits may have moved: report the zone found on next read */
+	event_batch_update(data_item - thing->data_items,
+			   data_item->value_type, &data_item->event,
+			   &data_item->event_filter);
+	event_update_data_item(data_item->sensor_id, data_item->event);
 }
 
 void *device_data_item_lookup(struct knot_thing *thing, int sensor_id)
 {
-	return l_hashmap_lookup(thing->data_items, L_INT_TO_PTR(sensor_id));
+	return data_item_lookup(sensor_id);
 }
 
 void device_set_thing_rabbitmq_url(struct knot_thing *thing, char *url)
@@ -406,6 +1057,12 @@ void device_set_thing_credentials(struct knot_thing *thing, const char *id,
 	strncpy(thing->token, token, KNOT_PROTOCOL_TOKEN_LEN);
 }
 
+void device_set_thing_schema_hash(struct knot_thing *thing,
+				  uint64_t schema_hash)
+{
+	thing->schema_hash = schema_hash;
+}
+
 void device_generate_thing_id(void)
 {
 	uint64_t id; /* knot id uses 16 characters which fits inside a uint64 */
@@ -460,7 +1117,7 @@ int device_start_event(void)
 		return rc;
 	}
 
-	l_hashmap_foreach(thing.data_items, foreach_event_add_data_item, NULL);
+	foreach_data_item(foreach_event_add_data_item, NULL);
 
 	return 0;
 }
@@ -472,19 +1129,40 @@ void device_stop_event(void)
 
 int device_update_config(struct l_queue *config_list)
 {
-	device_stop_event();
-
-	l_queue_foreach(config_list, foreach_update_config, NULL);
+	/* Only the timers of the items in the list are touched */
+	if (properties_update_data_items(&thing, thing.conf_files.device_path,
+					 config_list) < 0)
+		l_error("Couldn't store data items config");
 
-	device_start_event();
+	/* The config now matches the cloud's */
+	if (device_store_schema_on_file() < 0)
+		l_error("Couldn't store schema hash");
 
 	return 0;
 }
 
 int device_check_schema_change(void)
 {
-	/* TODO: Add schema change verification */
-	return 1;
+	return get_schema_hash() != thing.schema_hash;
+}
+
+int device_store_schema_on_file(void)
+{
+	uint64_t schema_hash = get_schema_hash();
+	int rc;
+
+	if (schema_hash == thing.schema_hash)
+		return 0;
+
+	rc = properties_store_schema_hash(&thing,
+					  thing.conf_files.credentials_path,
+					  schema_hash);
+	if (rc < 0)
+		return rc;
+
+	thing.schema_hash = schema_hash;
+
+	return 0;
 }
 
 int device_send_register_request(void)
@@ -504,7 +1182,7 @@ int device_send_config(void)
 
 	config_queue = l_queue_new();
 
-	l_hashmap_foreach(thing.data_items, foreach_send_config, config_queue);
+	foreach_data_item(foreach_send_config, config_queue);
 
 	rc = knot_cloud_update_config(thing.id, config_queue);
 
@@ -515,12 +1193,39 @@ int device_send_config(void)
 
 void device_publish_data_list(struct l_queue *sensor_id_list)
 {
-	l_queue_foreach(sensor_id_list, on_publish_data, NULL);
+	l_queue_foreach(sensor_id_list, on_publish_enqueue, NULL);
+	publish_schedule();
 }
 
 void device_publish_data_all(void)
 {
-	l_hashmap_foreach(thing.data_items, foreach_publish_all_data, NULL);
+	foreach_data_item(foreach_publish_all_data, NULL);
+	publish_schedule();
+}
+
+void device_store_data_list(struct l_queue *sensor_id_list)
+{
+	l_queue_foreach(sensor_id_list, on_store_data, NULL);
+}
+
+void device_start_offline_replay(void)
+{
+	if (offline_store_count())
+		l_info("Replaying %u offline readings (%u dropped)",
+		       offline_store_count(), offline_store_dropped());
+
+	thing.replay_enabled = true;
+	replay_schedule();
+}
+
+void device_stop_offline_replay(void)
+{
+	thing.replay_enabled = false;
+
+	if (thing.replay_to) {
+		l_timeout_remove(thing.replay_to);
+		thing.replay_to = NULL;
+	}
 }
 
 void device_msg_timeout_create(int seconds)
@@ -547,16 +1252,73 @@ int device_start_read_cloud(void)
 	return knot_cloud_read_start(thing.id, on_cloud_receive, NULL);
 }
 
+static void open_offline_store(const char *credentials_path)
+{
+	const char *dir_end;
+	int err;
+
+	if (!thing.offline_capacity)
+		return;
+
+	if (!thing.offline_path) {
+		dir_end = strrchr(credentials_path, '/');
+		thing.offline_path = dir_end ?
+			l_strdup_printf("%.*s/%s",
+					(int) (dir_end - credentials_path),
+					credentials_path,
+					OFFLINE_STORE_DEFAULT_FILE) :
+			l_strdup(OFFLINE_STORE_DEFAULT_FILE);
+	}
+
+	/* Not fatal: readings taken while offline are just not kept */
+	err = offline_store_open(thing.offline_path, thing.offline_capacity);
+	if (err < 0)
+		l_warn("Failed to open offline store %s: %s",
+		       thing.offline_path, strerror(-err));
+}
+
+static int start_modbus(void)
+{
+	struct iface_modbus_options options = {
+		.tcp_window = thing.modbus_tcp_window,
+		.reconnect_initial_ms = thing.reconnect_initial_ms,
+		.reconnect_max_ms = thing.reconnect_max_ms,
+		.reconnect_multiplier = thing.reconnect_multiplier
+	};
+	struct modbus_slave *slave;
+	int err;
+	int i;
+
+	for (i = 0; i < thing.modbus_slaves_len; i++) {
+		slave = &thing.modbus_slaves[i];
+		slave->bus = iface_modbus_add_bus(slave->url);
+		if (slave->bus < 0) {
+			l_error("Invalid Modbus URL %s", slave->url);
+			iface_modbus_stop();
+			return slave->bus;
+		}
+	}
+
+	err = iface_modbus_start(&options, on_modbus_connected,
+				 on_modbus_disconnected, NULL);
+	if (err < 0)
+		iface_modbus_stop();
+
+	return err;
+}
+
 int device_start(struct device_settings *conf_files)
 {
 	int err;
 
-	thing.data_items = l_hashmap_new();
+	thing.publish_queue = l_queue_new();
 	if (properties_create_device(&thing, conf_files)) {
 		l_error("Failed to set device properties");
 		return -EINVAL;
 	}
 
+	open_offline_store(conf_files->credentials_path);
+
 	sm_start();
 
 	err = create_data_item_polling();
@@ -566,12 +1328,11 @@ int device_start(struct device_settings *conf_files)
 		return err;
 	}
 
-	err = iface_modbus_start(thing.modbus_slave.url, thing.modbus_slave.id,
-				 on_modbus_connected, on_modbus_disconnected,
-				 NULL);
+	err = start_modbus();
 	if (err < 0) {
 		l_error("Failed to initialize Modbus");
 		poll_destroy();
+		read_plan_destroy();
 		knot_thing_destroy(&thing);
 		return err;
 	}
@@ -582,6 +1343,7 @@ int device_start(struct device_settings *conf_files)
 		l_error("Failed to initialize Cloud");
 		poll_destroy();
 		iface_modbus_stop();
+		read_plan_destroy();
 		knot_thing_destroy(&thing);
 		return err;
 	}
@@ -602,7 +1364,9 @@ void device_destroy(void)
 
 	poll_destroy();
 	knot_cloud_stop();
+	/* Stops the Modbus worker before releasing the block buffers */
 	iface_modbus_stop();
+	read_plan_destroy();
 
 	knot_thing_destroy(&thing);
 }
@@ -20,6 +20,7 @@
 
 struct knot_data_item;
 struct knot_thing;
+struct event_filter;
 
 struct device_settings {
 	char *credentials_path;
@@ -30,18 +31,30 @@ struct device_settings {
 void device_set_log_priority(int priority);
 void device_set_thing_name(struct knot_thing *thing, const char *name);
 void device_set_thing_user_token(struct knot_thing *thing, char *token);
-void device_set_thing_modbus_slave(struct knot_thing *thing, int slave_id,
-				   char *url);
-void device_set_new_data_item(struct knot_thing *thing, int sensor_id,
-			      knot_schema schema, knot_event event,
-			      int reg_addr, int bit_offset,
-			      int endianness_type);
+int device_add_thing_modbus_slave(struct knot_thing *thing, int slave_id,
+				  char *url);
+void device_set_thing_read_max_gap(struct knot_thing *thing, int max_gap);
+void device_set_thing_modbus_tcp_window(struct knot_thing *thing, int window);
+void device_set_thing_modbus_reconnect(struct knot_thing *thing,
+				       int initial_ms, int max_ms,
+				       float multiplier);
+void device_set_thing_publish_window(struct knot_thing *thing, int window_ms);
+void device_set_thing_offline_store(struct knot_thing *thing, char *path,
+				    int capacity, int replay_rate);
+void device_clear_thing_items(struct knot_thing *thing);
+int device_set_new_data_item(struct knot_thing *thing, int sensor_id,
+			     knot_schema schema, knot_event event,
+			     const struct event_filter *filter, int slave,
+			     int reg_addr, int bit_offset,
+			     int endianness_type, int polling_interval_ms);
 void device_update_config_data_item(struct knot_thing *thing,
 				    knot_msg_config *config);
 void *device_data_item_lookup(struct knot_thing *thing, int sensor_id);
 void device_set_thing_rabbitmq_url(struct knot_thing *thing, char *url);
 void device_set_thing_credentials(struct knot_thing *thing, const char *id,
 				  const char *token);
+void device_set_thing_schema_hash(struct knot_thing *thing,
+				  uint64_t schema_hash);
 void device_generate_thing_id(void);
 void device_clear_thing_id(struct knot_thing *thing);
 void device_clear_thing_token(struct knot_thing *thing);
@@ -55,12 +68,16 @@ void device_stop_event(void);
 int device_update_config(struct l_queue *config_list);
 
 int device_check_schema_change(void);
+int device_store_schema_on_file(void);
 
 int device_send_register_request(void);
 int device_send_auth_request(void);
 int device_send_config(void);
 void device_publish_data_list(struct l_queue *sensor_id_list);
 void device_publish_data_all(void);
+void device_store_data_list(struct l_queue *sensor_id_list);
+void device_start_offline_replay(void);
+void device_stop_offline_replay(void);
 
 void device_msg_timeout_create(int seconds);
 void device_msg_timeout_modify(int seconds);
@@ -69,4 +86,5 @@ void device_msg_timeout_remove(void);
 int device_start_read_cloud(void);
 
 int device_start(struct device_settings *conf_files);
+void device_log_stats(void);
 void device_destroy(void);
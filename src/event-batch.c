@@ -0,0 +1,645 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Batch event evaluation source file
+ *
+ *  Makes the same decisions as event_check_value() for every data item
+ *  read since the last evaluation. Items are grouped by value type and
+ *  each group keeps one array per field, so thresholds and changes are
+ *  checked several items at a time with vector compares. Masks replace
+ *  the branches of the scalar path. RAW items go through the scalar path.
+ *
+ *  Items are identified by their slot, the order they were added in.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <knot/knot_protocol.h>
+#include <knot/knot_types.h>
+#include <ell/ell.h>
+
+#include "event.h"
+#include "event-batch.h"
+
+#define VECTOR_SIZE		16
+/* Multiple of the lanes of every vector type */
+#define GROUP_MIN_CAP		16
+
+enum lane_column {
+	COL_CURRENT,
+	COL_SENT,
+	COL_UPPER,
+	COL_LOWER,
+	COL_UPPER_EXIT,
+	COL_LOWER_EXIT,
+	/* Masks: all bits set or cleared */
+	COL_UPPER_EN,
+	COL_LOWER_EN,
+	COL_CHANGE_EN,
+	COL_BAND_EN,
+	COL_DIRTY,
+	COL_ZONE,
+	COL_LANE_MAX
+};
+
+/*
+ * Items of a value type. Lanes are 32 or 64 bits wide depending on the
+ * type and the columns are padded up to cap with items that are never
+ * dirty, so the vector loop needs no tail.
+ */
+struct batch_group {
+	unsigned int len;
+	unsigned int cap;
+	unsigned int dirty;
+	int *slots;
+	void *cols[COL_LANE_MAX];
+	double *band_abs;
+	double *band_pct;
+};
+
+struct raw_item {
+	int slot;
+	bool dirty;
+	enum event_zone zone;
+	knot_event event;
+	struct event_filter filter;
+	knot_value_type current;
+	knot_value_type sent;
+};
+
+struct slot_ref {
+	int value_type;
+	unsigned int index;
+};
+
+typedef int (*group_evaluate_func_t) (struct batch_group *group,
+				      uint64_t *publish);
+
+static struct batch_group groups[KNOT_VALUE_TYPE_MAX + 1];
+static struct raw_item *raw_items;
+static unsigned int raw_items_len;
+static struct slot_ref *slot_refs;
+static int slots_len;
+
+static size_t lane_size(int value_type)
+{
+	if (value_type == KNOT_VALUE_TYPE_INT64 ||
+			value_type == KNOT_VALUE_TYPE_UINT64)
+		return sizeof(uint64_t);
+
+	return sizeof(uint32_t);
+}
+
+static void lane_set_value(int value_type, void *col, unsigned int index,
+			   const knot_value_type *value)
+{
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		((int32_t *) col)[index] = value->val_i;
+		break;
+	case KNOT_VALUE_TYPE_UINT:
+		((uint32_t *) col)[index] = value->val_u;
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		((uint32_t *) col)[index] = value->val_b;
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		((float *) col)[index] = value->val_f;
+		break;
+	case KNOT_VALUE_TYPE_INT64:
+		((int64_t *) col)[index] = value->val_i64;
+		break;
+	case KNOT_VALUE_TYPE_UINT64:
+		((uint64_t *) col)[index] = value->val_u64;
+		break;
+	}
+}
+
+static knot_value_type lane_get_value(int value_type, const void *col,
+				      unsigned int index)
+{
+	knot_value_type value;
+
+	memset(&value, 0, sizeof(value));
+
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		value.val_i = ((const int32_t *) col)[index];
+		break;
+	case KNOT_VALUE_TYPE_UINT:
+		value.val_u = ((const uint32_t *) col)[index];
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		value.val_b = ((const uint32_t *) col)[index];
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		value.val_f = ((const float *) col)[index];
+		break;
+	case KNOT_VALUE_TYPE_INT64:
+		value.val_i64 = ((const int64_t *) col)[index];
+		break;
+	case KNOT_VALUE_TYPE_UINT64:
+		value.val_u64 = ((const uint64_t *) col)[index];
+		break;
+	}
+
+	return value;
+}
+
+static void lane_set_int(void *col, size_t size, unsigned int index,
+			 int64_t val)
+{
+	if (size == sizeof(int32_t))
+		((int32_t *) col)[index] = val;
+	else
+		((int64_t *) col)[index] = val;
+}
+
+static int64_t lane_get_int(const void *col, size_t size, unsigned int index)
+{
+	if (size == sizeof(int32_t))
+		return ((const int32_t *) col)[index];
+
+	return ((const int64_t *) col)[index];
+}
+
+static void group_grow(struct batch_group *group, size_t size)
+{
+	unsigned int cap = group->cap ? group->cap * 2 : GROUP_MIN_CAP;
+	int col;
+
+	for (col = 0; col < COL_LANE_MAX; col++) {
+		group->cols[col] = l_realloc(group->cols[col], size * cap);
+		memset((uint8_t *) group->cols[col] + size * group->cap, 0,
+		       size * (cap - group->cap));
+	}
+
+	group->slots = l_realloc(group->slots, sizeof(int) * cap);
+	group->band_abs = l_realloc(group->band_abs, sizeof(double) * cap);
+	group->band_pct = l_realloc(group->band_pct, sizeof(double) * cap);
+	memset(group->band_abs + group->cap, 0,
+	       sizeof(double) * (cap - group->cap));
+	memset(group->band_pct + group->cap, 0,
+	       sizeof(double) * (cap - group->cap));
+	group->cap = cap;
+}
+
+static void group_set_event(struct batch_group *group, int value_type,
+			    unsigned int index, const knot_event *event,
+			    const struct event_filter *filter)
+{
+	size_t size = lane_size(value_type);
+	knot_value_type upper_exit;
+	knot_value_type lower_exit;
+	bool band;
+
+	event_get_exit_limits(event, filter, value_type, &upper_exit,
+			      &lower_exit);
+
+	lane_set_value(value_type, group->cols[COL_UPPER], index,
+		       &event->upper_limit);
+	lane_set_value(value_type, group->cols[COL_LOWER], index,
+		       &event->lower_limit);
+	lane_set_value(value_type, group->cols[COL_UPPER_EXIT], index,
+		       &upper_exit);
+	lane_set_value(value_type, group->cols[COL_LOWER_EXIT], index,
+		       &lower_exit);
+
+	lane_set_int(group->cols[COL_UPPER_EN], size, index,
+		     event->event_flags & KNOT_EVT_FLAG_UPPER_THRESHOLD ?
+		     -1 : 0);
+	lane_set_int(group->cols[COL_LOWER_EN], size, index,
+		     event->event_flags & KNOT_EVT_FLAG_LOWER_THRESHOLD ?
+		     -1 : 0);
+	lane_set_int(group->cols[COL_CHANGE_EN], size, index,
+		     event->event_flags & KNOT_EVT_FLAG_CHANGE ? -1 : 0);
+
+	/* Booleans can't be turned into a number, see is_value_changed() */
+	band = value_type != KNOT_VALUE_TYPE_BOOL &&
+		(filter->deadband_abs || filter->deadband_pct);
+	lane_set_int(group->cols[COL_BAND_EN], size, index, band ? -1 : 0);
+	group->band_abs[index] = filter->deadband_abs;
+	group->band_pct[index] = filter->deadband_pct;
+
+	lane_set_int(group->cols[COL_ZONE], size, index, EVENT_ZONE_NORMAL);
+}
+
+static unsigned int group_add(struct batch_group *group, int value_type,
+			      int slot, const knot_event *event,
+			      const struct event_filter *filter,
+			      const knot_value_type *sent)
+{
+	size_t size = lane_size(value_type);
+	unsigned int index = group->len;
+	int col;
+
+	if (group->len == group->cap)
+		group_grow(group, size);
+
+	group->len++;
+	group->slots[index] = slot;
+
+	for (col = 0; col < COL_LANE_MAX; col++)
+		memset((uint8_t *) group->cols[col] + size * index, 0, size);
+
+	group_set_event(group, value_type, index, event, filter);
+	lane_set_value(value_type, group->cols[COL_SENT], index, sent);
+
+	return index;
+}
+
+static void group_remove(struct batch_group *group, int value_type,
+			 unsigned int index)
+{
+	size_t size = lane_size(value_type);
+	unsigned int last = group->len - 1;
+	uint8_t *base;
+	int col;
+
+	if (lane_get_int(group->cols[COL_DIRTY], size, index))
+		group->dirty--;
+
+	/* Move the last item into the hole, then clear its old lanes */
+	for (col = 0; col < COL_LANE_MAX; col++) {
+		base = group->cols[col];
+		memcpy(base + size * index, base + size * last, size);
+		memset(base + size * last, 0, size);
+	}
+
+	group->slots[index] = group->slots[last];
+	group->band_abs[index] = group->band_abs[last];
+	group->band_pct[index] = group->band_pct[last];
+	slot_refs[group->slots[index]].index = index;
+	group->len--;
+}
+
+static unsigned int raw_add(int slot, const knot_event *event,
+			    const struct event_filter *filter,
+			    const knot_value_type *sent)
+{
+	struct raw_item *item;
+
+	raw_items = l_realloc(raw_items,
+			      sizeof(*raw_items) * (raw_items_len + 1));
+	item = &raw_items[raw_items_len];
+	memset(item, 0, sizeof(*item));
+	item->slot = slot;
+	item->zone = EVENT_ZONE_NORMAL;
+	item->event = *event;
+	item->filter = *filter;
+	item->sent = *sent;
+
+	return raw_items_len++;
+}
+
+static void raw_remove(unsigned int index)
+{
+	raw_items[index] = raw_items[--raw_items_len];
+	slot_refs[raw_items[index].slot].index = index;
+}
+
+static void item_insert(int slot, int value_type, const knot_event *event,
+			const struct event_filter *filter,
+			const knot_value_type *sent)
+{
+	unsigned int index;
+
+	if (value_type == KNOT_VALUE_TYPE_RAW)
+		index = raw_add(slot, event, filter, sent);
+	else
+		index = group_add(&groups[value_type], value_type, slot,
+				  event, filter, sent);
+
+	slot_refs[slot].value_type = value_type;
+	slot_refs[slot].index = index;
+}
+
+/* Returns whether the item had a value not evaluated yet, in current */
+static bool item_remove(int slot, knot_value_type *sent,
+			knot_value_type *current)
+{
+	struct slot_ref *ref = &slot_refs[slot];
+	struct batch_group *group = &groups[ref->value_type];
+	size_t size = lane_size(ref->value_type);
+	bool dirty;
+
+	if (ref->value_type == KNOT_VALUE_TYPE_RAW) {
+		*sent = raw_items[ref->index].sent;
+		*current = raw_items[ref->index].current;
+		dirty = raw_items[ref->index].dirty;
+		raw_remove(ref->index);
+	} else {
+		*sent = lane_get_value(ref->value_type, group->cols[COL_SENT],
+				       ref->index);
+		*current = lane_get_value(ref->value_type,
+					  group->cols[COL_CURRENT],
+					  ref->index);
+		dirty = lane_get_int(group->cols[COL_DIRTY], size, ref->index);
+		group_remove(group, ref->value_type, ref->index);
+	}
+
+	return dirty;
+}
+
+static void publish_set(uint64_t *publish, int slot)
+{
+	publish[slot / 64] |= UINT64_C(1) << (slot % 64);
+}
+
+/*
+ * Vector version of get_zone() and is_value_changed() for one lane type.
+ * Lanes are selected with masks: compares set all the bits of a lane.
+ */
+#define DEFINE_GROUP_EVALUATE(name, type, mask_type)			\
+static int name(struct batch_group *group, uint64_t *publish)		\
+{									\
+	typedef type vec_t __attribute__((vector_size(VECTOR_SIZE)));	\
+	typedef mask_type mask_t					\
+			__attribute__((vector_size(VECTOR_SIZE)));	\
+	typedef double dvec_t __attribute__((vector_size(		\
+			VECTOR_SIZE / sizeof(type) * sizeof(double))));	\
+	typedef int64_t lvec_t __attribute__((vector_size(		\
+			VECTOR_SIZE / sizeof(type) * sizeof(double))));	\
+	const unsigned int lanes = VECTOR_SIZE / sizeof(type);		\
+	vec_t cur, sent, upper, lower, upper_exit, lower_exit;		\
+	mask_t upper_en, lower_en, change_en, band_en, dirty, zone;	\
+	mask_t stay_above, stay_below, above, below, new_zone;		\
+	mask_t changed, banded, pub;					\
+	dvec_t cur_d, sent_d, diff, rel, band, band_abs, band_pct;	\
+	lvec_t wider;							\
+	unsigned int i;							\
+	unsigned int j;							\
+	int count = 0;							\
+									\
+	for (i = 0; i < group->len; i += lanes) {			\
+		memcpy(&dirty, (type *) group->cols[COL_DIRTY] + i,	\
+		       sizeof(dirty));					\
+		memcpy(&cur, (type *) group->cols[COL_CURRENT] + i,	\
+		       sizeof(cur));					\
+		memcpy(&sent, (type *) group->cols[COL_SENT] + i,	\
+		       sizeof(sent));					\
+		memcpy(&upper, (type *) group->cols[COL_UPPER] + i,	\
+		       sizeof(upper));					\
+		memcpy(&lower, (type *) group->cols[COL_LOWER] + i,	\
+		       sizeof(lower));					\
+		memcpy(&upper_exit,					\
+		       (type *) group->cols[COL_UPPER_EXIT] + i,	\
+		       sizeof(upper_exit));				\
+		memcpy(&lower_exit,					\
+		       (type *) group->cols[COL_LOWER_EXIT] + i,	\
+		       sizeof(lower_exit));				\
+		memcpy(&upper_en, (type *) group->cols[COL_UPPER_EN] + i, \
+		       sizeof(upper_en));				\
+		memcpy(&lower_en, (type *) group->cols[COL_LOWER_EN] + i, \
+		       sizeof(lower_en));				\
+		memcpy(&change_en,					\
+		       (type *) group->cols[COL_CHANGE_EN] + i,		\
+		       sizeof(change_en));				\
+		memcpy(&band_en, (type *) group->cols[COL_BAND_EN] + i,	\
+		       sizeof(band_en));				\
+		memcpy(&zone, (type *) group->cols[COL_ZONE] + i,	\
+		       sizeof(zone));					\
+		memcpy(&band_abs, group->band_abs + i, sizeof(band_abs)); \
+		memcpy(&band_pct, group->band_pct + i, sizeof(band_pct)); \
+									\
+		/* Thresholds, see get_zone() */			\
+		stay_above = (zone == EVENT_ZONE_ABOVE) & upper_en &	\
+			(cur > upper_exit);				\
+		stay_below = (zone == EVENT_ZONE_BELOW) & lower_en &	\
+			(cur < lower_exit);				\
+		above = stay_above |					\
+			(~stay_below & upper_en & (cur > upper));	\
+		below = ~above &					\
+			(stay_below | (lower_en & (cur < lower)));	\
+		new_zone = (above & EVENT_ZONE_ABOVE) |			\
+			(below & EVENT_ZONE_BELOW);			\
+									\
+		/* Changes, see is_value_changed() */			\
+		cur_d = __builtin_convertvector(cur, dvec_t);		\
+		sent_d = __builtin_convertvector(sent, dvec_t);		\
+		diff = (dvec_t) ((lvec_t) (cur_d - sent_d) & INT64_MAX); \
+		rel = (dvec_t) ((lvec_t) sent_d & INT64_MAX) *		\
+			band_pct / 100;					\
+		wider = rel > band_abs;					\
+		band = (dvec_t) (((lvec_t) rel & wider) |		\
+				 ((lvec_t) band_abs & ~wider));		\
+		banded = __builtin_convertvector(diff > band, mask_t);	\
+		changed = (band_en & banded) |				\
+			(~band_en & ((cur < sent) | (cur > sent)));	\
+									\
+		pub = dirty & ((change_en & changed) | (new_zone != zone)); \
+		sent = (vec_t) (((mask_t) cur & pub) |			\
+				((mask_t) sent & ~pub));		\
+		zone = (new_zone & dirty) | (zone & ~dirty);		\
+									\
+		memcpy((type *) group->cols[COL_SENT] + i, &sent,	\
+		       sizeof(sent));					\
+		memcpy((type *) group->cols[COL_ZONE] + i, &zone,	\
+		       sizeof(zone));					\
+		memset((type *) group->cols[COL_DIRTY] + i, 0,		\
+		       sizeof(dirty));					\
+									\
+		for (j = 0; j < lanes; j++) {				\
+			if (!pub[j])					\
+				continue;				\
+									\
+			publish_set(publish, group->slots[i + j]);	\
+			count++;					\
+		}							\
+	}								\
+									\
+	group->dirty = 0;						\
+									\
+	return count;							\
+}
+
+DEFINE_GROUP_EVALUATE(evaluate_int, int32_t, int32_t)
+DEFINE_GROUP_EVALUATE(evaluate_uint, uint32_t, int32_t)
+DEFINE_GROUP_EVALUATE(evaluate_float, float, int32_t)
+DEFINE_GROUP_EVALUATE(evaluate_int64, int64_t, int64_t)
+DEFINE_GROUP_EVALUATE(evaluate_uint64, uint64_t, int64_t)
+
+static const group_evaluate_func_t evaluate_funcs[] = {
+	[KNOT_VALUE_TYPE_INT] = evaluate_int,
+	[KNOT_VALUE_TYPE_FLOAT] = evaluate_float,
+	[KNOT_VALUE_TYPE_BOOL] = evaluate_uint,
+	[KNOT_VALUE_TYPE_INT64] = evaluate_int64,
+	[KNOT_VALUE_TYPE_UINT] = evaluate_uint,
+	[KNOT_VALUE_TYPE_UINT64] = evaluate_uint64
+};
+
+static int evaluate_raw(uint64_t *publish)
+{
+	struct raw_item *item;
+	unsigned int i;
+	int count = 0;
+
+	for (i = 0; i < raw_items_len; i++) {
+		item = &raw_items[i];
+		if (!item->dirty)
+			continue;
+
+		item->dirty = false;
+		if (event_check_value(item->event, &item->filter,
+				      item->current, item->sent,
+				      KNOT_VALUE_TYPE_RAW, &item->zone) <= 0)
+			continue;
+
+		item->sent = item->current;
+		publish_set(publish, item->slot);
+		count++;
+	}
+
+	return count;
+}
+
+static bool is_value_type_valid(int value_type)
+{
+	return value_type >= KNOT_VALUE_TYPE_MIN &&
+		value_type <= KNOT_VALUE_TYPE_MAX;
+}
+
+/* Returns the slot of the new item */
+int event_batch_add(int value_type, const knot_event *event,
+		    const struct event_filter *filter)
+{
+	knot_value_type sent;
+	int slot = slots_len;
+
+	if (!is_value_type_valid(value_type))
+		return -EINVAL;
+
+	slot_refs = l_realloc(slot_refs, sizeof(*slot_refs) * (slot + 1));
+	slots_len++;
+
+	memset(&sent, 0, sizeof(sent));
+	item_insert(slot, value_type, event, filter, &sent);
+
+	return slot;
+}
+
+/*
+ * The last sent value is kept, the item starts over from the normal zone.
+ * A value read but not evaluated yet is evaluated under the new event,
+ * unless the value type changed as it was decoded as the old type.
+ */
+int event_batch_update(int slot, int value_type, const knot_event *event,
+		       const struct event_filter *filter)
+{
+	knot_value_type sent;
+	knot_value_type current;
+	int old_type;
+	bool dirty;
+
+	if (slot < 0 || slot >= slots_len || !is_value_type_valid(value_type))
+		return -EINVAL;
+
+	old_type = slot_refs[slot].value_type;
+	dirty = item_remove(slot, &sent, &current);
+	item_insert(slot, value_type, event, filter, &sent);
+
+	if (dirty && value_type == old_type)
+		event_batch_set_value(slot, &current);
+
+	return 0;
+}
+
+/* Sets the value read for an item, checked on the next evaluation */
+int event_batch_set_value(int slot, const knot_value_type *value)
+{
+	struct slot_ref *ref;
+	struct batch_group *group;
+	size_t size;
+
+	if (slot < 0 || slot >= slots_len)
+		return -EINVAL;
+
+	ref = &slot_refs[slot];
+
+	if (ref->value_type == KNOT_VALUE_TYPE_RAW) {
+		raw_items[ref->index].current = *value;
+		raw_items[ref->index].dirty = true;
+		return 0;
+	}
+
+	group = &groups[ref->value_type];
+	size = lane_size(ref->value_type);
+
+	lane_set_value(ref->value_type, group->cols[COL_CURRENT], ref->index,
+		       value);
+	if (!lane_get_int(group->cols[COL_DIRTY], size, ref->index)) {
+		lane_set_int(group->cols[COL_DIRTY], size, ref->index, -1);
+		group->dirty++;
+	}
+
+	return 0;
+}
+
+/*
+ * Evaluates the items set since the last call. The bit of an item is set
+ * in publish, EVENT_BATCH_BITMAP_LEN() words, when its value must be sent.
+ * Its last sent value is then updated. Returns the number of bits set.
+ */
+int event_batch_evaluate(uint64_t *publish)
+{
+	struct batch_group *group;
+	int value_type;
+	int count = 0;
+
+	memset(publish, 0,
+	       sizeof(*publish) * EVENT_BATCH_BITMAP_LEN(slots_len));
+
+	for (value_type = KNOT_VALUE_TYPE_MIN;
+			value_type <= KNOT_VALUE_TYPE_MAX; value_type++) {
+		group = &groups[value_type];
+		if (value_type == KNOT_VALUE_TYPE_RAW || !group->dirty)
+			continue;
+
+		count += evaluate_funcs[value_type](group, publish);
+	}
+
+	return count + evaluate_raw(publish);
+}
+
+void event_batch_destroy(void)
+{
+	struct batch_group *group;
+	int value_type;
+	int col;
+
+	for (value_type = 0; value_type <= KNOT_VALUE_TYPE_MAX;
+							value_type++) {
+		group = &groups[value_type];
+		for (col = 0; col < COL_LANE_MAX; col++)
+			l_free(group->cols[col]);
+
+		l_free(group->slots);
+		l_free(group->band_abs);
+		l_free(group->band_pct);
+		memset(group, 0, sizeof(*group));
+	}
+
+	l_free(raw_items);
+	raw_items = NULL;
+	raw_items_len = 0;
+
+	l_free(slot_refs);
+	slot_refs = NULL;
+	slots_len = 0;
+}
@@ -0,0 +1,30 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Batch event evaluation header file
+ */
+
+/* Words of the bitmap filled by event_batch_evaluate() for n items */
+#define EVENT_BATCH_BITMAP_LEN(n)	(((n) + 63) / 64)
+
+int event_batch_add(int value_type, const knot_event *event,
+		    const struct event_filter *filter);
+int event_batch_update(int slot, int value_type, const knot_event *event,
+		       const struct event_filter *filter);
+int event_batch_set_value(int slot, const knot_value_type *value);
+int event_batch_evaluate(uint64_t *publish);
+void event_batch_destroy(void);
@@ -15,7 +15,9 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <errno.h>
 #include <knot/knot_protocol.h>
 #include <knot/knot_types.h>
@@ -30,81 +32,146 @@
 #define is_lower_flag_set(a) ((a) & KNOT_EVT_FLAG_LOWER_THRESHOLD)
 #define is_upper_flag_set(a) ((a) & KNOT_EVT_FLAG_UPPER_THRESHOLD)
 
-struct data_item_timeout {
-	int id;
-	unsigned int timeout_sec;
+/* Time triggered data items sharing a period, reported together */
+struct time_bucket {
+	unsigned int period_sec;
+	struct l_timeout *to;
+	struct l_queue *ids;
 };
 
-struct l_queue *sensor_timeouts;
+struct l_queue *time_buckets;
 timeout_cb_t timeout_cb;
-static bool active;
 
-static int compare_int(int val1, int val2)
+typedef int (*compare_func_t) (const knot_value_type *val1,
+			       const knot_value_type *val2);
+
+static int compare_int(const knot_value_type *val1,
+		       const knot_value_type *val2)
 {
-	if (val1 < val2)
-		return -1;
-	if (val1 > val2)
-		return 1;
+	return (val1->val_i > val2->val_i) - (val1->val_i < val2->val_i);
+}
 
-	return 0;
+static int compare_uint(const knot_value_type *val1,
+			const knot_value_type *val2)
+{
+	return (val1->val_u > val2->val_u) - (val1->val_u < val2->val_u);
 }
 
-static int compare_float(float val1, float val2)
+static int compare_int64(const knot_value_type *val1,
+			 const knot_value_type *val2)
 {
-	if (val1 < val2)
-		return -1;
-	if (val1 > val2)
-		return 1;
+	return (val1->val_i64 > val2->val_i64) -
+		(val1->val_i64 < val2->val_i64);
+}
 
-	return 0;
+static int compare_uint64(const knot_value_type *val1,
+			  const knot_value_type *val2)
+{
+	return (val1->val_u64 > val2->val_u64) -
+		(val1->val_u64 < val2->val_u64);
 }
 
-static int compare_bool(bool val1, bool val2)
+static int compare_float(const knot_value_type *val1,
+			 const knot_value_type *val2)
 {
-	if (val1 == false && val2 == true)
-		return -1;
-	if (val1 == true && val2 == false)
-		return 1;
+	return (val1->val_f > val2->val_f) - (val1->val_f < val2->val_f);
+}
 
-	return 0;
+static int compare_bool(const knot_value_type *val1,
+			const knot_value_type *val2)
+{
+	return (val1->val_b > val2->val_b) - (val1->val_b < val2->val_b);
 }
 
-static int compare_raw(unsigned char *val1, unsigned char *val2)
+static int compare_raw(const uint8_t *val1, const uint8_t *val2, int len)
 {
-	/* TODO: compare raw */
-	return 1;
+	int rc;
+
+	if (len <= 0 || len > KNOT_DATA_RAW_SIZE)
+		len = KNOT_DATA_RAW_SIZE;
+
+	rc = memcmp(val1, val2, len);
+
+	return (rc > 0) - (rc < 0);
 }
 
+static int compare_raw_value(const knot_value_type *val1,
+			     const knot_value_type *val2)
+{
+	return compare_raw(val1->raw, val2->raw, KNOT_DATA_RAW_SIZE);
+}
+
+/* Indexed by value type, checked by event_check_value() */
+static const compare_func_t compare_funcs[KNOT_VALUE_TYPE_MAX + 1] = {
+	[KNOT_VALUE_TYPE_INT] = compare_int,
+	[KNOT_VALUE_TYPE_FLOAT] = compare_float,
+	[KNOT_VALUE_TYPE_BOOL] = compare_bool,
+	[KNOT_VALUE_TYPE_RAW] = compare_raw_value,
+	[KNOT_VALUE_TYPE_INT64] = compare_int64,
+	[KNOT_VALUE_TYPE_UINT] = compare_uint,
+	[KNOT_VALUE_TYPE_UINT64] = compare_uint64
+};
+
 static int compare_knot_value(knot_value_type val1, knot_value_type val2,
 			      int value_type)
 {
-	int rc;
+	return compare_funcs[value_type](&val1, &val2);
+}
+
+static bool is_value_equal(knot_value_type new_value,
+			   knot_value_type old_value,
+			   int value_type)
+{
+	return compare_knot_value(new_value, old_value, value_type) == 0;
+}
 
+static bool value_to_double(knot_value_type value, int value_type,
+			    double *out)
+{
 	switch (value_type) {
 	case KNOT_VALUE_TYPE_INT:
-		rc = compare_int(val1.val_i, val2.val_i);
+		*out = value.val_i;
 		break;
-	case KNOT_VALUE_TYPE_FLOAT:
-		rc = compare_float(val1.val_f, val2.val_f);
+	case KNOT_VALUE_TYPE_UINT:
+		*out = value.val_u;
+		break;
+	case KNOT_VALUE_TYPE_INT64:
+		*out = value.val_i64;
 		break;
-	case KNOT_VALUE_TYPE_BOOL:
-		rc = compare_bool(val1.val_b, val2.val_b);
+	case KNOT_VALUE_TYPE_UINT64:
+		*out = value.val_u64;
 		break;
-	case KNOT_VALUE_TYPE_RAW:
-		rc = compare_raw(val1.raw, val2.raw);
+	case KNOT_VALUE_TYPE_FLOAT:
+		*out = value.val_f;
 		break;
 	default:
-		rc = 1;
+		return false;
 	}
 
-	return rc;
+	return true;
 }
 
-static bool is_value_equal(knot_value_type new_value,
-			   knot_value_type old_value,
-			   int value_type)
+static bool is_value_changed(knot_value_type new_value,
+			     knot_value_type old_value, int value_type,
+			     const struct event_filter *filter)
 {
-	return compare_knot_value(new_value, old_value, value_type) == 0;
+	double new_val;
+	double old_val;
+	double band;
+
+	if (value_type == KNOT_VALUE_TYPE_RAW)
+		return compare_raw(new_value.raw, old_value.raw,
+				   filter->raw_len) != 0;
+
+	if ((!filter->deadband_abs && !filter->deadband_pct) ||
+			!value_to_double(new_value, value_type, &new_val) ||
+			!value_to_double(old_value, value_type, &old_val))
+		return !is_value_equal(new_value, old_value, value_type);
+
+	band = fmax(filter->deadband_abs,
+		    fabs(old_val) * filter->deadband_pct / 100);
+
+	return fabs(new_val - old_val) > band;
 }
 
 static bool is_lower_than_threshold(knot_value_type value,
@@ -121,43 +188,196 @@ static bool is_higher_than_threshold(knot_value_type value,
 	return compare_knot_value(value, threshold, value_type) > 0;
 }
 
-static void on_sensor_to(struct l_timeout *to, void *data)
+/* Offsets a signed value, saturating at min and max instead of overflowing */
+static int64_t int_add(int64_t val, float delta, int64_t min, int64_t max)
 {
-	struct data_item_timeout *data_item_to_info = data;
+	int64_t step;
+
+	if (isnan(delta))
+		return val;
 
-	timeout_cb(data_item_to_info->id);
-	l_timeout_modify(to, data_item_to_info->timeout_sec);
+	/* Past the range of step, and of any value */
+	if (delta >= (float) INT64_MAX)
+		return max;
+	if (delta <= (float) INT64_MIN)
+		return min;
+
+	step = delta;
+	if (step > 0 && val > max - step)
+		return max;
+	if (step < 0 && val < min - step)
+		return min;
+
+	return val + step;
 }
 
-static void timeout_destroy(void *data)
+/* Same as int_add() for unsigned values, saturating at 0 and max */
+static uint64_t uint_add(uint64_t val, float delta, uint64_t max)
 {
-	struct l_timeout *to = data;
+	uint64_t step;
+
+	if (isnan(delta))
+		return val;
+
+	if (delta >= (float) UINT64_MAX)
+		return max;
+	if (delta <= -(float) UINT64_MAX)
+		return 0;
+
+	if (delta >= 0) {
+		step = delta;
+		return val > max - step ? max : val + step;
+	}
+
+	step = -delta;
 
-	l_timeout_remove(to);
+	return step > val ? 0 : val - step;
 }
 
-int event_check_value(knot_event event, knot_value_type current_val,
-		      knot_value_type sent_val, int value_type)
+static knot_value_type value_add(knot_value_type value, int value_type,
+				 float delta)
 {
-	int rc;
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		value.val_i = int_add(value.val_i, delta, INT32_MIN, INT32_MAX);
+		break;
+	case KNOT_VALUE_TYPE_INT64:
+		value.val_i64 = int_add(value.val_i64, delta, INT64_MIN,
+					INT64_MAX);
+		break;
+	case KNOT_VALUE_TYPE_UINT:
+		value.val_u = uint_add(value.val_u, delta, UINT32_MAX);
+		break;
+	case KNOT_VALUE_TYPE_UINT64:
+		value.val_u64 = uint_add(value.val_u64, delta, UINT64_MAX);
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		value.val_f += delta;
+		break;
+	default:
+		/* No band for values that can't be offset */
+		break;
+	}
 
-	if (!active)
-		return -ENOMSG;
+	return value;
+}
+
+static enum event_zone get_zone(knot_event event, float hysteresis,
+				knot_value_type value, int value_type,
+				enum event_zone zone)
+{
+	knot_value_type limit;
+
+	/* Stay in the current zone until the value is past the band */
+	if (zone == EVENT_ZONE_ABOVE && is_upper_flag_set(event.event_flags)) {
+		limit = value_add(event.upper_limit, value_type, -hysteresis);
+		if (is_higher_than_threshold(value, limit, value_type))
+			return EVENT_ZONE_ABOVE;
+	} else if (zone == EVENT_ZONE_BELOW &&
+			is_lower_flag_set(event.event_flags)) {
+		limit = value_add(event.lower_limit, value_type, hysteresis);
+		if (is_lower_than_threshold(value, limit, value_type))
+			return EVENT_ZONE_BELOW;
+	}
+
+	if (is_upper_flag_set(event.event_flags) &&
+			is_higher_than_threshold(value, event.upper_limit,
+						 value_type))
+		return EVENT_ZONE_ABOVE;
+
+	if (is_lower_flag_set(event.event_flags) &&
+			is_lower_than_threshold(value, event.lower_limit,
+						value_type))
+		return EVENT_ZONE_BELOW;
+
+	return EVENT_ZONE_NORMAL;
+}
+
+/* Values a reading must get past to leave the zone above or below */
+void event_get_exit_limits(const knot_event *event,
+			   const struct event_filter *filter, int value_type,
+			   knot_value_type *upper_exit,
+			   knot_value_type *lower_exit)
+{
+	*upper_exit = value_add(event->upper_limit, value_type,
+				-filter->hysteresis);
+	*lower_exit = value_add(event->lower_limit, value_type,
+				filter->hysteresis);
+}
+
+static void on_bucket_to(struct l_timeout *to, void *user_data)
+{
+	struct time_bucket *bucket = user_data;
+
+	timeout_cb(bucket->ids);
+	l_timeout_modify(to, bucket->period_sec);
+}
+
+static bool bucket_match_period(const void *data, const void *match_data)
+{
+	const struct time_bucket *bucket = data;
+
+	return bucket->period_sec == L_PTR_TO_UINT(match_data);
+}
+
+static bool match_id(const void *data, const void *match_data)
+{
+	const int *id = data;
+
+	return *id == L_PTR_TO_INT(match_data);
+}
+
+static struct time_bucket *find_bucket_by_id(int id)
+{
+	const struct l_queue_entry *entry;
+	struct time_bucket *bucket;
+
+	for (entry = l_queue_get_entries(time_buckets); entry;
+						entry = entry->next) {
+		bucket = entry->data;
+		if (l_queue_find(bucket->ids, match_id, L_INT_TO_PTR(id)))
+			return bucket;
+	}
+
+	return NULL;
+}
+
+static void bucket_destroy(void *data)
+{
+	struct time_bucket *bucket = data;
+
+	l_timeout_remove(bucket->to);
+	l_queue_destroy(bucket->ids, l_free);
+	l_free(bucket);
+}
+
+/*
+ * Thresholds are edge triggered: a value is reported when it enters or
+ * leaves the zone above upper_limit or below lower_limit, not on every
+ * reading taken while it stays there.
+ */
+int event_check_value(knot_event event, const struct event_filter *filter,
+		      knot_value_type current_val, knot_value_type sent_val,
+		      int value_type, enum event_zone *zone)
+{
+	enum event_zone new_zone;
+	bool zone_changed;
+	int rc;
 
 	if (value_type < KNOT_VALUE_TYPE_MIN ||
 			value_type > KNOT_VALUE_TYPE_MAX)
 		return -EINVAL;
 
+	new_zone = get_zone(event, filter->hysteresis, current_val,
+			    value_type, *zone);
+	zone_changed = new_zone != *zone;
+	*zone = new_zone;
+
 	if (is_change_flag_set(event.event_flags) &&
-			!is_value_equal(current_val, sent_val, value_type))
-		rc = 1;
-	else if (is_lower_flag_set(event.event_flags) &&
-			is_lower_than_threshold(current_val,
-				event.lower_limit, value_type))
+			is_value_changed(current_val, sent_val, value_type,
+					 filter))
 		rc = 1;
-	else if (is_upper_flag_set(event.event_flags) &&
-			is_higher_than_threshold(current_val,
-				event.upper_limit, value_type))
+	else if (zone_changed)
 		rc = 1;
 	else
 		rc = 0;
@@ -167,36 +387,67 @@ int event_check_value(knot_event event, knot_value_type current_val,
 
 void event_add_data_item(int id, knot_event event)
 {
-	struct data_item_timeout *data = l_new(struct data_item_timeout, 1);
+	struct time_bucket *bucket;
+
+	if (!time_buckets || !is_timeout_flag_set(event.event_flags))
+		return;
+
+	bucket = l_queue_find(time_buckets, bucket_match_period,
+			      L_UINT_TO_PTR(event.time_sec));
+	if (!bucket) {
+		bucket = l_new(struct time_bucket, 1);
+		bucket->period_sec = event.time_sec;
+		bucket->ids = l_queue_new();
+		bucket->to = l_timeout_create(event.time_sec, on_bucket_to,
+					      bucket, NULL);
+		l_queue_push_tail(time_buckets, bucket);
+	}
 
-	data->id = id;
-	data->timeout_sec = event.time_sec;
+	l_queue_push_tail(bucket->ids, l_memdup(&id, sizeof(id)));
+}
 
-	if (is_timeout_flag_set(event.event_flags)) {
-		struct l_timeout *to = l_timeout_create(event.time_sec,
-							on_sensor_to,
-							data,
-							l_free);
-		l_queue_push_head(sensor_timeouts, to);
-	}
+/* Keeps the phase of the item if its period didn't change */
+void event_update_data_item(int id, knot_event event)
+{
+	struct time_bucket *bucket = find_bucket_by_id(id);
+
+	if (bucket && is_timeout_flag_set(event.event_flags) &&
+			bucket->period_sec == event.time_sec)
+		return;
+
+	event_remove_data_item(id);
+	event_add_data_item(id, event);
+}
+
+void event_remove_data_item(int id)
+{
+	struct time_bucket *bucket = find_bucket_by_id(id);
+
+	if (!bucket)
+		return;
+
+	l_free(l_queue_remove_if(bucket->ids, match_id, L_INT_TO_PTR(id)));
+	if (!l_queue_isempty(bucket->ids))
+		return;
+
+	l_queue_remove(time_buckets, bucket);
+	bucket_destroy(bucket);
 }
 
 int event_start(timeout_cb_t cb)
 {
-	sensor_timeouts = l_queue_new();
-	if (!sensor_timeouts)
+	time_buckets = l_queue_new();
+	if (!time_buckets)
 		return -ENOMSG;
 	timeout_cb = cb;
-	active = true;
 
 	return 0;
 }
 
 void event_stop(void)
 {
-	active = false;
-	if (sensor_timeouts) {
-		l_queue_destroy(sensor_timeouts, timeout_destroy);
-		sensor_timeouts = NULL;
+	if (time_buckets) {
+		l_queue_destroy(time_buckets, bucket_destroy);
+		time_buckets = NULL;
 	}
 }
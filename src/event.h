@@ -14,10 +14,41 @@
  *  Lesser General Public License for more details.
  */
 
-typedef void (*timeout_cb_t)(int);
+struct l_queue;
 
-int event_check_value(knot_event event, knot_value_type current_val,
-		      knot_value_type sent_val, int value_type);
+/* Called with the ids of the data items sharing a period on each tick */
+typedef void (*timeout_cb_t)(struct l_queue *ids);
+
+/* Which side of the thresholds a data item was last reported on */
+enum event_zone {
+	EVENT_ZONE_NORMAL,
+	EVENT_ZONE_BELOW,
+	EVENT_ZONE_ABOVE
+};
+
+/* Per data item event settings that knot_event doesn't carry */
+struct event_filter {
+	/* How far, in value units, a value must return to leave a zone */
+	float hysteresis;
+	/*
+	 * A change is only reported once it exceeds the larger of deadband_abs
+	 * (value units) and deadband_pct percent of the last sent value.
+	 */
+	float deadband_abs;
+	float deadband_pct;
+	/* Meaningful bytes of a RAW value, 0 compares the whole value */
+	int raw_len;
+};
+
+int event_check_value(knot_event event, const struct event_filter *filter,
+		      knot_value_type current_val, knot_value_type sent_val,
+		      int value_type, enum event_zone *zone);
+void event_get_exit_limits(const knot_event *event,
+			   const struct event_filter *filter, int value_type,
+			   knot_value_type *upper_exit,
+			   knot_value_type *lower_exit);
 int event_start(timeout_cb_t cb);
 void event_add_data_item(int id, knot_event event);
+void event_update_data_item(int id, knot_event event);
+void event_remove_data_item(int id);
 void event_stop(void);
@@ -33,40 +33,54 @@
 
 #include "conf-parameters.h"
 #include "iface-modbus.h"
+#include "modbus-worker.h"
+#include "modbus-tcp.h"
+#include "tcp-connect.h"
+#include "backoff.h"
 
 #define TCP_PREFIX "tcp://"
 #define TCP_PREFIX_SIZE 6
 #define RTU_PREFIX "serial://"
 #define RTU_PREFIX_SIZE 9
-#define RECONNECT_TIMEOUT 5
+#define CONNECT_TIMEOUT_MS 2000
+#define TCP_HOSTNAME_LEN 128
+#define TCP_PORT_LEN 8
 
 enum driver_type {
 	TCP,
 	RTU
 };
 
-enum modbus_types_offset {
-	TYPE_BOOL = 1,
-	TYPE_BYTE = 8,
-	TYPE_U16 = 16,
-	TYPE_U32 = 32,
-	TYPE_U64 = 64
-};
-
-union modbus_types {
-	float val_float;
-	uint8_t val_bool;
-	uint8_t val_byte;
-	uint16_t val_u16;
-	uint32_t val_u32;
-	uint64_t val_u64;
+/*
+ * Slaves behind the same gateway or on the same serial line share a bus.
+ * Each bus has its own worker thread and request queue, so a slow or
+ * half-duplex bus never delays the reads of the others. TCP buses may use
+ * the native client instead, which pipelines requests on the main loop.
+ * TCP sockets are always connected by the main loop, with a deadline.
+ */
+struct modbus_bus {
+	char *url;
+	modbus_t *ctx;
+	struct modbus_worker *worker;
+	struct modbus_tcp *tcp;
+	/* Connects the socket handed to the worker of a TCP bus */
+	struct tcp_connect *connector;
+	struct l_io *io;
+	struct l_timeout *connect_to;
+	bool connecting;
+	/* The socket hung up before the worker took it over */
+	bool hangup;
+	bool connected;
+	struct backoff backoff;
+	struct iface_modbus_stats stats;
 };
 
-static struct l_timeout *connect_to;
-static struct l_io *modbus_io;
-static modbus_t *modbus_ctx;
+static struct modbus_bus **buses;
+static int buses_len;
+static int buses_connected;
 static iface_modbus_connected_cb_t conn_cb;
 static iface_modbus_disconnected_cb_t disconn_cb;
+static void *cb_data;
 
 static modbus_t *create_rtu(const char *url)
 {
@@ -113,20 +127,28 @@ static modbus_t *create_rtu(const char *url)
 	return ctx;
 }
 
-static modbus_t *create_tcp(const char *url)
+static int parse_tcp_url(const char *url, char *hostname, char *port)
 {
-	char hostname[128];
-	char port[8];
-
-	memset(hostname, 0, sizeof(hostname));
-	memset(port, 0, sizeof(port));
+	memset(hostname, 0, TCP_HOSTNAME_LEN);
+	memset(port, 0, TCP_PORT_LEN);
 
 	/* Ignoring "tcp://" */
 	if (sscanf(&url[6], "%127[^:]:%7s", hostname, port) != 2) {
 		l_error("Address (%s) not supported: Invalid format", url);
-		return NULL;
+		return -EINVAL;
 	}
 
+	return 0;
+}
+
+static modbus_t *create_tcp(const char *url)
+{
+	char hostname[TCP_HOSTNAME_LEN];
+	char port[TCP_PORT_LEN];
+
+	if (parse_tcp_url(url, hostname, port) < 0)
+		return NULL;
+
 	return modbus_new_tcp_pi(hostname, port);
 }
 
@@ -138,199 +160,431 @@ static modbus_t *create_ctx(const char *url)
 		return create_rtu(url);
 	} else {
 		l_error("Address (%s) not supported: Invalid prefix", url);
-		errno = -EINVAL;
+		errno = EINVAL;
 		return NULL;
 	}
 }
 
+static int bus_submit(struct modbus_bus *bus,
+		      const struct modbus_worker_msg *msg)
+{
+	if (bus->tcp)
+		return modbus_tcp_submit(bus->tcp, msg);
+
+	return modbus_worker_submit(bus->worker, msg);
+}
+
+static void schedule_connect(struct modbus_bus *bus)
+{
+	unsigned int delay_ms = backoff_next(&bus->backoff);
+
+	bus->stats.retries = bus->backoff.attempts;
+	bus->stats.retry_delay_ms = delay_ms;
+
+	l_info("Modbus %s: retry %u in %u ms (up to %u ms)", bus->url,
+	       bus->backoff.attempts, delay_ms, bus->backoff.ceiling_ms);
+
+	l_timeout_modify_ms(bus->connect_to, delay_ms);
+}
+
+static void bus_connected(struct modbus_bus *bus)
+{
+	if (bus->backoff.attempts)
+		l_info("Connected to Modbus %s after %u retries", bus->url,
+		       bus->backoff.attempts);
+	else
+		l_info("Connected to Modbus %s", bus->url);
+
+	bus->connected = true;
+	backoff_reset(&bus->backoff);
+	bus->stats.retries = 0;
+	bus->stats.retry_delay_ms = 0;
+
+	if (buses_connected++ == 0 && conn_cb)
+		conn_cb(cb_data);
+}
+
+static void bus_disconnected(struct modbus_bus *bus)
+{
+	if (!bus->connected)
+		return;
+
+	l_info("Disconnected from Modbus %s", bus->url);
+
+	bus->connected = false;
+	bus->stats.disconnections++;
+
+	/* Reads go on while at least one bus is up */
+	if (--buses_connected == 0 && disconn_cb)
+		disconn_cb(cb_data);
+
+	if (bus->connect_to)
+		schedule_connect(bus);
+}
+
+/* The next connect request closes the current socket, if any */
+static void connect_failed(struct modbus_bus *bus, int err)
+{
+	bus->connecting = false;
+	bus->stats.connect_failures++;
+
+	l_error("error connecting to Modbus %s: %s", bus->url,
+		modbus_strerror(-err));
+
+	schedule_connect(bus);
+}
+
 static void on_disconnected(struct l_io *io, void *user_data)
 {
-	if (disconn_cb)
-		disconn_cb(user_data);
+	struct modbus_bus *bus = user_data;
 
-	if (connect_to)
-		l_timeout_modify(connect_to, RECONNECT_TIMEOUT);
+	if (bus->connecting) {
+		bus->hangup = true;
+		return;
+	}
+
+	bus_disconnected(bus);
 }
 
-static void attempt_connect(struct l_timeout *to, void *user_data)
+static void on_tcp_disconnected(void *user_data)
 {
-	l_debug("Trying to connect to Modbus");
+	bus_disconnected(user_data);
+}
 
-	/* Check and close if a connection is already up */
-	if (modbus_get_socket(modbus_ctx) != -1)
-		modbus_close(modbus_ctx);
+/* The native client watches its own socket */
+static void on_tcp_connect_done(int rc, void *user_data)
+{
+	struct modbus_bus *bus = user_data;
 
-	/* Check and destroy if an IO is already allocated */
-	if (modbus_io) {
-		l_io_destroy(modbus_io);
-		modbus_io = NULL;
+	if (rc < 0) {
+		connect_failed(bus, rc);
+		return;
 	}
 
-	if (modbus_connect(modbus_ctx) < 0) {
-		l_error("error connecting to Modbus: %s",
-			modbus_strerror(errno));
-		goto retry;
+	bus->connecting = false;
+	bus_connected(bus);
+}
+
+static void on_connect_done(int rc, void *user_data)
+{
+	struct modbus_bus *bus = user_data;
+
+	if (rc < 0) {
+		/* Not taken by the context, if it came from the connector */
+		if (bus->io)
+			l_io_set_close_on_destroy(bus->io, true);
+		connect_failed(bus, rc);
+		return;
 	}
 
-	modbus_io = l_io_new(modbus_get_socket(modbus_ctx));
-	if (!modbus_io)
-		goto connection_close;
+	if (bus->hangup) {
+		connect_failed(bus, -ECONNRESET);
+		return;
+	}
 
-	if (!l_io_set_disconnect_handler(modbus_io, on_disconnected, NULL,
-					 NULL)) {
-		l_error("Couldn't set Modbus disconnect handler");
-		goto io_destroy;
+	/* Serial lines are opened by the worker */
+	if (!bus->io) {
+		bus->io = l_io_new(rc);
+		if (!bus->io) {
+			connect_failed(bus, -ENOMEM);
+			return;
+		}
+
+		if (!l_io_set_disconnect_handler(bus->io, on_disconnected, bus,
+						 NULL)) {
+			l_error("Couldn't set Modbus disconnect handler");
+			l_io_destroy(bus->io);
+			bus->io = NULL;
+			connect_failed(bus, -EIO);
+			return;
+		}
 	}
 
-	if (conn_cb)
-		conn_cb(user_data);
+	bus->connecting = false;
+	bus_connected(bus);
+}
+
+static void on_socket_connected(struct l_io *io, int err, void *user_data)
+{
+	struct modbus_bus *bus = user_data;
+	struct modbus_worker_msg msg = {
+		.op = MODBUS_WORKER_OP_SET_SOCKET,
+		.done = on_connect_done,
+		.done_data = bus
+	};
+
+	if (err < 0) {
+		connect_failed(bus, err);
+		return;
+	}
 
-	return;
+	/* Watched here, but the worker context owns the descriptor */
+	bus->io = io;
+	msg.fd = l_io_get_fd(io);
 
-io_destroy:
-	l_io_destroy(modbus_io);
-	modbus_io = NULL;
-connection_close:
-	modbus_close(modbus_ctx);
-retry:
-	l_timeout_modify(to, RECONNECT_TIMEOUT);
+	if (!l_io_set_disconnect_handler(io, on_disconnected, bus, NULL) ||
+	    bus_submit(bus, &msg) < 0) {
+		l_io_set_close_on_destroy(io, true);
+		connect_failed(bus, -EIO);
+	}
 }
 
-static void iface_modbus_config_endianness_type_recv_32_bits(uint32_t *src,
-				int endianness_type)
+static void attempt_connect(struct l_timeout *to, void *user_data)
 {
-	switch (endianness_type) {
-	case MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN:
-		*src = ((*src & 0xffff0000u) >> 16)|
-			((*src & 0x0000ffffu) << 16);
-		break;
-	case MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN:
-		*src = ((((*src) & 0xff000000u) >> 24)|
-			(((*src) & 0x00ff0000u) >> 8)|
-			(((*src) & 0x0000ff00u) << 8)|
-			(((*src) & 0x000000ffu) << 24));
-		break;
-	case MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN:
-		*src = ((((*src) & 0xff000000u) >> 8)|
-			(((*src) & 0x00ff0000u) << 8)|
-			(((*src) & 0x0000ff00u) >> 8)|
-			(((*src) & 0x000000ffu) << 8));
-		break;
-	case MODBUS_ENDIANNESS_TYPE_MID_LITTLE_ENDIAN:
+	struct modbus_bus *bus = user_data;
+	struct modbus_worker_msg msg = {
+		.op = MODBUS_WORKER_OP_CONNECT,
+		.done = bus->tcp ? on_tcp_connect_done : on_connect_done,
+		.done_data = bus
+	};
+	int err;
+
+	if (bus->connecting)
+		return;
+
+	l_debug("Trying to connect to Modbus %s", bus->url);
+
+	/* Check and destroy if an IO is already allocated */
+	if (bus->io) {
+		l_io_destroy(bus->io);
+		bus->io = NULL;
+	}
+
+	bus->connecting = true;
+	bus->hangup = false;
+	bus->stats.connect_attempts++;
+
+	if (bus->connector)
+		err = tcp_connect_start(bus->connector, CONNECT_TIMEOUT_MS,
+					on_socket_connected, bus);
+	else
+		err = bus_submit(bus, &msg);
+
+	if (err < 0)
+		connect_failed(bus, err);
+}
+
+/* Runs on the main loop, whichever bus and transport served the request */
+static void on_worker_complete(struct modbus_worker_msg *msg,
+			       void *user_data)
+{
+	struct modbus_bus *bus = user_data;
+
+	switch (msg->op) {
+	case MODBUS_WORKER_OP_READ_BITS:
+	case MODBUS_WORKER_OP_READ_REGISTERS:
+		if (msg->rc < 0)
+			l_error("Failed to read %s from Modbus %s: %s (%d)",
+				msg->op == MODBUS_WORKER_OP_READ_BITS ?
+				"bits" : "registers", bus->url,
+				modbus_strerror(-msg->rc), msg->rc);
 		break;
-	default:
-		src = NULL;
+	case MODBUS_WORKER_OP_CONNECT:
+	case MODBUS_WORKER_OP_SET_SOCKET:
 		break;
 	}
+
+	if (msg->done)
+		msg->done(msg->rc, msg->done_data);
 }
 
-static void iface_modbus_config_endianness_type_recv_64_bits(uint64_t *src,
-				int endianness_type)
+static int submit_read(enum modbus_worker_op op, int bus_id, int slave_id,
+		       int addr, int count, void *dest,
+		       iface_modbus_read_cb_t read_cb, void *user_data)
 {
-	if (endianness_type == MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN ||
-		endianness_type == MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN){
-		*src = ((*src & 0xff00000000000000u) >> 8)|
-			((*src & 0x00ff000000000000u) << 8)|
-			((*src & 0x0000ff0000000000u) >> 8)|
-			((*src & 0x000000ff00000000u) << 8)|
-			((*src & 0x00000000ff000000u) >> 8)|
-			((*src & 0x0000000000ff0000u) << 8)|
-			((*src & 0x000000000000ff00u) >> 8)|
-			((*src & 0x00000000000000ffu) << 8);
-	}
-	if (endianness_type == MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN ||
-		endianness_type == MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN){
-		*src = ((*src & 0xffff000000000000u) >> 48)|
-			((*src & 0x0000ffff00000000u) >> 16)|
-			((*src & 0x00000000ffff0000u) << 16)|
-			((*src & 0x000000000000ffffu) << 48);
+	struct modbus_worker_msg msg = {
+		.op = op,
+		.slave_id = slave_id,
+		.addr = addr,
+		.count = count,
+		.dest = dest,
+		.done = read_cb,
+		.done_data = user_data
+	};
+
+	if (bus_id < 0 || bus_id >= buses_len)
+		return -EINVAL;
+
+	if (!buses[bus_id]->connected)
+		return -ENOTCONN;
+
+	return bus_submit(buses[bus_id], &msg);
+}
+
+int iface_modbus_read_bits(int bus_id, int slave_id, int addr, int count,
+			   uint8_t *dest, iface_modbus_read_cb_t read_cb,
+			   void *user_data)
+{
+	return submit_read(MODBUS_WORKER_OP_READ_BITS, bus_id, slave_id, addr,
+			   count, dest, read_cb, user_data);
+}
+
+int iface_modbus_read_registers(int bus_id, int slave_id, int addr,
+				int count, uint16_t *dest,
+				iface_modbus_read_cb_t read_cb,
+				void *user_data)
+{
+	return submit_read(MODBUS_WORKER_OP_READ_REGISTERS, bus_id, slave_id,
+			   addr, count, dest, read_cb, user_data);
+}
+
+/*
+ * Returns the bus reaching url, created on the first call for that url.
+ * Unit ids are multiplexed over the connection of their bus.
+ */
+int iface_modbus_add_bus(const char *url)
+{
+	struct modbus_bus *bus;
+	modbus_t *ctx;
+	int i;
+
+	for (i = 0; i < buses_len; i++) {
+		if (!strcmp(buses[i]->url, url))
+			return i;
 	}
+
+	errno = 0;
+	ctx = create_ctx(url);
+	if (!ctx)
+		return errno ? -errno : -EINVAL;
+
+	bus = l_new(struct modbus_bus, 1);
+	bus->url = l_strdup(url);
+	bus->ctx = ctx;
+
+	buses = l_realloc(buses, sizeof(*buses) * (buses_len + 1));
+	buses[buses_len] = bus;
+
+	return buses_len++;
 }
 
-int iface_modbus_read_data(int reg_addr, int bit_offset, knot_value_type *out,
-			   int endianness_type)
+static int start_bus(struct modbus_bus *bus,
+		     const struct iface_modbus_options *options)
 {
-	int rc;
-	union modbus_types tmp;
-	uint8_t byte_tmp[8];
-	uint8_t i;
+	char hostname[TCP_HOSTNAME_LEN];
+	char port[TCP_PORT_LEN];
 
-	memset(&tmp, 0, sizeof(tmp));
+	backoff_init(&bus->backoff, options->reconnect_initial_ms,
+		     options->reconnect_max_ms, options->reconnect_multiplier);
 
-	switch (bit_offset) {
-	case TYPE_BOOL:
-		rc = modbus_read_input_bits(modbus_ctx, reg_addr, 1,
-					    &tmp.val_bool);
-		break;
-	case TYPE_BYTE:
-		rc = modbus_read_input_bits(modbus_ctx, reg_addr, 8, byte_tmp);
-		/**
-		 * Store in tmp.val_byte the value read from a Modbus Slave
-		 * where each position of byte_tmp corresponds to a bit.
-		*/
-		for (i = 0; i < sizeof(byte_tmp); i++)
-			tmp.val_byte |= byte_tmp[i] << i;
-		break;
-	case TYPE_U16:
-		rc = modbus_read_registers(modbus_ctx, reg_addr, 1,
-					   &tmp.val_u16);
-		break;
-	case TYPE_U32:
-		rc = modbus_read_registers(modbus_ctx, reg_addr, 2,
-					   (uint16_t *) &tmp.val_u32);
-		iface_modbus_config_endianness_type_recv_32_bits(&tmp.val_u32,
-						endianness_type);
-		break;
-	case TYPE_U64:
-		rc = modbus_read_registers(modbus_ctx, reg_addr, 4,
-					   (uint16_t *) &tmp.val_u64);
-		iface_modbus_config_endianness_type_recv_64_bits(&tmp.val_u64,
-						endianness_type);
-		break;
-	default:
-		rc = -EINVAL;
+	errno = 0;
+
+	if (options->tcp_window > 0 &&
+	    !strncmp(bus->url, TCP_PREFIX, TCP_PREFIX_SIZE)) {
+		if (parse_tcp_url(bus->url, hostname, port) < 0)
+			return -EINVAL;
+
+		bus->tcp = modbus_tcp_new(hostname, port, options->tcp_window,
+					  CONNECT_TIMEOUT_MS,
+					  on_worker_complete,
+					  on_tcp_disconnected, bus);
+		if (!bus->tcp)
+			return errno ? -errno : -ENOMEM;
+
+		l_info("Modbus %s: %d requests in flight", bus->url,
+		       options->tcp_window);
+
+		return 0;
 	}
 
-	if (rc < 0) {
-		rc = -errno;
-		l_error("Failed to read from Modbus: %s (%d)",
-			modbus_strerror(errno), rc);
-	} else {
-		memcpy(out, &tmp, sizeof(tmp));
+	bus->worker = modbus_worker_new(bus->ctx, on_worker_complete, bus);
+	if (!bus->worker)
+		return errno ? -errno : -ENOMEM;
+
+	if (!strncmp(bus->url, TCP_PREFIX, TCP_PREFIX_SIZE)) {
+		if (parse_tcp_url(bus->url, hostname, port) < 0)
+			return -EINVAL;
+
+		bus->connector = tcp_connect_new(hostname, port);
 	}
 
-	return rc;
+	return 0;
+}
+
+static void stop_bus(struct modbus_bus *bus)
+{
+	tcp_connect_free(bus->connector);
+	bus->connector = NULL;
+
+	/* Joins the worker thread, the context is ours afterwards */
+	modbus_worker_free(bus->worker);
+	bus->worker = NULL;
+
+	modbus_tcp_free(bus->tcp);
+	bus->tcp = NULL;
 }
 
-int iface_modbus_start(const char *url, int slave_id,
+int iface_modbus_start(const struct iface_modbus_options *options,
 		       iface_modbus_connected_cb_t connected_cb,
 		       iface_modbus_disconnected_cb_t disconnected_cb,
 		       void *user_data)
 {
-	modbus_ctx = create_ctx(url);
-	if (!modbus_ctx)
-		return -errno;
+	int err;
+	int i;
 
-	if (modbus_set_slave(modbus_ctx, slave_id) < 0)
-		return -errno;
+	if (!buses_len)
+		return -EINVAL;
+
+	for (i = 0; i < buses_len; i++) {
+		err = start_bus(buses[i], options);
+		if (err < 0)
+			goto stop_buses;
+	}
 
 	conn_cb = connected_cb;
 	disconn_cb = disconnected_cb;
+	cb_data = user_data;
 
-	connect_to = l_timeout_create_ms(1, attempt_connect, NULL, NULL);
+	for (i = 0; i < buses_len; i++)
+		buses[i]->connect_to = l_timeout_create_ms(1, attempt_connect,
+							   buses[i], NULL);
 
 	return 0;
+
+stop_buses:
+	for (; i >= 0; i--)
+		stop_bus(buses[i]);
+
+	return err;
 }
 
-void iface_modbus_stop(void)
+/* Counters since iface_modbus_start(), for monitoring */
+int iface_modbus_get_stats(int bus_id, struct iface_modbus_stats *stats)
 {
-	l_timeout_remove(connect_to);
-	connect_to = NULL;
+	if (bus_id < 0 || bus_id >= buses_len)
+		return -EINVAL;
 
-	l_io_destroy(modbus_io);
-	modbus_io = NULL;
+	*stats = buses[bus_id]->stats;
+	stats->connected = buses[bus_id]->connected;
 
-	modbus_close(modbus_ctx);
-	modbus_free(modbus_ctx);
+	return 0;
 }
 
+void iface_modbus_stop(void)
+{
+	struct modbus_bus *bus;
+	int i;
+
+	for (i = 0; i < buses_len; i++) {
+		l_timeout_remove(buses[i]->connect_to);
+		buses[i]->connect_to = NULL;
+
+		l_io_destroy(buses[i]->io);
+		buses[i]->io = NULL;
+	}
+
+	for (i = 0; i < buses_len; i++) {
+		bus = buses[i];
+
+		stop_bus(bus);
+		modbus_close(bus->ctx);
+		modbus_free(bus->ctx);
+		l_free(bus->url);
+		l_free(bus);
+	}
+
+	l_free(buses);
+	buses = NULL;
+	buses_len = 0;
+	buses_connected = 0;
+}
@@ -17,13 +17,52 @@
 extern struct modbus_driver tcp;
 extern struct modbus_driver rtu;
 
+enum modbus_types_offset {
+	TYPE_BOOL = 1,
+	TYPE_BYTE = 8,
+	TYPE_U16 = 16,
+	TYPE_U32 = 32,
+	TYPE_U64 = 64
+};
+
+/* RAW data items span whole registers, up to the size of a RAW value */
+#define TYPE_RAW_MAX		(KNOT_DATA_RAW_SIZE * 8)
+
+struct iface_modbus_options {
+	/* Modbus TCP requests in flight per connection, 0 uses libmodbus */
+	int tcp_window;
+	/* Connect attempts wait a random delay up to an exponential bound */
+	unsigned int reconnect_initial_ms;
+	unsigned int reconnect_max_ms;
+	float reconnect_multiplier;
+};
+
+struct iface_modbus_stats {
+	bool connected;
+	unsigned int connect_attempts;
+	unsigned int connect_failures;
+	unsigned int disconnections;
+	/* Attempts scheduled since the bus was last connected */
+	unsigned int retries;
+	/* Delay before the next attempt, 0 while connected */
+	unsigned int retry_delay_ms;
+};
+
 typedef void (*iface_modbus_connected_cb_t) (void *user_data);
 typedef void (*iface_modbus_disconnected_cb_t) (void *user_data);
+typedef void (*iface_modbus_read_cb_t) (int rc, void *user_data);
 
-int iface_modbus_read_data(int reg_addr, int bit_offset, knot_value_type *out,
-			   int endianness_type);
-int iface_modbus_start(const char *url, int slave_id,
+int iface_modbus_read_bits(int bus_id, int slave_id, int addr, int count,
+			   uint8_t *dest, iface_modbus_read_cb_t read_cb,
+			   void *user_data);
+int iface_modbus_read_registers(int bus_id, int slave_id, int addr,
+				int count, uint16_t *dest,
+				iface_modbus_read_cb_t read_cb,
+				void *user_data);
+int iface_modbus_add_bus(const char *url);
+int iface_modbus_start(const struct iface_modbus_options *options,
 		       iface_modbus_connected_cb_t connected_cb,
 		       iface_modbus_disconnected_cb_t disconnected_cb,
 		       void *user_data);
+int iface_modbus_get_stats(int bus_id, struct iface_modbus_stats *stats);
 void iface_modbus_stop(void);
@@ -46,6 +46,11 @@ static void signal_handler(uint32_t signo, void *user_data)
 	}
 }
 
+static void stats_signal_handler(void *user_data)
+{
+	device_log_stats();
+}
+
 static int detach_daemon(void)
 {
 	if (daemon(0, 0))
@@ -111,6 +116,7 @@ int main(int argc, char *argv[])
 {
 	struct settings *settings;
 	struct device_settings *conf_files;
+	struct l_signal *stats_signal;
 	int err;
 
 	settings = settings_load(argc, argv);
@@ -158,8 +164,13 @@ int main(int argc, char *argv[])
 
 	settings_free(settings);
 
+	/* kill -USR1 logs the Modbus connection counters */
+	stats_signal = l_signal_create(SIGUSR1, stats_signal_handler, NULL,
+				       NULL);
+
 	l_main_run_with_signal(signal_handler, NULL);
 
+	l_signal_remove(stats_signal);
 	device_destroy();
 
 	l_info("Exiting KNoT VirtualThing");
@@ -0,0 +1,572 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Native Modbus TCP client source file
+ *
+ *  Talks Modbus TCP over a non-blocking socket watched by the ell main
+ *  loop, instead of the request/response round trips of libmodbus. Up to
+ *  a window of requests is kept in flight on the connection and responses
+ *  are matched by the transaction id of their MBAP header, so a gateway
+ *  with a long round trip time serves several reads per round trip.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <modbus/modbus.h>
+#include <ell/ell.h>
+
+#include "modbus-worker.h"
+#include "modbus-tcp.h"
+#include "tcp-connect.h"
+
+#define MBAP_HEADER_LEN		7
+#define REQUEST_ADU_LEN		12
+#define RESPONSE_TIMEOUT_MS	500
+/* Same bound as the worker rings */
+#define REQUESTS_MAX		64
+
+struct tcp_request {
+	struct modbus_worker_msg msg;
+	uint16_t tid;
+	uint64_t deadline;
+};
+
+struct modbus_tcp {
+	char *host;
+	char *port;
+	int window;
+	struct tcp_connect *connector;
+	unsigned int connect_timeout_ms;
+	int fd;
+	struct l_io *io;
+	bool connecting;
+	bool connected;
+	bool writing;
+	struct modbus_worker_msg connect_msg;
+	uint16_t next_tid;
+	/* Waiting for room in the window */
+	struct l_queue *pending;
+	/* Sent, oldest first, waiting for the response with their tid */
+	struct l_queue *in_flight;
+	struct l_timeout *response_to;
+	/* Holds window requests, sent or not */
+	uint8_t *tx_buf;
+	size_t tx_cap;
+	size_t tx_len;
+	size_t tx_off;
+	uint8_t rx_buf[MODBUS_TCP_MAX_ADU_LENGTH];
+	size_t rx_len;
+	modbus_worker_complete_cb_t complete_cb;
+	modbus_tcp_disconnect_cb_t disconnect_cb;
+	void *user_data;
+};
+
+static void put_be16(uint8_t *buf, uint16_t val)
+{
+	buf[0] = val >> 8;
+	buf[1] = val;
+}
+
+static uint16_t get_be16(const uint8_t *buf)
+{
+	return buf[0] << 8 | buf[1];
+}
+
+static uint8_t function_code(const struct modbus_worker_msg *msg)
+{
+	/* Same functions libmodbus is asked for by the worker */
+	return msg->op == MODBUS_WORKER_OP_READ_BITS ?
+		MODBUS_FC_READ_DISCRETE_INPUTS :
+		MODBUS_FC_READ_HOLDING_REGISTERS;
+}
+
+static void complete_request(struct modbus_tcp *tcp, struct tcp_request *req,
+			     int rc)
+{
+	req->msg.rc = rc;
+	tcp->complete_cb(&req->msg, tcp->user_data);
+	l_free(req);
+}
+
+static void complete_connect(struct modbus_tcp *tcp, int rc)
+{
+	/* The callback may already ask for the next connection */
+	struct modbus_worker_msg msg = tcp->connect_msg;
+
+	tcp->connecting = false;
+
+	msg.rc = rc;
+	tcp->complete_cb(&msg, tcp->user_data);
+}
+
+static void fail_requests(struct modbus_tcp *tcp, int err)
+{
+	struct tcp_request *req;
+
+	while ((req = l_queue_pop_head(tcp->in_flight)))
+		complete_request(tcp, req, err);
+
+	while ((req = l_queue_pop_head(tcp->pending)))
+		complete_request(tcp, req, err);
+}
+
+static void close_socket(struct modbus_tcp *tcp)
+{
+	tcp_connect_cancel(tcp->connector);
+
+	l_timeout_remove(tcp->response_to);
+	tcp->response_to = NULL;
+
+	l_io_destroy(tcp->io);
+	tcp->io = NULL;
+
+	if (tcp->fd >= 0)
+		close(tcp->fd);
+	tcp->fd = -1;
+
+	tcp->connecting = false;
+	tcp->connected = false;
+	tcp->writing = false;
+	tcp->tx_len = 0;
+	tcp->tx_off = 0;
+	tcp->rx_len = 0;
+}
+
+/* The disconnect handler takes over once the socket is shut down */
+static void abort_connection(struct modbus_tcp *tcp)
+{
+	shutdown(tcp->fd, SHUT_RDWR);
+}
+
+static int flush_tx(struct modbus_tcp *tcp)
+{
+	ssize_t n;
+
+	while (tcp->tx_off < tcp->tx_len) {
+		n = send(tcp->fd, tcp->tx_buf + tcp->tx_off,
+			 tcp->tx_len - tcp->tx_off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+
+		tcp->tx_off += n;
+	}
+
+	if (tcp->tx_off == tcp->tx_len) {
+		tcp->tx_len = 0;
+		tcp->tx_off = 0;
+	}
+
+	return 0;
+}
+
+static void send_pending(struct modbus_tcp *tcp);
+
+static bool on_writable(struct l_io *io, void *user_data)
+{
+	struct modbus_tcp *tcp = user_data;
+
+	if (flush_tx(tcp) < 0) {
+		abort_connection(tcp);
+		tcp->writing = false;
+		return false;
+	}
+
+	tcp->writing = tcp->tx_len > 0;
+
+	/* Requests held back while the buffer was full */
+	send_pending(tcp);
+
+	return tcp->writing;
+}
+
+static void on_response_timeout(struct l_timeout *timeout, void *user_data);
+
+static void arm_response_timeout(struct modbus_tcp *tcp)
+{
+	struct tcp_request *req;
+	uint64_t now;
+	uint64_t ms = 1;
+
+	req = l_queue_peek_head(tcp->in_flight);
+	if (!req)
+		return;
+
+	now = l_time_now();
+	if (l_time_before(now, req->deadline))
+		ms = l_time_diff(now, req->deadline) / L_USEC_PER_MSEC + 1;
+
+	if (!tcp->response_to)
+		tcp->response_to = l_timeout_create_ms(ms, on_response_timeout,
+						       tcp, NULL);
+	else
+		l_timeout_modify_ms(tcp->response_to, ms);
+}
+
+static void encode_request(uint8_t *adu, uint16_t tid,
+			   const struct modbus_worker_msg *msg)
+{
+	put_be16(adu, tid);
+	/* Protocol id, then the length of what follows */
+	put_be16(adu + 2, 0);
+	put_be16(adu + 4, REQUEST_ADU_LEN - 6);
+	adu[6] = msg->slave_id;
+	adu[7] = function_code(msg);
+	put_be16(adu + 8, msg->addr);
+	put_be16(adu + 10, msg->count);
+}
+
+/* Moves pending requests into the window and sends them */
+static void send_pending(struct modbus_tcp *tcp)
+{
+	struct tcp_request *req;
+	uint64_t deadline;
+	bool added = false;
+
+	if (!tcp->connected)
+		return;
+
+	if (tcp->tx_off) {
+		memmove(tcp->tx_buf, tcp->tx_buf + tcp->tx_off,
+			tcp->tx_len - tcp->tx_off);
+		tcp->tx_len -= tcp->tx_off;
+		tcp->tx_off = 0;
+	}
+
+	deadline = l_time_now() + RESPONSE_TIMEOUT_MS * L_USEC_PER_MSEC;
+
+	/*
+	 * Requests that timed out leave the window with their bytes possibly
+	 * still unsent, so room in the window doesn't mean room in tx_buf.
+	 */
+	while (l_queue_length(tcp->in_flight) < (unsigned int) tcp->window &&
+			tcp->tx_len + REQUEST_ADU_LEN <= tcp->tx_cap) {
+		req = l_queue_pop_head(tcp->pending);
+		if (!req)
+			break;
+
+		encode_request(tcp->tx_buf + tcp->tx_len, req->tid, &req->msg);
+		tcp->tx_len += REQUEST_ADU_LEN;
+		req->deadline = deadline;
+		l_queue_push_tail(tcp->in_flight, req);
+		added = true;
+	}
+
+	if (!added)
+		return;
+
+	arm_response_timeout(tcp);
+
+	/* The write handler sends them once the socket has room */
+	if (tcp->writing)
+		return;
+
+	if (flush_tx(tcp) < 0) {
+		abort_connection(tcp);
+		return;
+	}
+
+	if (tcp->tx_len && l_io_set_write_handler(tcp->io, on_writable, tcp,
+						  NULL))
+		tcp->writing = true;
+}
+
+static void on_response_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct modbus_tcp *tcp = user_data;
+	struct tcp_request *req;
+	uint64_t now = l_time_now();
+
+	/* A late response is dropped, its tid is no longer in flight */
+	while ((req = l_queue_peek_head(tcp->in_flight)) &&
+			!l_time_before(now, req->deadline)) {
+		l_queue_pop_head(tcp->in_flight);
+		complete_request(tcp, req, -ETIMEDOUT);
+	}
+
+	arm_response_timeout(tcp);
+	send_pending(tcp);
+}
+
+static int parse_response(const struct modbus_worker_msg *msg,
+			  const uint8_t *frame, size_t len)
+{
+	const uint8_t *pdu = frame + MBAP_HEADER_LEN;
+	size_t pdu_len = len - MBAP_HEADER_LEN;
+	uint8_t function = function_code(msg);
+	uint8_t *bits = msg->dest;
+	uint16_t *regs = msg->dest;
+	const uint8_t *data;
+	size_t byte_count;
+	int i;
+
+	if (frame[6] != msg->slave_id)
+		return -EMBBADDATA;
+
+	/* Exceptions map to the same errors libmodbus reports */
+	if (pdu[0] == (function | 0x80)) {
+		if (pdu_len < 2)
+			return -EMBBADDATA;
+		if (pdu[1] == 0 || pdu[1] >= MODBUS_EXCEPTION_MAX)
+			return -EMBBADEXC;
+		return -(MODBUS_ENOBASE + pdu[1]);
+	}
+
+	if (pdu[0] != function || pdu_len < 2)
+		return -EMBBADDATA;
+
+	byte_count = pdu[1];
+	data = pdu + 2;
+	if (pdu_len != 2 + byte_count)
+		return -EMBBADDATA;
+
+	if (msg->op == MODBUS_WORKER_OP_READ_BITS) {
+		if (byte_count != (size_t) (msg->count + 7) / 8)
+			return -EMBBADDATA;
+
+		/* One byte per bit, as libmodbus fills them */
+		for (i = 0; i < msg->count; i++)
+			bits[i] = (data[i / 8] >> (i % 8)) & 1;
+	} else {
+		if (byte_count != (size_t) msg->count * 2)
+			return -EMBBADDATA;
+
+		for (i = 0; i < msg->count; i++)
+			regs[i] = get_be16(data + i * 2);
+	}
+
+	return msg->count;
+}
+
+static bool match_tid(const void *data, const void *user_data)
+{
+	const struct tcp_request *req = data;
+
+	return req->tid == L_PTR_TO_UINT(user_data);
+}
+
+static void handle_response(struct modbus_tcp *tcp, const uint8_t *frame,
+			    size_t len)
+{
+	struct tcp_request *req;
+	uint16_t tid = get_be16(frame);
+
+	req = l_queue_remove_if(tcp->in_flight, match_tid,
+				L_UINT_TO_PTR(tid));
+	if (!req) {
+		l_debug("Dropping response %u from Modbus %s:%s", tid,
+			tcp->host, tcp->port);
+		return;
+	}
+
+	complete_request(tcp, req, parse_response(&req->msg, frame, len));
+}
+
+static bool on_read(struct l_io *io, void *user_data)
+{
+	struct modbus_tcp *tcp = user_data;
+	size_t frame_len;
+	ssize_t n;
+
+	n = recv(tcp->fd, tcp->rx_buf + tcp->rx_len,
+		 sizeof(tcp->rx_buf) - tcp->rx_len, 0);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN ||
+		      errno == EWOULDBLOCK))
+		return true;
+
+	if (n <= 0) {
+		abort_connection(tcp);
+		return false;
+	}
+
+	tcp->rx_len += n;
+
+	while (tcp->rx_len >= MBAP_HEADER_LEN) {
+		/* Length counts the unit id and the PDU */
+		frame_len = 6 + get_be16(tcp->rx_buf + 4);
+		if (get_be16(tcp->rx_buf + 2) != 0 ||
+		    frame_len < MBAP_HEADER_LEN + 1 ||
+		    frame_len > sizeof(tcp->rx_buf)) {
+			l_error("Invalid frame from Modbus %s:%s", tcp->host,
+				tcp->port);
+			abort_connection(tcp);
+			return false;
+		}
+
+		if (tcp->rx_len < frame_len)
+			break;
+
+		handle_response(tcp, tcp->rx_buf, frame_len);
+
+		tcp->rx_len -= frame_len;
+		memmove(tcp->rx_buf, tcp->rx_buf + frame_len, tcp->rx_len);
+	}
+
+	/* Responses made room in the window */
+	send_pending(tcp);
+
+	return true;
+}
+
+static void on_disconnect(struct l_io *io, void *user_data)
+{
+	struct modbus_tcp *tcp = user_data;
+
+	if (!tcp->connected)
+		return;
+
+	tcp->connected = false;
+	tcp->writing = false;
+
+	fail_requests(tcp, -ECONNRESET);
+	tcp->disconnect_cb(tcp->user_data);
+}
+
+static void on_connected(struct l_io *io, int err, void *user_data)
+{
+	struct modbus_tcp *tcp = user_data;
+
+	if (err < 0) {
+		complete_connect(tcp, err);
+		return;
+	}
+
+	tcp->io = io;
+	tcp->fd = l_io_get_fd(io);
+
+	if (!l_io_set_read_handler(io, on_read, tcp, NULL) ||
+	    !l_io_set_disconnect_handler(io, on_disconnect, tcp, NULL)) {
+		/* Released by the next connection attempt */
+		complete_connect(tcp, -EIO);
+		return;
+	}
+
+	tcp->connected = true;
+	complete_connect(tcp, 0);
+}
+
+struct modbus_tcp *modbus_tcp_new(const char *host, const char *port,
+				  int window, unsigned int connect_timeout_ms,
+				  modbus_worker_complete_cb_t complete_cb,
+				  modbus_tcp_disconnect_cb_t disconnect_cb,
+				  void *user_data)
+{
+	struct modbus_tcp *tcp;
+
+	if (window < 1 || window > REQUESTS_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tcp = l_new(struct modbus_tcp, 1);
+	tcp->host = l_strdup(host);
+	tcp->port = l_strdup(port);
+	tcp->window = window;
+	tcp->connector = tcp_connect_new(host, port);
+	tcp->connect_timeout_ms = connect_timeout_ms;
+	tcp->fd = -1;
+	tcp->pending = l_queue_new();
+	tcp->in_flight = l_queue_new();
+	tcp->tx_cap = window * REQUEST_ADU_LEN;
+	tcp->tx_buf = l_malloc(tcp->tx_cap);
+	tcp->complete_cb = complete_cb;
+	tcp->disconnect_cb = disconnect_cb;
+	tcp->user_data = user_data;
+
+	return tcp;
+}
+
+/*
+ * Connect requests drop the current connection, if any, failing the
+ * requests in flight. Reads are queued until the window has room.
+ */
+int modbus_tcp_submit(struct modbus_tcp *tcp,
+		      const struct modbus_worker_msg *msg)
+{
+	struct tcp_request *req;
+	int max_count;
+	int err;
+
+	if (msg->op == MODBUS_WORKER_OP_CONNECT) {
+		if (tcp->connecting)
+			return -EALREADY;
+
+		if (tcp->connected) {
+			tcp->connected = false;
+			fail_requests(tcp, -ECONNRESET);
+		}
+
+		close_socket(tcp);
+
+		err = tcp_connect_start(tcp->connector,
+					tcp->connect_timeout_ms, on_connected,
+					tcp);
+		if (err < 0)
+			return err;
+
+		tcp->connect_msg = *msg;
+		tcp->connecting = true;
+
+		return 0;
+	}
+
+	if (!tcp->connected)
+		return -ENOTCONN;
+
+	max_count = msg->op == MODBUS_WORKER_OP_READ_BITS ?
+		MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+	if (msg->count < 1 || msg->count > max_count)
+		return -EMBMDATA;
+
+	if (l_queue_length(tcp->pending) +
+			l_queue_length(tcp->in_flight) >= REQUESTS_MAX)
+		return -EAGAIN;
+
+	req = l_new(struct tcp_request, 1);
+	req->msg = *msg;
+	req->tid = tcp->next_tid++;
+	l_queue_push_tail(tcp->pending, req);
+
+	send_pending(tcp);
+
+	return 0;
+}
+
+void modbus_tcp_free(struct modbus_tcp *tcp)
+{
+	if (!tcp)
+		return;
+
+	/* Pending requests are dropped without calling their callbacks */
+	close_socket(tcp);
+	tcp_connect_free(tcp->connector);
+	l_queue_destroy(tcp->pending, l_free);
+	l_queue_destroy(tcp->in_flight, l_free);
+
+	l_free(tcp->tx_buf);
+	l_free(tcp->host);
+	l_free(tcp->port);
+	l_free(tcp);
+}
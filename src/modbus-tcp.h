@@ -0,0 +1,36 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Native Modbus TCP client header file
+ */
+
+struct modbus_tcp;
+
+typedef void (*modbus_tcp_disconnect_cb_t) (void *user_data);
+
+/*
+ * Requests are described by struct modbus_worker_msg, as for the worker,
+ * and are completed through complete_cb on the main loop.
+ */
+struct modbus_tcp *modbus_tcp_new(const char *host, const char *port,
+				  int window, unsigned int connect_timeout_ms,
+				  modbus_worker_complete_cb_t complete_cb,
+				  modbus_tcp_disconnect_cb_t disconnect_cb,
+				  void *user_data);
+int modbus_tcp_submit(struct modbus_tcp *tcp,
+		      const struct modbus_worker_msg *msg);
+void modbus_tcp_free(struct modbus_tcp *tcp);
@@ -0,0 +1,288 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Modbus I/O worker source file
+ *
+ *  A worker owns a libmodbus context and runs every blocking call on its own
+ *  thread, so independent buses each get a worker and are served in
+ *  parallel. Requests are handed over through a
+ *  single-producer/single-consumer ring and the worker is woken up by an
+ *  eventfd. Completions travel back through a second ring and an eventfd
+ *  watched by the main loop, so the caller's callbacks always run on the
+ *  ell main loop.
+ *
+ *  Only the main loop thread may call the functions exported here.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <modbus/modbus.h>
+#include <ell/ell.h>
+
+#include "modbus-worker.h"
+
+/* Must be a power of two */
+#define WORKER_RING_SIZE	64
+#define WORKER_RING_MASK	(WORKER_RING_SIZE - 1)
+
+struct msg_ring {
+	struct modbus_worker_msg msgs[WORKER_RING_SIZE];
+	atomic_uint head;
+	atomic_uint tail;
+};
+
+struct modbus_worker {
+	modbus_t *ctx;
+	pthread_t thread;
+	atomic_bool stop;
+	int req_fd;
+	int done_fd;
+	struct l_io *done_io;
+	/* Main loop -> worker */
+	struct msg_ring requests;
+	/* Worker -> main loop */
+	struct msg_ring completions;
+	/* Submitted and not yet completed, bounds the completion ring */
+	unsigned int in_flight;
+	modbus_worker_complete_cb_t complete_cb;
+	void *user_data;
+};
+
+static bool ring_push(struct msg_ring *ring,
+		      const struct modbus_worker_msg *msg)
+{
+	unsigned int tail;
+	unsigned int head;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (tail - head == WORKER_RING_SIZE)
+		return false;
+
+	ring->msgs[tail & WORKER_RING_MASK] = *msg;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	return true;
+}
+
+static bool ring_pop(struct msg_ring *ring, struct modbus_worker_msg *msg)
+{
+	unsigned int head;
+	unsigned int tail;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head == tail)
+		return false;
+
+	*msg = ring->msgs[head & WORKER_RING_MASK];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+static void eventfd_notify(int fd)
+{
+	uint64_t val = 1;
+
+	if (write(fd, &val, sizeof(val)) < 0)
+		return;
+}
+
+static void worker_execute(modbus_t *ctx, struct modbus_worker_msg *msg)
+{
+	int rc;
+
+	switch (msg->op) {
+	case MODBUS_WORKER_OP_CONNECT:
+		/* Check and close if a connection is already up */
+		if (modbus_get_socket(ctx) != -1)
+			modbus_close(ctx);
+
+		rc = modbus_connect(ctx);
+		if (rc == 0)
+			rc = modbus_get_socket(ctx);
+		break;
+	case MODBUS_WORKER_OP_SET_SOCKET:
+		/* Connected by the main loop, which enforces a deadline */
+		if (modbus_get_socket(ctx) != -1)
+			modbus_close(ctx);
+
+		rc = modbus_set_socket(ctx, msg->fd);
+		if (rc == 0)
+			rc = msg->fd;
+		break;
+	case MODBUS_WORKER_OP_READ_BITS:
+		/* Several unit ids can share the connection of a gateway */
+		rc = modbus_set_slave(ctx, msg->slave_id);
+		if (rc < 0)
+			break;
+
+		rc = modbus_read_input_bits(ctx, msg->addr, msg->count,
+					    msg->dest);
+		break;
+	case MODBUS_WORKER_OP_READ_REGISTERS:
+		rc = modbus_set_slave(ctx, msg->slave_id);
+		if (rc < 0)
+			break;
+
+		rc = modbus_read_registers(ctx, msg->addr, msg->count,
+					   msg->dest);
+		break;
+	default:
+		rc = -1;
+		errno = EINVAL;
+	}
+
+	msg->rc = rc < 0 ? -errno : rc;
+}
+
+static void *worker_thread(void *data)
+{
+	struct modbus_worker *worker = data;
+	struct modbus_worker_msg msg;
+	uint64_t val;
+
+	while (!atomic_load(&worker->stop)) {
+		if (read(worker->req_fd, &val, sizeof(val)) < 0 &&
+				errno != EINTR)
+			break;
+
+		while (!atomic_load(&worker->stop) &&
+				ring_pop(&worker->requests, &msg)) {
+			worker_execute(worker->ctx, &msg);
+			/* Can't fail: in_flight never exceeds the ring size */
+			ring_push(&worker->completions, &msg);
+			eventfd_notify(worker->done_fd);
+		}
+	}
+
+	return NULL;
+}
+
+static bool on_completion(struct l_io *io, void *user_data)
+{
+	struct modbus_worker *worker = user_data;
+	struct modbus_worker_msg msg;
+	uint64_t val;
+
+	if (read(l_io_get_fd(io), &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return true;
+
+	while (ring_pop(&worker->completions, &msg)) {
+		worker->in_flight--;
+		worker->complete_cb(&msg, worker->user_data);
+	}
+
+	return true;
+}
+
+struct modbus_worker *modbus_worker_new(modbus_t *ctx,
+					modbus_worker_complete_cb_t complete_cb,
+					void *user_data)
+{
+	struct modbus_worker *worker;
+	sigset_t mask;
+	sigset_t old_mask;
+	int err;
+
+	worker = l_new(struct modbus_worker, 1);
+	worker->ctx = ctx;
+	worker->complete_cb = complete_cb;
+	worker->user_data = user_data;
+	atomic_init(&worker->stop, false);
+	atomic_init(&worker->requests.head, 0);
+	atomic_init(&worker->requests.tail, 0);
+	atomic_init(&worker->completions.head, 0);
+	atomic_init(&worker->completions.tail, 0);
+
+	worker->req_fd = eventfd(0, EFD_CLOEXEC);
+	if (worker->req_fd < 0)
+		goto free_worker;
+
+	worker->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (worker->done_fd < 0)
+		goto close_req;
+
+	worker->done_io = l_io_new(worker->done_fd);
+	if (!worker->done_io) {
+		close(worker->done_fd);
+		goto close_req;
+	}
+
+	l_io_set_close_on_destroy(worker->done_io, true);
+	if (!l_io_set_read_handler(worker->done_io, on_completion, worker,
+				   NULL))
+		goto destroy_io;
+
+	/* Signals are handled by the main loop, never by the worker */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	err = pthread_create(&worker->thread, NULL, worker_thread, worker);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (err) {
+		errno = err;
+		goto destroy_io;
+	}
+
+	return worker;
+
+destroy_io:
+	l_io_destroy(worker->done_io);
+close_req:
+	close(worker->req_fd);
+free_worker:
+	l_free(worker);
+
+	return NULL;
+}
+
+int modbus_worker_submit(struct modbus_worker *worker,
+			 const struct modbus_worker_msg *msg)
+{
+	if (worker->in_flight == WORKER_RING_SIZE)
+		return -EAGAIN;
+
+	if (!ring_push(&worker->requests, msg))
+		return -EAGAIN;
+
+	worker->in_flight++;
+	eventfd_notify(worker->req_fd);
+
+	return 0;
+}
+
+void modbus_worker_free(struct modbus_worker *worker)
+{
+	if (!worker)
+		return;
+
+	/* Pending requests are dropped without calling their callbacks */
+	atomic_store(&worker->stop, true);
+	eventfd_notify(worker->req_fd);
+	pthread_join(worker->thread, NULL);
+
+	l_io_destroy(worker->done_io);
+	close(worker->req_fd);
+	l_free(worker);
+}
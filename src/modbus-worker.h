@@ -0,0 +1,55 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Modbus I/O worker header file
+ */
+
+enum modbus_worker_op {
+	MODBUS_WORKER_OP_CONNECT,
+	MODBUS_WORKER_OP_SET_SOCKET,
+	MODBUS_WORKER_OP_READ_BITS,
+	MODBUS_WORKER_OP_READ_REGISTERS
+};
+
+typedef void (*modbus_worker_done_cb_t) (int rc, void *user_data);
+
+struct modbus_worker_msg {
+	enum modbus_worker_op op;
+	/* Unit id the request is addressed to, ignored by connect */
+	int slave_id;
+	int addr;
+	int count;
+	void *dest;
+	/* Socket connected by the caller, only for set socket */
+	int fd;
+	/* Filled by the worker: >= 0 on success, -errno on failure */
+	int rc;
+	modbus_worker_done_cb_t done;
+	void *done_data;
+};
+
+struct modbus_worker;
+
+typedef void (*modbus_worker_complete_cb_t) (struct modbus_worker_msg *msg,
+					     void *user_data);
+
+struct modbus_worker *modbus_worker_new(modbus_t *ctx,
+					modbus_worker_complete_cb_t complete_cb,
+					void *user_data);
+int modbus_worker_submit(struct modbus_worker *worker,
+			 const struct modbus_worker_msg *msg);
+void modbus_worker_free(struct modbus_worker *worker);
@@ -0,0 +1,204 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Offline data store source file
+ *
+ *  Bounded ring of data item readings kept in a memory-mapped file, so the
+ *  readings taken while the cloud is unreachable survive a daemon restart.
+ *  When the ring is full the oldest reading is overwritten.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "offline-store.h"
+
+#define STORE_MAGIC		0x4b4e4f42 /* "KNOB" */
+#define STORE_VERSION		2
+
+struct store_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	/* Index of the oldest record */
+	uint32_t head;
+	uint32_t count;
+	/* Records overwritten because the ring was full */
+	uint32_t dropped;
+};
+
+static struct store_header *header;
+static struct offline_record *records;
+static size_t map_len;
+
+static uint64_t get_wall_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool is_header_valid(unsigned int capacity)
+{
+	return header->magic == STORE_MAGIC &&
+		header->version == STORE_VERSION &&
+		header->record_size == sizeof(struct offline_record) &&
+		header->capacity == capacity &&
+		header->head < capacity &&
+		header->count <= capacity;
+}
+
+static void header_init(unsigned int capacity)
+{
+	memset(header, 0, sizeof(*header));
+	header->magic = STORE_MAGIC;
+	header->version = STORE_VERSION;
+	header->record_size = sizeof(struct offline_record);
+	header->capacity = capacity;
+}
+
+int offline_store_open(const char *path, unsigned int capacity)
+{
+	struct stat st;
+	size_t len;
+	void *map;
+	int fd;
+	int err;
+
+	if (!path || !capacity)
+		return -EINVAL;
+
+	offline_store_close();
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0)
+		goto error;
+
+	len = sizeof(*header) + sizeof(*records) * capacity;
+	if ((size_t) st.st_size != len && ftruncate(fd, len) < 0)
+		goto error;
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto error;
+
+	/* The mapping stays valid after the descriptor is closed */
+	close(fd);
+
+	header = map;
+	records = (struct offline_record *) (header + 1);
+	map_len = len;
+
+	if (!is_header_valid(capacity)) {
+		if (st.st_size)
+			l_warn("Offline store %s discarded: layout changed",
+			       path);
+		header_init(capacity);
+	}
+
+	return 0;
+
+error:
+	err = -errno;
+	close(fd);
+
+	return err;
+}
+
+int offline_store_push(int sensor_id, uint8_t value_type, uint8_t value_len,
+		       const knot_value_type *value)
+{
+	struct offline_record *record;
+
+	if (!header)
+		return -ENODEV;
+
+	record = &records[(header->head + header->count) % header->capacity];
+	record->timestamp_ms = get_wall_time_ms();
+	record->sensor_id = sensor_id;
+	record->value_type = value_type;
+	record->value_len = value_len;
+	record->value = *value;
+
+	if (header->count < header->capacity) {
+		header->count++;
+		return 0;
+	}
+
+	/* Full: the slot just written was the oldest record */
+	header->head = (header->head + 1) % header->capacity;
+	header->dropped++;
+
+	return 0;
+}
+
+int offline_store_drain(unsigned int max, offline_store_drain_cb_t func,
+			void *user_data)
+{
+	unsigned int n;
+
+	if (!header)
+		return -ENODEV;
+
+	for (n = 0; n < max && header->count; n++) {
+		if (func(&records[header->head], user_data) < 0)
+			break;
+
+		header->head = (header->head + 1) % header->capacity;
+		header->count--;
+	}
+
+	return n;
+}
+
+unsigned int offline_store_count(void)
+{
+	return header ? header->count : 0;
+}
+
+unsigned int offline_store_dropped(void)
+{
+	return header ? header->dropped : 0;
+}
+
+void offline_store_close(void)
+{
+	if (!header)
+		return;
+
+	msync(header, map_len, MS_SYNC);
+	munmap(header, map_len);
+
+	header = NULL;
+	records = NULL;
+	map_len = 0;
+}
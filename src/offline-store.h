@@ -0,0 +1,40 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Offline data store header file
+ */
+
+struct offline_record {
+	uint64_t timestamp_ms;
+	int32_t sensor_id;
+	uint8_t value_type;
+	uint8_t value_len;
+	knot_value_type value;
+};
+
+/* Returning a negative value keeps the record and stops the drain */
+typedef int (*offline_store_drain_cb_t) (const struct offline_record *record,
+					 void *user_data);
+
+int offline_store_open(const char *path, unsigned int capacity);
+int offline_store_push(int sensor_id, uint8_t value_type, uint8_t value_len,
+		       const knot_value_type *value);
+int offline_store_drain(unsigned int max, offline_store_drain_cb_t func,
+			void *user_data);
+unsigned int offline_store_count(void);
+unsigned int offline_store_dropped(void);
+void offline_store_close(void);
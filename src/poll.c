@@ -13,63 +13,155 @@
  *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
  *  Lesser General Public License for more details.
  */
+
+/**
+ *  Poll scheduler source file
+ *
+ *  All poll entries are kept in a min-heap ordered by their next due time
+ *  and driven by a single timeout. Every expiration runs the whole batch of
+ *  entries that are due (or about to be) and re-arms the timeout for the
+ *  earliest remaining entry.
+ */
+
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ell/util.h>
 #include <ell/queue.h>
 #include <ell/timeout.h>
+#include <ell/time.h>
 
 #include "poll.h"
 
-struct poll_data {
+/* Entries due within this window are run in the same batch */
+#define POLL_BATCH_SLACK_MS	5
+
+struct poll_entry {
 	int id;
-	int interval;
+	uint64_t interval_ms;
+	uint64_t due_ms;
 	poll_read_cb_t read_cb;
 };
 
-struct poll_entry {
-	struct poll_data *data;
-	struct l_timeout *to;
-};
+static struct poll_entry **heap;
+static int heap_len;
+static struct l_timeout *poll_to;
+static bool active;
 
-struct l_queue *poll_entries;
-bool active;
+static uint64_t now_ms(void)
+{
+	return l_time_now() / 1000;
+}
 
-static void on_poll_timeout(struct l_timeout *to, void *user_data)
+static void heap_swap(int i, int j)
 {
-	struct poll_data *data;
+	struct poll_entry *tmp = heap[i];
 
-	if (!active)
-		return;
+	heap[i] = heap[j];
+	heap[j] = tmp;
+}
 
-	data = (struct poll_data *) user_data;
-	data->read_cb(data->id);
+static void heap_sift_up(int i)
+{
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (heap[parent]->due_ms <= heap[i]->due_ms)
+			break;
 
-	l_timeout_modify(to, data->interval);
+		heap_swap(i, parent);
+		i = parent;
+	}
 }
 
-static void entry_destroy(void *user_data)
+static void heap_sift_down(int i)
 {
-	struct poll_entry *entry;
+	int smallest;
+	int left;
+	int right;
+
+	for (;;) {
+		smallest = i;
+		left = 2 * i + 1;
+		right = left + 1;
+
+		if (left < heap_len &&
+				heap[left]->due_ms < heap[smallest]->due_ms)
+			smallest = left;
+		if (right < heap_len &&
+				heap[right]->due_ms < heap[smallest]->due_ms)
+			smallest = right;
+
+		if (smallest == i)
+			break;
+
+		heap_swap(i, smallest);
+		i = smallest;
+	}
+}
+
+static void poll_timer_arm(uint64_t now)
+{
+	uint64_t delay;
 
-	entry = (struct poll_entry *) user_data;
-	l_timeout_remove(entry->to);
-	l_free(entry);
+	if (!heap_len)
+		return;
+
+	delay = heap[0]->due_ms > now ? heap[0]->due_ms - now : 0;
+	/* A zero value would disarm the timer instead of firing it */
+	if (!delay)
+		delay = 1;
+
+	l_timeout_modify_ms(poll_to, delay);
 }
 
-static void poll_timer_start(void *data, void *user_data)
+static void on_poll_timeout(struct l_timeout *to, void *user_data)
 {
 	struct poll_entry *entry;
+	uint64_t now;
+	int n;
+
+	if (!active)
+		return;
+
+	now = now_ms();
+
+	/* Bounded so that short intervals can't keep a batch running */
+	for (n = 0; active && n < heap_len &&
+			heap[0]->due_ms <= now + POLL_BATCH_SLACK_MS; n++) {
+		entry = heap[0];
+		entry->read_cb(entry->id);
 
-	entry = (struct poll_entry *) data;
+		/* Skip missed periods instead of firing a burst to catch up */
+		entry->due_ms += entry->interval_ms;
+		if (entry->due_ms <= now)
+			entry->due_ms = now + entry->interval_ms;
 
-	l_timeout_modify(entry->to, entry->data->interval);
+		heap_sift_down(0);
+	}
+
+	if (active)
+		poll_timer_arm(now_ms());
 }
 
 void poll_start(void)
 {
+	uint64_t now = now_ms();
+	int i;
+
 	active = true;
-	l_queue_foreach(poll_entries, poll_timer_start, NULL);
+
+	for (i = 0; i < heap_len; i++)
+		heap[i]->due_ms = now + heap[i]->interval_ms;
+
+	for (i = heap_len / 2 - 1; i >= 0; i--)
+		heap_sift_down(i);
+
+	if (!poll_to)
+		poll_to = l_timeout_create_ms(0, on_poll_timeout, NULL, NULL);
+
+	poll_timer_arm(now);
 }
 
 void poll_stop(void)
@@ -77,36 +169,39 @@ void poll_stop(void)
 	active = false;
 }
 
-int poll_create(int interval, int id, poll_read_cb_t read_cb)
+int poll_create(int interval_ms, int id, poll_read_cb_t read_cb)
 {
 	struct poll_entry *entry;
-	struct poll_data *data;
-	struct l_timeout *to;
-
-	data = l_new(struct poll_data, 1);
-	data->id = id;
-	data->read_cb = read_cb;
-	data->interval = interval;
 
-	to = l_timeout_create(0, on_poll_timeout, data, l_free);
-	if (!to)
-		return -ENOMSG;
+	if (interval_ms <= 0 || !read_cb)
+		return -EINVAL;
 
 	entry = l_new(struct poll_entry, 1);
-	entry->data = data;
-	entry->to = to;
+	entry->id = id;
+	entry->read_cb = read_cb;
+	entry->interval_ms = interval_ms;
+	entry->due_ms = now_ms() + entry->interval_ms;
 
-	if (!poll_entries)
-		poll_entries = l_queue_new();
-	l_queue_push_head(poll_entries, entry);
+	heap = l_realloc(heap, sizeof(*heap) * (heap_len + 1));
+	heap[heap_len++] = entry;
+	heap_sift_up(heap_len - 1);
 
 	return 0;
 }
 
 void poll_destroy(void)
 {
-	if (poll_entries) {
-		l_queue_destroy(poll_entries, entry_destroy);
-		poll_entries = NULL;
-	}
+	int i;
+
+	active = false;
+
+	l_timeout_remove(poll_to);
+	poll_to = NULL;
+
+	for (i = 0; i < heap_len; i++)
+		l_free(heap[i]);
+
+	l_free(heap);
+	heap = NULL;
+	heap_len = 0;
 }
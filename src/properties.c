@@ -25,12 +25,57 @@
 #include <ell/ell.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 
+#include "event.h"
+#include "iface-modbus.h"
 #include "device.h"
 #include "properties.h"
 #include "storage.h"
+#include "snapshot.h"
 #include "conf-parameters.h"
 
+/* What set_thing_properties() read, saved as the device file snapshot */
+struct snapshot_builder {
+	struct snapshot_thing thing;
+	struct snapshot_slave *slaves;
+	unsigned int slaves_len;
+	/* Slave group name -> index of the slave + 1 */
+	struct l_hashmap *slave_groups;
+	struct snapshot_item *items;
+	unsigned int items_len;
+	/* A value doesn't fit in the snapshot, keep using the INI file */
+	bool overflow;
+};
+
+static void builder_set_string(struct snapshot_builder *builder, char *dest,
+			       size_t len, const char *str)
+{
+	if (strlen(str) >= len) {
+		builder->overflow = true;
+		return;
+	}
+
+	strcpy(dest, str);
+}
+
+static int add_modbus_slave(struct knot_thing *thing,
+			    struct snapshot_builder *builder, int id,
+			    char *url)
+{
+	struct snapshot_slave *slave;
+
+	builder->slaves = l_realloc(builder->slaves, sizeof(*slave) *
+				    (builder->slaves_len + 1));
+	slave = &builder->slaves[builder->slaves_len++];
+	memset(slave, 0, sizeof(*slave));
+	slave->id = id;
+	builder_set_string(builder, slave->url, sizeof(slave->url), url);
+
+	/* Both lists grow together: the indexes match */
+	return device_add_thing_modbus_slave(thing, id, url);
+}
+
 #define EMPTY_STRING ""
 
 static int erase_thing_id(struct knot_thing *thing, int cred_fd)
@@ -62,11 +107,30 @@ static int erase_thing_token(struct knot_thing *thing, int cred_fd)
 	return rc;
 }
 
+static int erase_schema_hash(struct knot_thing *thing, int cred_fd)
+{
+	int rc;
+
+	if (!storage_has_unit(cred_fd, CREDENTIALS_GROUP,
+			      CREDENTIALS_SCHEMA_HASH))
+		return 0;
+
+	rc = storage_remove_key(cred_fd, CREDENTIALS_GROUP,
+				CREDENTIALS_SCHEMA_HASH);
+	if (rc < 0)
+		l_error("Failed to erase schema hash");
+	else
+		device_set_thing_schema_hash(thing, 0);
+
+	return rc;
+}
+
 static int set_thing_credentials(struct knot_thing *thing, char *filename)
 {
 	int cred_fd;
 	char *thing_id;
 	char *thing_token;
+	uint64_t schema_hash;
 
 	cred_fd = storage_open(filename);
 	if (cred_fd < 0) {
@@ -82,6 +146,11 @@ static int set_thing_credentials(struct knot_thing *thing, char *filename)
 
 	device_set_thing_credentials(thing, thing_id, thing_token);
 
+	/* Optional: only present once the cloud has accepted the config */
+	if (storage_read_key_uint64(cred_fd, CREDENTIALS_GROUP,
+				    CREDENTIALS_SCHEMA_HASH, &schema_hash) > 0)
+		device_set_thing_schema_hash(thing, schema_hash);
+
 	l_free(thing_id);
 	l_free(thing_token);
 
@@ -158,6 +227,21 @@ static int set_modbus_source_properties(struct knot_thing *thing,
 	if (rc <= 0)
 		return -EINVAL;
 
+	if (schema.value_type == KNOT_VALUE_TYPE_RAW) {
+		/* RAW values are kept in register order, no endianness */
+		rc = storage_read_key_int(fd, group_id, MODBUS_REGISTER_COUNT,
+					  &bit_offset_aux);
+		if (rc <= 0 || bit_offset_aux <= 0 ||
+				bit_offset_aux > TYPE_RAW_MAX / TYPE_U16)
+			return -EINVAL;
+
+		*bit_offset = bit_offset_aux * TYPE_U16;
+		*reg_addr = reg_addr_aux;
+		*endianness_type = MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN;
+
+		return 0;
+	}
+
 	rc = storage_read_key_int(fd, group_id, MODBUS_TYPE_ENDIANNESS,
 				  &endianness_type_aux);
 	if (rc <= 0)
@@ -179,6 +263,56 @@ static int set_modbus_source_properties(struct knot_thing *thing,
 	return 0;
 }
 
+static int set_polling_interval(int fd, char *group_id, int *interval_ms)
+{
+	int rc;
+	int interval_aux;
+
+	rc = storage_read_key_int(fd, group_id, POLLING_INTERVAL_MS,
+				  &interval_aux);
+	if (rc < 0)
+		return -EINVAL;
+
+	if (rc == 0) {
+		*interval_ms = POLLING_INTERVAL_DEFAULT_MS;
+		return 0;
+	}
+
+	if (interval_aux < POLLING_INTERVAL_MIN_MS)
+		return -EINVAL;
+
+	*interval_ms = interval_aux;
+
+	return 0;
+}
+
+static int set_modbus_slave(int fd, char *group_id,
+			    struct l_hashmap *slave_groups, int *slave)
+{
+	char *name;
+	int index;
+
+	/* Optional: defaults to the slave of the KNoTThing group */
+	name = storage_read_key_string(fd, group_id, MODBUS_SLAVE);
+	if (!name) {
+		*slave = 0;
+		return 0;
+	}
+
+	index = L_PTR_TO_INT(l_hashmap_lookup(slave_groups, name));
+	if (!index)
+		l_error("Unknown Modbus slave group: %s", name);
+
+	l_free(name);
+
+	if (!index)
+		return -EINVAL;
+
+	*slave = index - 1;
+
+	return 0;
+}
+
 static int get_upper_limit(int fd, char *group_id, int value_type,
 			   knot_value_type *temp)
 {
@@ -372,6 +506,47 @@ static int set_event(struct knot_thing *thing, int fd, char *group_id,
 	return 0;
 }
 
+static int get_event_band(int fd, char *group_id, const char *key,
+			  float *band)
+{
+	float aux;
+
+	/* Optional: keeps the default of no band */
+	if (storage_read_key_float(fd, group_id, key, &aux) <= 0)
+		return 0;
+
+	/* Also rejects NaN */
+	if (!(aux >= 0))
+		return -EINVAL;
+
+	*band = aux;
+
+	return 0;
+}
+
+static int set_event_filter(int fd, char *group_id,
+			    struct event_filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+
+	if (get_event_band(fd, group_id, EVENT_HYSTERESIS,
+			   &filter->hysteresis) < 0)
+		return -EINVAL;
+
+	if (filter->hysteresis > EVENT_HYSTERESIS_MAX)
+		filter->hysteresis = EVENT_HYSTERESIS_MAX;
+
+	if (get_event_band(fd, group_id, EVENT_DEADBAND_ABS,
+			   &filter->deadband_abs) < 0)
+		return -EINVAL;
+
+	if (get_event_band(fd, group_id, EVENT_DEADBAND_PCT,
+			   &filter->deadband_pct) < 0)
+		return -EINVAL;
+
+	return 0;
+}
+
 static int set_schema(struct knot_thing *thing, int fd, char *group_id,
 		      knot_schema *schema)
 {
@@ -425,6 +600,10 @@ static int set_sensor_id(struct knot_thing *thing, int fd, char *group_id,
 	if (rc <= 0)
 		return -EINVAL;
 
+	if (sensor_id_aux < SCHEMA_MIN_SENSOR_ID ||
+			sensor_id_aux > SCHEMA_MAX_SENSOR_ID)
+		return -EINVAL;
+
 	if (device_data_item_lookup(thing, sensor_id_aux))
 		return -EINVAL;
 
@@ -433,18 +612,23 @@ static int set_sensor_id(struct knot_thing *thing, int fd, char *group_id,
 	return 0;
 }
 
-static int set_data_items(struct knot_thing *thing, int fd)
+static int set_data_items(struct knot_thing *thing, int fd,
+			  struct snapshot_builder *builder)
 {
+	struct snapshot_item *item;
 	int rc;
 	int i;
 	char **data_item_group;
 
 	int sensor_id;
+	int slave;
 	int reg_addr;
 	int bit_offset;
 	int endianness_type;
+	int polling_interval_ms;
 	knot_schema schema;
 	knot_event event;
+	struct event_filter filter;
 
 	data_item_group = get_data_item_groups(fd);
 
@@ -475,6 +659,13 @@ static int set_data_items(struct knot_thing *thing, int fd)
 			goto error;
 		}
 
+		rc = set_event_filter(fd, data_item_group[i], &filter);
+		if (rc < 0) {
+			l_error("Failed to set event filter on %s",
+				data_item_group[i]);
+			goto error;
+		}
+
 		rc = set_modbus_source_properties(thing, fd, data_item_group[i],
 						  schema, &reg_addr,
 						  &bit_offset,
@@ -485,8 +676,46 @@ static int set_data_items(struct knot_thing *thing, int fd)
 			goto error;
 		}
 
-		device_set_new_data_item(thing, sensor_id, schema, event,
-					 reg_addr, bit_offset, endianness_type);
+		rc = set_polling_interval(fd, data_item_group[i],
+					  &polling_interval_ms);
+		if (rc < 0) {
+			l_error("Failed to set polling interval on %s",
+				data_item_group[i]);
+			goto error;
+		}
+
+		rc = set_modbus_slave(fd, data_item_group[i],
+				      builder->slave_groups, &slave);
+		if (rc < 0) {
+			l_error("Failed to set Modbus slave on %s",
+				data_item_group[i]);
+			goto error;
+		}
+
+		rc = device_set_new_data_item(thing, sensor_id, schema, event,
+					      &filter, slave, reg_addr,
+					      bit_offset, endianness_type,
+					      polling_interval_ms);
+		if (rc < 0) {
+			l_error("Failed to add data item %s",
+				data_item_group[i]);
+			goto error;
+		}
+
+		builder->items = l_realloc(builder->items,
+					   sizeof(*item) * (i + 1));
+		item = &builder->items[i];
+		memset(item, 0, sizeof(*item));
+		item->sensor_id = sensor_id;
+		item->slave = slave;
+		item->reg_addr = reg_addr;
+		item->bit_offset = bit_offset;
+		item->endianness_type = endianness_type;
+		item->polling_interval_ms = polling_interval_ms;
+		item->schema = schema;
+		item->event = event;
+		item->filter = filter;
+		builder->items_len = i + 1;
 	}
 
 	l_strfreev(data_item_group);
@@ -499,8 +728,38 @@ error:
 	return -EINVAL;
 }
 
-static int set_modbus_slave_properties(struct knot_thing *thing, int fd)
+struct slave_group_data {
+	struct knot_thing *thing;
+	struct snapshot_builder *builder;
+	int err;
+};
+
+static void foreach_slave_group(const char *key, int id, const char *name,
+				const char *address, void *user_data)
 {
+	struct slave_group_data *data = user_data;
+	int index;
+
+	if (id < MODBUS_MIN_SLAVE_ID || id > MODBUS_MAX_SLAVE_ID ||
+	    !strcmp(address, "")) {
+		l_error("Invalid Modbus slave group: %s", key);
+		data->err = -EINVAL;
+		return;
+	}
+
+	index = add_modbus_slave(data->thing, data->builder, id,
+				 l_strdup(address));
+	l_hashmap_insert(data->builder->slave_groups, key,
+			 L_INT_TO_PTR(index + 1));
+}
+
+static int set_modbus_slave_properties(struct knot_thing *thing, int fd,
+				       struct snapshot_builder *builder)
+{
+	struct slave_group_data slave_data = {
+		.thing = thing,
+		.builder = builder
+	};
 	int rc;
 	int aux;
 	int id;
@@ -520,7 +779,138 @@ static int set_modbus_slave_properties(struct knot_thing *thing, int fd)
 		return -EINVAL;
 	/* TODO: Check if modbus url is in a valid format */
 
-	device_set_thing_modbus_slave(thing, id, url);
+	/* Index 0, the slave of the data items without ModbusSlave */
+	add_modbus_slave(thing, builder, id, url);
+
+	/* Optional: registers/bits allowed between coalesced data items */
+	rc = storage_read_key_int(fd, THING_GROUP, THING_MODBUS_READ_MAX_GAP,
+				  &aux);
+	if (rc > 0) {
+		if (aux < 0)
+			return -EINVAL;
+
+		device_set_thing_read_max_gap(thing, aux);
+		builder->thing.read_max_gap = aux;
+	}
+
+	/* Optional: pipelined requests per Modbus TCP connection */
+	rc = storage_read_key_int(fd, THING_GROUP, THING_MODBUS_TCP_WINDOW,
+				  &aux);
+	if (rc > 0) {
+		if (aux < 0 || aux > MODBUS_TCP_WINDOW_MAX)
+			return -EINVAL;
+
+		device_set_thing_modbus_tcp_window(thing, aux);
+		builder->thing.modbus_tcp_window = aux;
+	}
+
+	/* Optional: more slaves, each in a group with Id, Name and URL */
+	storage_foreach_slave(fd, foreach_slave_group, &slave_data);
+
+	return slave_data.err;
+}
+
+static int set_modbus_reconnect(struct knot_thing *thing, int fd,
+				struct snapshot_builder *builder)
+{
+	bool has_initial = true;
+	int initial_ms;
+	int max_ms;
+	float multiplier;
+
+	/* Optional: bounds of the random delay between connect attempts */
+	if (storage_read_key_int(fd, THING_GROUP,
+				 THING_MODBUS_RECONNECT_INITIAL_MS,
+				 &initial_ms) <= 0) {
+		initial_ms = RECONNECT_DEFAULT_INITIAL_MS;
+		has_initial = false;
+	} else if (initial_ms <= 0) {
+		return -EINVAL;
+	}
+
+	if (storage_read_key_int(fd, THING_GROUP,
+				 THING_MODBUS_RECONNECT_MAX_MS, &max_ms) <= 0) {
+		max_ms = initial_ms > RECONNECT_DEFAULT_MAX_MS ?
+			initial_ms : RECONNECT_DEFAULT_MAX_MS;
+	} else if (max_ms < initial_ms) {
+		/* Only a default initial delay gives way to the maximum */
+		if (has_initial || max_ms <= 0)
+			return -EINVAL;
+		initial_ms = max_ms;
+	}
+
+	/* The bound grows by this factor after each failed attempt */
+	if (storage_read_key_float(fd, THING_GROUP,
+				   THING_MODBUS_RECONNECT_MULTIPLIER,
+				   &multiplier) <= 0)
+		multiplier = RECONNECT_DEFAULT_MULTIPLIER;
+	else if (!(multiplier >= 1))
+		return -EINVAL;
+
+	device_set_thing_modbus_reconnect(thing, initial_ms, max_ms,
+					  multiplier);
+	builder->thing.reconnect_initial_ms = initial_ms;
+	builder->thing.reconnect_max_ms = max_ms;
+	builder->thing.reconnect_multiplier = multiplier;
+
+	return 0;
+}
+
+static int set_publish_window(struct knot_thing *thing, int fd,
+			      struct snapshot_builder *builder)
+{
+	int rc;
+	int window_ms;
+
+	/* Optional: time to gather data updates before publishing them */
+	rc = storage_read_key_int(fd, THING_GROUP, THING_PUBLISH_WINDOW_MS,
+				  &window_ms);
+	if (rc <= 0)
+		window_ms = PUBLISH_WINDOW_DEFAULT_MS;
+	else if (window_ms < 0)
+		return -EINVAL;
+
+	device_set_thing_publish_window(thing, window_ms);
+	builder->thing.publish_window_ms = window_ms;
+
+	return 0;
+}
+
+static int set_offline_store(struct knot_thing *thing, int fd,
+			     struct snapshot_builder *builder)
+{
+	char *path;
+	int capacity;
+	int rate;
+
+	/* Optional: readings kept while offline, 0 disables the store */
+	if (storage_read_key_int(fd, THING_GROUP, THING_OFFLINE_STORE_SIZE,
+				 &capacity) <= 0)
+		capacity = OFFLINE_STORE_DEFAULT_SIZE;
+	else if (capacity < 0)
+		return -EINVAL;
+
+	/* Optional: readings per second sent back once online */
+	if (storage_read_key_int(fd, THING_GROUP, THING_OFFLINE_REPLAY_RATE,
+				 &rate) <= 0)
+		rate = OFFLINE_REPLAY_DEFAULT_RATE;
+	else if (rate <= 0)
+		return -EINVAL;
+
+	/* Optional: defaults to a file next to the credentials */
+	path = storage_read_key_string(fd, THING_GROUP,
+				       THING_OFFLINE_STORE_PATH);
+	if (path && !strcmp(path, "")) {
+		l_free(path);
+		path = NULL;
+	}
+
+	device_set_thing_offline_store(thing, path, capacity, rate);
+	builder->thing.offline_capacity = capacity;
+	builder->thing.offline_replay_rate = rate;
+	if (path)
+		builder_set_string(builder, builder->thing.offline_path,
+				   sizeof(builder->thing.offline_path), path);
 
 	return 0;
 }
@@ -539,7 +929,8 @@ static int set_thing_user_token(struct knot_thing *thing, int fd)
 	return 0;
 }
 
-static int set_thing_name(struct knot_thing *thing, int fd)
+static int set_thing_name(struct knot_thing *thing, int fd,
+			  struct snapshot_builder *builder)
 {
 	char *knot_thing_name;
 
@@ -551,12 +942,14 @@ static int set_thing_name(struct knot_thing *thing, int fd)
 	}
 
 	device_set_thing_name(thing, knot_thing_name);
+	strcpy(builder->thing.name, knot_thing_name);
 	l_free(knot_thing_name);
 
 	return 0;
 }
 
-static int set_thing_properties(struct knot_thing *thing, char *filename)
+static int set_thing_properties(struct knot_thing *thing, char *filename,
+				struct snapshot_builder *builder)
 {
 	int device_fd;
 	int rc;
@@ -567,21 +960,42 @@ static int set_thing_properties(struct knot_thing *thing, char *filename)
 		return device_fd;
 	}
 
-	rc = set_thing_name(thing, device_fd);
+	rc = set_thing_name(thing, device_fd, builder);
 	if (rc < 0) {
 		l_error("Failed to set Thing name");
 		storage_close(device_fd);
 		return rc;
 	}
 
-	rc = set_modbus_slave_properties(thing, device_fd);
+	rc = set_modbus_slave_properties(thing, device_fd, builder);
 	if (rc < 0) {
 		l_error("Failed to set Modbus Slave properties");
 		storage_close(device_fd);
 		return rc;
 	}
 
-	rc = set_data_items(thing, device_fd);
+	rc = set_modbus_reconnect(thing, device_fd, builder);
+	if (rc < 0) {
+		l_error("Failed to set Modbus reconnection backoff");
+		storage_close(device_fd);
+		return rc;
+	}
+
+	rc = set_publish_window(thing, device_fd, builder);
+	if (rc < 0) {
+		l_error("Failed to set publish window");
+		storage_close(device_fd);
+		return rc;
+	}
+
+	rc = set_offline_store(thing, device_fd, builder);
+	if (rc < 0) {
+		l_error("Failed to set offline store");
+		storage_close(device_fd);
+		return rc;
+	}
+
+	rc = set_data_items(thing, device_fd, builder);
 	if (rc < 0) {
 		l_error("Failed to set KNoT Data items");
 		storage_close(device_fd);
@@ -593,6 +1007,117 @@ static int set_thing_properties(struct knot_thing *thing, char *filename)
 	return rc;
 }
 
+static int load_data_items(struct knot_thing *thing,
+			   const struct snapshot *snap)
+{
+	const struct snapshot_item *item;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < snap->items_len; i++) {
+		item = &snap->items[i];
+		rc = device_set_new_data_item(thing, item->sensor_id,
+					      item->schema, item->event,
+					      &item->filter, item->slave,
+					      item->reg_addr,
+					      item->bit_offset,
+					      item->endianness_type,
+					      item->polling_interval_ms);
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int load_thing_snapshot(struct knot_thing *thing,
+			       const struct snapshot *snap)
+{
+	unsigned int i;
+
+	device_set_thing_name(thing, snap->thing->name);
+	device_set_thing_read_max_gap(thing, snap->thing->read_max_gap);
+	device_set_thing_modbus_tcp_window(thing,
+					   snap->thing->modbus_tcp_window);
+	device_set_thing_modbus_reconnect(thing,
+					  snap->thing->reconnect_initial_ms,
+					  snap->thing->reconnect_max_ms,
+					  snap->thing->reconnect_multiplier);
+	device_set_thing_publish_window(thing, snap->thing->publish_window_ms);
+	device_set_thing_offline_store(thing, snap->thing->offline_path[0] ?
+				       l_strdup(snap->thing->offline_path) :
+				       NULL,
+				       snap->thing->offline_capacity,
+				       snap->thing->offline_replay_rate);
+
+	for (i = 0; i < snap->slaves_len; i++)
+		device_add_thing_modbus_slave(thing, snap->slaves[i].id,
+					      l_strdup(snap->slaves[i].url));
+
+	return load_data_items(thing, snap);
+}
+
+/*
+ * The device file is only parsed when it changed since the snapshot next
+ * to it was taken, or when the snapshot can't be applied. The snapshot is
+ * then taken again.
+ */
+static int set_device_properties(struct knot_thing *thing, char *filename)
+{
+	struct snapshot_builder builder;
+	struct snapshot_key key;
+	struct snapshot snap;
+	char *snapshot_path;
+	bool has_key;
+	int rc;
+
+	snapshot_path = l_strdup_printf("%s%s", filename, SNAPSHOT_SUFFIX);
+
+	/* Taken before parsing: a file changed meanwhile is seen as stale */
+	has_key = snapshot_get_key(filename, &key) == 0;
+
+	if (has_key && snapshot_load(snapshot_path, &key, &snap) == 0) {
+		rc = load_thing_snapshot(thing, &snap);
+		snapshot_unload();
+
+		if (rc == 0) {
+			l_debug("Device properties loaded from %s",
+				snapshot_path);
+			l_free(snapshot_path);
+			return 0;
+		}
+
+		/* Part of it may be applied already: start over */
+		l_warn("Invalid device snapshot %s, parsing %s",
+		       snapshot_path, filename);
+		device_clear_thing_items(thing);
+		unlink(snapshot_path);
+	}
+
+	memset(&builder, 0, sizeof(builder));
+	builder.slave_groups = l_hashmap_string_new();
+
+	rc = set_thing_properties(thing, filename, &builder);
+	if (rc == 0 && has_key && !builder.overflow) {
+		snap.thing = &builder.thing;
+		snap.slaves = builder.slaves;
+		snap.slaves_len = builder.slaves_len;
+		snap.items = builder.items;
+		snap.items_len = builder.items_len;
+
+		if (snapshot_save(snapshot_path, &key, &snap) < 0)
+			l_warn("Couldn't save device snapshot %s",
+			       snapshot_path);
+	}
+
+	l_hashmap_destroy(builder.slave_groups, NULL);
+	l_free(builder.slaves);
+	l_free(builder.items);
+	l_free(snapshot_path);
+
+	return rc;
+}
+
 static int set_cloud_properties(struct knot_thing *thing, char *filename)
 {
 	int rc;
@@ -728,7 +1253,7 @@ int properties_create_device(struct knot_thing *thing,
 {
 	int rc;
 
-	rc = set_thing_properties(thing, conf_files->device_path);
+	rc = set_device_properties(thing, conf_files->device_path);
 	if (rc < 0) {
 		l_error("Failed to set Thing properties");
 		return rc;
@@ -768,6 +1293,10 @@ int properties_clear_credentials(struct knot_thing *thing, char *filename)
 	if (rc < 0)
 		goto error;
 
+	rc = erase_schema_hash(thing, cred_fd);
+	if (rc < 0)
+		goto error;
+
 	storage_close(cred_fd);
 
 	return rc;
@@ -820,12 +1349,80 @@ error:
 	return -EINVAL;
 }
 
-int properties_update_data_item(struct knot_thing *thing, char *filename,
-				knot_msg_config *config)
+int properties_store_schema_hash(struct knot_thing *thing, char *filename,
+				 uint64_t schema_hash)
+{
+	int rc;
+	int cred_fd;
+
+	cred_fd = storage_open(filename);
+	if (cred_fd < 0) {
+		l_error("Failed to open credentials file");
+		return cred_fd;
+	}
+
+	rc = storage_write_key_uint64(cred_fd, CREDENTIALS_GROUP,
+				      CREDENTIALS_SCHEMA_HASH, schema_hash);
+	if (rc < 0)
+		l_error("Failed to store schema hash");
+
+	storage_close(cred_fd);
+
+	return rc;
+}
+
+static const char *find_data_item_group(int fd, char **groups, int sensor_id)
+{
+	int i;
+
+	for (i = 0; groups[i] != NULL; i++) {
+		if (equal_sensor_id(fd, groups[i], sensor_id))
+			return groups[i];
+	}
+
+	return NULL;
+}
+
+static int update_data_item(struct knot_thing *thing, int fd, char **groups,
+			    knot_msg_config *config)
 {
+	const char *group_id;
+	int rc = 0;
+
+	/* Update values on knot_thing struct */
+	device_update_config_data_item(thing, config);
+
+	group_id = find_data_item_group(fd, groups, config->sensor_id);
+	if (!group_id)
+		return 0;
+
+	if (update_schema_data_item(fd, group_id, &config->schema) < 0) {
+		rc = -1;
+		l_error("Error on set schema property");
+	}
+
+	if (!(config->event.event_flags & KNOT_EVT_FLAG_UNREGISTERED)) {
+		if (update_event_data_item(fd, group_id,
+					   config->schema.value_type,
+					   &config->event) < 0) {
+			rc = -1;
+			l_error("Error on set event property");
+		}
+	}
+
+	return rc;
+}
+
+/*
+ * The device file is parsed once and written once for the whole list,
+ * instead of once per key of every data item.
+ */
+int properties_update_data_items(struct knot_thing *thing, char *filename,
+				 struct l_queue *config_list)
+{
+	const struct l_queue_entry *entry;
 	char **data_item_group;
 	int device_fd;
-	int i;
 	bool has_err;
 
 	device_fd = storage_open(filename);
@@ -834,35 +1431,28 @@ int properties_update_data_item(struct knot_thing *thing, char *filename,
 		return device_fd;
 	}
 
-	/* Update values on knot_thing struct */
-	device_update_config_data_item(thing, config);
-
-	has_err = false;
 	data_item_group = get_data_item_groups(device_fd);
+	if (!data_item_group) {
+		storage_close(device_fd);
+		return -EINVAL;
+	}
 
-	for (i = 0; data_item_group[i] != NULL; i++) {
-		if (!equal_sensor_id(device_fd, data_item_group[i],
-				     config->sensor_id))
-			continue;
+	has_err = false;
+	storage_begin(device_fd);
 
-		if (update_schema_data_item(device_fd, data_item_group[i],
-					    &config->schema) < 0) {
+	for (entry = l_queue_get_entries(config_list); entry;
+	     entry = entry->next) {
+		if (update_data_item(thing, device_fd, data_item_group,
+				     entry->data) < 0)
 			has_err = true;
-			l_error("Error on set schema property");
-		}
+	}
 
-		if (!(config->event.event_flags & KNOT_EVT_FLAG_UNREGISTERED)) {
-			if (update_event_data_item(device_fd,
-						   data_item_group[i],
-						   config->schema.value_type,
-						   &config->event) < 0) {
-				has_err = true;
-				l_error("Error on set event property");
-			}
-		}
-		break;
+	if (storage_commit(device_fd) < 0) {
+		has_err = true;
+		l_error("Failed to save device file");
 	}
 
+	l_strfreev(data_item_group);
 	storage_close(device_fd);
 
 	if (has_err)
@@ -0,0 +1,253 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Modbus read planner source file
+ *
+ *  Groups data items that share a polling interval and a slave and whose
+ *  register ranges are contiguous (or separated by at most max_gap units)
+ *  into a single Modbus request, so a poll cycle costs one round trip per
+ *  block instead of one per data item.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "iface-modbus.h"
+#include "read-plan.h"
+
+struct plan_item {
+	int id;
+	int slave;
+	int interval_ms;
+	enum read_plan_space space;
+	int addr;
+	int count;
+};
+
+static struct plan_item *plan_items;
+static int plan_items_len;
+static struct read_plan_block **plan_blocks;
+static int plan_blocks_len;
+
+static int get_item_span(int bit_offset, enum read_plan_space *space,
+			 int *count)
+{
+	switch (bit_offset) {
+	case TYPE_BOOL:
+	case TYPE_BYTE:
+		*space = READ_PLAN_SPACE_BITS;
+		*count = bit_offset;
+		break;
+	default:
+		/* 16, 32 and 64-bit values or a RAW block of registers */
+		if (bit_offset <= 0 || bit_offset % TYPE_U16 ||
+				bit_offset > TYPE_RAW_MAX)
+			return -EINVAL;
+
+		*space = READ_PLAN_SPACE_REGISTERS;
+		*count = bit_offset / TYPE_U16;
+	}
+
+	return 0;
+}
+
+static int get_space_limit(enum read_plan_space space)
+{
+	return space == READ_PLAN_SPACE_BITS ? MODBUS_MAX_READ_BITS :
+					       MODBUS_MAX_READ_REGISTERS;
+}
+
+static int compare_plan_item(const void *a, const void *b)
+{
+	const struct plan_item *item1 = a;
+	const struct plan_item *item2 = b;
+
+	if (item1->interval_ms != item2->interval_ms)
+		return item1->interval_ms < item2->interval_ms ? -1 : 1;
+
+	if (item1->slave != item2->slave)
+		return item1->slave < item2->slave ? -1 : 1;
+
+	if (item1->space != item2->space)
+		return item1->space < item2->space ? -1 : 1;
+
+	if (item1->addr != item2->addr)
+		return item1->addr < item2->addr ? -1 : 1;
+
+	return item1->count - item2->count;
+}
+
+static void block_destroy(struct read_plan_block *block)
+{
+	l_queue_destroy(block->entries, l_free);
+	l_free(block->buf);
+	l_free(block);
+}
+
+static struct read_plan_block *block_new(struct plan_item *item)
+{
+	struct read_plan_block *block;
+
+	block = l_new(struct read_plan_block, 1);
+	block->interval_ms = item->interval_ms;
+	block->slave = item->slave;
+	block->space = item->space;
+	block->addr = item->addr;
+	block->count = item->count;
+	block->entries = l_queue_new();
+
+	return block;
+}
+
+static bool block_fits(struct read_plan_block *block, struct plan_item *item,
+		       int max_gap)
+{
+	int block_end = block->addr + block->count;
+	int item_end = item->addr + item->count;
+
+	if (block->interval_ms != item->interval_ms ||
+			block->slave != item->slave ||
+			block->space != item->space)
+		return false;
+
+	if (item->addr - block_end > max_gap)
+		return false;
+
+	if (item_end > block_end &&
+			item_end - block->addr > get_space_limit(block->space))
+		return false;
+
+	return true;
+}
+
+static void block_add_item(struct read_plan_block *block,
+			   struct plan_item *item)
+{
+	struct read_plan_entry *entry;
+	int item_end = item->addr + item->count;
+
+	if (item_end > block->addr + block->count)
+		block->count = item_end - block->addr;
+
+	entry = l_new(struct read_plan_entry, 1);
+	entry->id = item->id;
+	entry->offset = item->addr - block->addr;
+	l_queue_push_tail(block->entries, entry);
+}
+
+static void block_alloc_buf(struct read_plan_block *block)
+{
+	size_t unit_size;
+
+	unit_size = block->space == READ_PLAN_SPACE_BITS ? sizeof(uint8_t) :
+							   sizeof(uint16_t);
+	block->buf = l_malloc(unit_size * block->count);
+}
+
+int read_plan_add_item(int id, int slave, int reg_addr, int bit_offset,
+		       int interval_ms)
+{
+	struct plan_item *item;
+	enum read_plan_space space;
+	int count;
+
+	if (reg_addr < 0 || interval_ms <= 0 ||
+			get_item_span(bit_offset, &space, &count) < 0)
+		return -EINVAL;
+
+	plan_items = l_realloc(plan_items,
+			       sizeof(*plan_items) * (plan_items_len + 1));
+	item = &plan_items[plan_items_len++];
+	item->id = id;
+	item->slave = slave;
+	item->interval_ms = interval_ms;
+	item->space = space;
+	item->addr = reg_addr;
+	item->count = count;
+
+	return 0;
+}
+
+int read_plan_build(int max_gap)
+{
+	struct read_plan_block *block = NULL;
+	int i;
+
+	if (max_gap < 0)
+		return -EINVAL;
+
+	qsort(plan_items, plan_items_len, sizeof(*plan_items),
+	      compare_plan_item);
+
+	for (i = 0; i < plan_items_len; i++) {
+		if (!block || !block_fits(block, &plan_items[i], max_gap)) {
+			block = block_new(&plan_items[i]);
+			plan_blocks = l_realloc(plan_blocks,
+						sizeof(*plan_blocks) *
+						(plan_blocks_len + 1));
+			plan_blocks[plan_blocks_len++] = block;
+		}
+
+		block_add_item(block, &plan_items[i]);
+	}
+
+	for (i = 0; i < plan_blocks_len; i++)
+		block_alloc_buf(plan_blocks[i]);
+
+	l_free(plan_items);
+	plan_items = NULL;
+	plan_items_len = 0;
+
+	return plan_blocks_len;
+}
+
+struct read_plan_block *read_plan_get_block(int block_id)
+{
+	if (block_id < 0 || block_id >= plan_blocks_len)
+		return NULL;
+
+	return plan_blocks[block_id];
+}
+
+void read_plan_foreach_block(read_plan_foreach_block_t func, void *user_data)
+{
+	int i;
+
+	for (i = 0; i < plan_blocks_len; i++)
+		func(i, plan_blocks[i], user_data);
+}
+
+void read_plan_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < plan_blocks_len; i++)
+		block_destroy(plan_blocks[i]);
+
+	l_free(plan_blocks);
+	plan_blocks = NULL;
+	plan_blocks_len = 0;
+
+	l_free(plan_items);
+	plan_items = NULL;
+	plan_items_len = 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Modbus read planner header file
+ */
+
+enum read_plan_space {
+	READ_PLAN_SPACE_BITS,
+	READ_PLAN_SPACE_REGISTERS
+};
+
+struct read_plan_entry {
+	int id;
+	int offset;
+};
+
+struct read_plan_block {
+	int interval_ms;
+	/* Index of the slave all the entries are read from */
+	int slave;
+	enum read_plan_space space;
+	int addr;
+	int count;
+	void *buf;
+	bool in_flight;
+	struct l_queue *entries;
+};
+
+typedef void (*read_plan_foreach_block_t)(int block_id,
+					  struct read_plan_block *block,
+					  void *user_data);
+
+int read_plan_add_item(int id, int slave, int reg_addr, int bit_offset,
+		       int interval_ms);
+int read_plan_build(int max_gap);
+struct read_plan_block *read_plan_get_block(int block_id);
+void read_plan_foreach_block(read_plan_foreach_block_t func, void *user_data);
+void read_plan_destroy(void);
@@ -152,10 +152,14 @@ enum STATES get_next_disconnected(enum EVENTS event, void *user_data)
 	case EVT_CFG_UPT_NOT_OK:
 	case EVT_UNREG_REQ:
 	case EVT_REG_PERM:
-	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
 		next_state = ST_DISCONNECTED;
 		break;
+	case EVT_PUB_DATA:
+		/* Kept on disk and sent once the thing is online */
+		device_store_data_list(user_data);
+		next_state = ST_DISCONNECTED;
+		break;
 	default:
 		next_state = ST_ERROR;
 	}
@@ -201,10 +205,14 @@ enum STATES get_next_auth(enum EVENTS event, void *user_data)
 	case EVT_CFG_UPT_OK:
 	case EVT_CFG_UPT_NOT_OK:
 	case EVT_REG_PERM:
-	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
 		next_state = ST_AUTH;
 		break;
+	case EVT_PUB_DATA:
+		/* Kept on disk and sent once the thing is online */
+		device_store_data_list(user_data);
+		next_state = ST_AUTH;
+		break;
 	default:
 		next_state = ST_ERROR;
 	}
@@ -267,10 +275,14 @@ enum STATES get_next_register(enum EVENTS event, void *user_data)
 	case EVT_CFG_UPT_OK:
 	case EVT_CFG_UPT_NOT_OK:
 	case EVT_REG_PERM:
-	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
 		next_state = ST_REGISTER;
 		break;
+	case EVT_PUB_DATA:
+		/* Kept on disk and sent once the thing is online */
+		device_store_data_list(user_data);
+		next_state = ST_REGISTER;
+		break;
 	default:
 		next_state = ST_ERROR;
 	}
@@ -301,6 +313,8 @@ enum STATES get_next_config(enum EVENTS event, void *user_data)
 		break;
 	case EVT_CFG_UPT_OK:
 		device_msg_timeout_remove();
+		if (device_store_schema_on_file() < 0)
+			l_error("Couldn't store schema hash");
 		next_state = ST_ONLINE;
 		break;
 	case EVT_CFG_UPT_NOT_OK:
@@ -324,10 +338,14 @@ enum STATES get_next_config(enum EVENTS event, void *user_data)
 	case EVT_REG_OK:
 	case EVT_REG_NOT_OK:
 	case EVT_REG_PERM:
-	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
 		next_state = ST_CONFIG;
 		break;
+	case EVT_PUB_DATA:
+		/* Kept on disk and sent once the thing is online */
+		device_store_data_list(user_data);
+		next_state = ST_CONFIG;
+		break;
 	default:
 		next_state = ST_ERROR;
 		break;
@@ -355,6 +373,7 @@ enum STATES get_next_online(enum EVENTS event, void *user_data)
 
 	switch(event) {
 	case EVT_NOT_READY:
+		device_stop_offline_replay();
 		device_stop_event();
 		next_state = ST_DISCONNECTED;
 		break;
@@ -367,6 +386,7 @@ enum STATES get_next_online(enum EVENTS event, void *user_data)
 		next_state = ST_ONLINE;
 		break;
 	case EVT_UNREG_REQ:
+		device_stop_offline_replay();
 		next_state = ST_UNREGISTER;
 		break;
 	case EVT_CFG_UPT_OK:
@@ -403,6 +423,8 @@ static void enter_online(void)
 	err = device_start_event();
 	if (err < 0)
 		l_error("Couldn't start config");
+
+	device_start_offline_replay();
 }
 
 /* UNREGISTER */
@@ -0,0 +1,297 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Device file snapshot source file
+ *
+ *  Binary copy of the validated device file, kept next to it and mapped
+ *  on startup instead of parsing the INI file again. A snapshot is only
+ *  used while the device file still has the mtime, size and contents
+ *  hash it was taken from.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "event.h"
+#include "snapshot.h"
+#include "hash.h"
+
+#define SNAPSHOT_MAGIC		0x4b4e4f53 /* "KNOS" */
+#define SNAPSHOT_VERSION	4
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	/* Catch layout changes of the structs between builds */
+	uint32_t thing_size;
+	uint32_t slave_size;
+	uint32_t item_size;
+	uint32_t slaves_len;
+	uint32_t items_len;
+	uint32_t reserved;
+	struct snapshot_key key;
+};
+
+static void *map;
+static size_t map_len;
+
+int snapshot_get_key(const char *conf_path, struct snapshot_key *key)
+{
+	struct stat st;
+	void *data;
+	int fd;
+	int err = 0;
+
+	fd = open(conf_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	memset(key, 0, sizeof(*key));
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->size = st.st_size;
+	key->hash = HASH_INIT;
+
+	if (!st.st_size)
+		goto done;
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		err = -errno;
+		goto done;
+	}
+
+	key->hash = hash_bytes(HASH_INIT, data, st.st_size);
+	munmap(data, st.st_size);
+
+done:
+	close(fd);
+
+	return err;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int snapshot_save(const char *path, const struct snapshot_key *key,
+		  const struct snapshot *snap)
+{
+	struct snapshot_header header;
+	char *tmp_path;
+	int fd;
+	int err;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.thing_size = sizeof(*snap->thing);
+	header.slave_size = sizeof(*snap->slaves);
+	header.item_size = sizeof(*snap->items);
+	header.slaves_len = snap->slaves_len;
+	header.items_len = snap->items_len;
+	header.key = *key;
+
+	/* Readers either see the previous snapshot or the complete new one */
+	tmp_path = l_strdup_printf("%s.tmp", path);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	err = write_all(fd, &header, sizeof(header));
+	if (!err)
+		err = write_all(fd, snap->thing, sizeof(*snap->thing));
+	if (!err)
+		err = write_all(fd, snap->slaves,
+				sizeof(*snap->slaves) * snap->slaves_len);
+	if (!err)
+		err = write_all(fd, snap->items,
+				sizeof(*snap->items) * snap->items_len);
+	if (!err && fsync(fd) < 0)
+		err = -errno;
+
+	close(fd);
+
+	if (!err && rename(tmp_path, path) < 0)
+		err = -errno;
+
+	if (err)
+		unlink(tmp_path);
+
+done:
+	l_free(tmp_path);
+
+	return err;
+}
+
+static bool is_string_valid(const char *str, size_t len)
+{
+	return memchr(str, '\0', len) != NULL;
+}
+
+static bool is_snapshot_valid(const struct snapshot_header *header,
+			      size_t len, const struct snapshot_key *key)
+{
+	const struct snapshot_thing *thing;
+	const struct snapshot_slave *slaves;
+	const struct snapshot_item *items;
+	unsigned int i;
+
+	if (header->magic != SNAPSHOT_MAGIC ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->thing_size != sizeof(*thing) ||
+	    header->slave_size != sizeof(*slaves) ||
+	    header->item_size != sizeof(*items))
+		return false;
+
+	if (len != sizeof(*header) + sizeof(*thing) +
+		   (size_t) header->slaves_len * sizeof(*slaves) +
+		   (size_t) header->items_len * sizeof(*items))
+		return false;
+
+	if (header->key.mtime_sec != key->mtime_sec ||
+	    header->key.mtime_nsec != key->mtime_nsec ||
+	    header->key.size != key->size ||
+	    header->key.hash != key->hash)
+		return false;
+
+	thing = (const struct snapshot_thing *) (header + 1);
+	slaves = (const struct snapshot_slave *) (thing + 1);
+	items = (const struct snapshot_item *) (slaves + header->slaves_len);
+
+	if (!is_string_valid(thing->name, sizeof(thing->name)) ||
+	    !is_string_valid(thing->offline_path, sizeof(thing->offline_path)))
+		return false;
+
+	for (i = 0; i < header->slaves_len; i++) {
+		if (!is_string_valid(slaves[i].url, sizeof(slaves[i].url)))
+			return false;
+	}
+
+	for (i = 0; i < header->items_len; i++) {
+		if (items[i].slave < 0 ||
+		    (uint32_t) items[i].slave >= header->slaves_len)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Maps the snapshot at path if it was taken from the device file with the
+ * given key. The pointers in snap stay valid until snapshot_unload().
+ * Returns -ESTALE if the snapshot doesn't match the key.
+ */
+int snapshot_load(const char *path, const struct snapshot_key *key,
+		  struct snapshot *snap)
+{
+	const struct snapshot_header *header;
+	struct stat st;
+	void *data;
+	int fd;
+	int err;
+
+	snapshot_unload();
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0)
+		goto error;
+
+	if ((size_t) st.st_size < sizeof(*header) +
+				  sizeof(struct snapshot_thing)) {
+		close(fd);
+		return -ESTALE;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		goto error;
+
+	/* The mapping stays valid after the descriptor is closed */
+	close(fd);
+
+	header = data;
+	if (!is_snapshot_valid(header, st.st_size, key)) {
+		munmap(data, st.st_size);
+		return -ESTALE;
+	}
+
+	map = data;
+	map_len = st.st_size;
+
+	snap->thing = (const struct snapshot_thing *) (header + 1);
+	snap->slaves = (const struct snapshot_slave *) (snap->thing + 1);
+	snap->slaves_len = header->slaves_len;
+	snap->items = (const struct snapshot_item *)
+					(snap->slaves + snap->slaves_len);
+	snap->items_len = header->items_len;
+
+	return 0;
+
+error:
+	err = -errno;
+	close(fd);
+
+	return err;
+}
+
+void snapshot_unload(void)
+{
+	if (!map)
+		return;
+
+	munmap(map, map_len);
+
+	map = NULL;
+	map_len = 0;
+}
@@ -0,0 +1,78 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Device file snapshot header file
+ */
+
+#define SNAPSHOT_SUFFIX		".snapshot"
+#define SNAPSHOT_URL_LEN	256
+#define SNAPSHOT_PATH_LEN	1024
+
+/* Identifies the contents of the device file a snapshot was taken from */
+struct snapshot_key {
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t size;
+	uint64_t hash;
+};
+
+struct snapshot_thing {
+	char name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
+	int32_t read_max_gap;
+	int32_t modbus_tcp_window;
+	int32_t reconnect_initial_ms;
+	int32_t reconnect_max_ms;
+	float reconnect_multiplier;
+	int32_t publish_window_ms;
+	int32_t offline_capacity;
+	int32_t offline_replay_rate;
+	/* Empty for the default path */
+	char offline_path[SNAPSHOT_PATH_LEN];
+};
+
+struct snapshot_slave {
+	int32_t id;
+	char url[SNAPSHOT_URL_LEN];
+};
+
+struct snapshot_item {
+	int32_t sensor_id;
+	/* Index in the slaves of the snapshot */
+	int32_t slave;
+	int32_t reg_addr;
+	int32_t bit_offset;
+	int32_t endianness_type;
+	int32_t polling_interval_ms;
+	knot_schema schema;
+	knot_event event;
+	struct event_filter filter;
+};
+
+struct snapshot {
+	const struct snapshot_thing *thing;
+	const struct snapshot_slave *slaves;
+	unsigned int slaves_len;
+	const struct snapshot_item *items;
+	unsigned int items_len;
+};
+
+int snapshot_get_key(const char *conf_path, struct snapshot_key *key);
+int snapshot_save(const char *path, const struct snapshot_key *key,
+		  const struct snapshot *snap);
+int snapshot_load(const char *path, const struct snapshot_key *key,
+		  struct snapshot *snap);
+void snapshot_unload(void);
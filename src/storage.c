@@ -24,12 +24,13 @@
 #endif
 
 #include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <regex.h>
 
 #include <ell/ell.h>
 
@@ -81,57 +82,168 @@ static int make_dirs(const char *filename, const mode_t mode)
 	return 0;
 }
 
-static int save_settings(int fd, struct l_settings *settings)
+/* Settings of an open file, written back on every change */
+struct storage_file {
+	struct l_settings *settings;
+	char *pathname;
+	/* Nested storage_begin() calls not committed yet */
+	unsigned int txn_depth;
+	bool dirty;
+};
+
+static struct l_settings *get_settings(int fd)
+{
+	struct storage_file *file;
+
+	file = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	if (!file)
+		return NULL;
+
+	return file->settings;
+}
+
+/* Makes a rename in the directory of pathname durable */
+static int sync_parent_dir(const char *pathname)
+{
+	char *dir;
+	char *slash;
+	int dir_fd;
+	int err = 0;
+
+	dir = l_strdup(pathname);
+	slash = strrchr(dir, '/');
+	if (!slash) {
+		l_free(dir);
+		dir = l_strdup(".");
+	} else if (slash == dir) {
+		slash[1] = '\0';
+	} else {
+		slash[0] = '\0';
+	}
+
+	dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		err = -errno;
+		goto failure;
+	}
+
+	if (fsync(dir_fd) < 0)
+		err = -errno;
+
+	close(dir_fd);
+failure:
+	l_free(dir);
+
+	return err;
+}
+
+/*
+ * The new contents are written to a temporary file, with the mode of the
+ * old one, renamed over it. With the file and its directory synced, a
+ * crash leaves either the previous or the new file, never a truncated
+ * one. The descriptor is then moved to the new file.
+ */
+static int save_settings(int fd, struct storage_file *file)
 {
+	struct stat st;
+	char *tmp_path;
 	char *res;
 	size_t res_len;
+	ssize_t len;
+	size_t off;
+	int tmp_fd;
 	int err = 0;
 
-	res = l_settings_to_data(settings, &res_len);
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	res = l_settings_to_data(file->settings, &res_len);
+	tmp_path = l_strdup_printf("%s.tmp", file->pathname);
 
-	if (ftruncate(fd, 0) == -1) {
+	/* Read-write, as storage_open() opened the descriptor it replaces */
+	tmp_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		      S_IRUSR | S_IWUSR);
+	if (tmp_fd < 0) {
 		err = -errno;
 		goto failure;
 	}
 
-	if (pwrite(fd, res, res_len, 0) < 0)
+	if (fchmod(tmp_fd, st.st_mode & 07777) < 0) {
+		err = -errno;
+		goto close_tmp;
+	}
+
+	for (off = 0; off < res_len; off += len) {
+		len = write(tmp_fd, res + off, res_len - off);
+		if (len < 0) {
+			if (errno == EINTR) {
+				len = 0;
+				continue;
+			}
+
+			err = -errno;
+			goto close_tmp;
+		}
+	}
+
+	if (fsync(tmp_fd) < 0 || rename(tmp_path, file->pathname) < 0) {
 		err = -errno;
+		goto close_tmp;
+	}
 
+	file->dirty = false;
+
+	err = sync_parent_dir(file->pathname);
+
+	if (dup2(tmp_fd, fd) < 0)
+		err = -errno;
+
+close_tmp:
+	close(tmp_fd);
+	if (file->dirty)
+		unlink(tmp_path);
 failure:
+	l_free(tmp_path);
 	l_free(res);
 
 	return err;
 }
 
-static int check_valid_groups(char **all_groups, int index)
+/* Flushes a change right away, or once the transaction is committed */
+static int settings_changed(int fd)
 {
-	int repeated_check;
-	regex_t preg;
-	int i;
-
-	regcomp(&preg, "^DataItem_[0-9]+$", REG_EXTENDED);
+	struct storage_file *file;
 
-	if (!regexec(&preg, all_groups[index], 0, (regmatch_t *)NULL, 0) == 0) {
-		l_error("Invalid DataItem group: %s", all_groups[index]);
-		regfree(&preg);
+	file = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	if (!file)
 		return -EINVAL;
-	}
 
-	for (i = index + 1; all_groups[i] != NULL; i++) {
-		repeated_check = strcmp(all_groups[i], all_groups[index]);
-		if (repeated_check == 0) {
-			l_error("Repeated DataItem group: %s", all_groups[i]);
-			regfree(&preg);
-			return -EINVAL;
-		}
+	file->dirty = true;
+	if (file->txn_depth)
+		return 0;
+
+	return save_settings(fd, file);
+}
+
+/* Same as matching "^DataItem_[0-9]+$", without compiling a regex */
+static bool is_valid_data_item_group(const char *group)
+{
+	const char *c = group + strlen(DATA_ITEM_GROUP);
+
+	if (*c == '\0')
+		return false;
+
+	for (; *c != '\0'; c++) {
+		if (*c < '0' || *c > '9')
+			return false;
 	}
 
-	return 0;
+	return true;
 }
 
 int storage_open(const char *pathname)
 {
-	struct l_settings *settings;
+	struct storage_file *file;
 	int fd, err;
 
 	err = make_dirs(pathname, S_IRUSR | S_IWUSR | S_IXUSR);
@@ -142,31 +254,70 @@ int storage_open(const char *pathname)
 	if (fd < 0)
 		return -errno;
 
-	settings = l_settings_new();
+	file = l_new(struct storage_file, 1);
+	file->pathname = l_strdup(pathname);
+	file->settings = l_settings_new();
 	/* Ignore error if file doesn't exists */
-	l_settings_load_from_file(settings, pathname);
+	l_settings_load_from_file(file->settings, pathname);
 
 	if (!storage_list)
 		storage_list = l_hashmap_new();
 
-	l_hashmap_insert(storage_list, L_INT_TO_PTR(fd), settings);
+	l_hashmap_insert(storage_list, L_INT_TO_PTR(fd), file);
 
 	return fd;
 }
 
 int storage_close(int fd)
 {
-	struct l_settings *settings;
+	struct storage_file *file;
 
-	settings = l_hashmap_remove(storage_list, L_INT_TO_PTR(fd));
-	if(!settings)
+	file = l_hashmap_remove(storage_list, L_INT_TO_PTR(fd));
+	if(!file)
 		return -ENOENT;
 
-	l_settings_free(settings);
+	/* Don't lose the writes of a transaction left open */
+	if (file->dirty && save_settings(fd, file) < 0)
+		l_error("storage: couldn't save %s", file->pathname);
+
+	l_settings_free(file->settings);
+	l_free(file->pathname);
+	l_free(file);
 
 	return close(fd);
 }
 
+/*
+ * Writes between storage_begin() and the matching storage_commit() only
+ * change the settings in memory; the file is written once, on commit.
+ */
+int storage_begin(int fd)
+{
+	struct storage_file *file;
+
+	file = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	if (!file)
+		return -EINVAL;
+
+	file->txn_depth++;
+
+	return 0;
+}
+
+int storage_commit(int fd)
+{
+	struct storage_file *file;
+
+	file = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	if (!file || !file->txn_depth)
+		return -EINVAL;
+
+	if (--file->txn_depth || !file->dirty)
+		return 0;
+
+	return save_settings(fd, file);
+}
+
 void storage_foreach_slave(int fd, storage_foreach_slave_t func,
 						void *user_data)
 {
@@ -177,7 +328,7 @@ void storage_foreach_slave(int fd, storage_foreach_slave_t func,
 	int i;
 	int id;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return;
 
@@ -213,7 +364,7 @@ void storage_foreach_source(int fd, storage_foreach_source_t func,
 	int interval = 1000;
 	int i;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return;
 
@@ -251,7 +402,7 @@ char *storage_read_key_string(int fd, const char *group, const char *key)
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return NULL;
 
@@ -263,21 +414,21 @@ int storage_write_key_string(int fd, const char *group,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EIO;
 
 	if (l_settings_set_string(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 int storage_read_key_int(int fd, const char *group, const char *key, int *value)
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
@@ -288,14 +439,14 @@ int storage_write_key_int(int fd, const char *group, const char *key, int value)
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_set_int(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 int storage_read_key_float(int fd, const char *group, const char *key,
@@ -303,7 +454,7 @@ int storage_read_key_float(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
@@ -315,14 +466,14 @@ int storage_write_key_float(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_set_float(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 int storage_read_key_bool(int fd, const char *group, const char *key,
@@ -331,7 +482,7 @@ int storage_read_key_bool(int fd, const char *group, const char *key,
 	struct l_settings *settings;
 	bool result;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
@@ -348,14 +499,14 @@ int storage_write_key_bool(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_set_bool(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 int storage_read_key_int64(int fd, const char *group, const char *key,
@@ -363,7 +514,7 @@ int storage_read_key_int64(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
@@ -375,14 +526,14 @@ int storage_write_key_int64(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_set_int64(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 int storage_read_key_uint(int fd, const char *group, const char *key,
@@ -390,7 +541,7 @@ int storage_read_key_uint(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
@@ -402,14 +553,14 @@ int storage_write_key_uint(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_set_uint(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 int storage_read_key_uint64(int fd, const char *group, const char *key,
@@ -417,7 +568,7 @@ int storage_read_key_uint64(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
@@ -429,85 +580,109 @@ int storage_write_key_uint64(int fd, const char *group, const char *key,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_set_uint64(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 int storage_remove_group(int fd, const char *group)
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_remove_group(settings, group) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 int storage_remove_key(int fd, const char *group, const char *key)
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_remove_key(settings, group, key) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	return settings_changed(fd);
 }
 
 bool storage_has_unit(int fd, const char *group, const char *key)
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = get_settings(fd);
 	if (!settings)
 		return false;
 
 	return l_settings_has_key(settings, group, key);
 }
 
+/*
+ * Returns the DataItem groups of the file in a single pass, checking
+ * their names and looking for repeated groups in a hash set.
+ */
 char **get_data_item_groups(int fd)
 {
 	struct l_settings *settings;
+	struct l_hashmap *seen;
 	char **all_groups;
+	char **data_item_groups;
 	int group_index;
-	int data_item_check;
-	int err;
-
-	err = 0;
-
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	int n;
 
+	settings = get_settings(fd);
 	if (!settings)
 		return NULL;
 
 	all_groups = l_settings_get_groups(settings);
+	data_item_groups = l_new(char *, l_strv_length(all_groups) + 1);
+	seen = l_hashmap_string_new();
+	n = 0;
 
 	for (group_index = 0; all_groups[group_index] != NULL; group_index++) {
-		data_item_check = strncmp(all_groups[group_index],
-						DATA_ITEM_GROUP,
-						strlen(DATA_ITEM_GROUP));
-		if (data_item_check)
-			l_settings_remove_group(settings,
-						all_groups[group_index]);
-		else
-			err = check_valid_groups(all_groups, group_index);
+		if (strncmp(all_groups[group_index], DATA_ITEM_GROUP,
+			    strlen(DATA_ITEM_GROUP)))
+			continue;
 
+		if (!is_valid_data_item_group(all_groups[group_index])) {
+			l_error("Invalid DataItem group: %s",
+				all_groups[group_index]);
+			goto error;
+		}
+
+		if (l_hashmap_lookup(seen, all_groups[group_index])) {
+			l_error("Repeated DataItem group: %s",
+				all_groups[group_index]);
+			goto error;
+		}
+
+		l_hashmap_insert(seen, all_groups[group_index],
+				 all_groups[group_index]);
+
+		data_item_groups[n++] = l_strdup(all_groups[group_index]);
 	}
 
+	l_hashmap_destroy(seen, NULL);
+	l_strfreev(all_groups);
+
+	return data_item_groups;
+
+error:
+	l_hashmap_destroy(seen, NULL);
 	l_strfreev(all_groups);
+	l_strfreev(data_item_groups);
 
-	return err < 0 ? NULL : l_settings_get_groups(settings);
+	return NULL;
 }
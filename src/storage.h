@@ -41,6 +41,9 @@ void storage_foreach_source(int fd,
 int storage_open(const char *pathname);
 int storage_close(int fd);
 
+int storage_begin(int fd);
+int storage_commit(int fd);
+
 int storage_remove_group(int fd, const char *group);
 int storage_remove_key(int fd, const char *group, const char *key);
 
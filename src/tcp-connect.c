@@ -0,0 +1,440 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Non-blocking TCP connect source file
+ *
+ *  Connects a non-blocking socket and waits for it to become writable on
+ *  the ell main loop, giving up once the deadline expires. Unreachable
+ *  hosts never hold the main loop for the kernel connect timeout, and
+ *  host names are looked up off the main loop.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <ell/ell.h>
+
+#include "tcp-connect.h"
+
+/*
+ * Lookup of a host name, run by a detached thread. Shared by the thread
+ * and the main loop, the last one to drop it frees it.
+ */
+struct resolver {
+	char *host;
+	char *port;
+	int fd;
+	struct l_io *io;
+	int err;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	atomic_int refs;
+};
+
+struct tcp_connect {
+	char *host;
+	char *port;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	/* addr comes from a lookup, not from a numeric host */
+	bool resolved;
+	/* Kept across attempts, at most one lookup runs per connector */
+	struct resolver *resolver;
+	bool resolving;
+	/* The attempt in progress waits for the lookup */
+	bool waiting;
+	int fd;
+	struct l_io *io;
+	struct l_timeout *timeout;
+	tcp_connect_cb_t cb;
+	void *user_data;
+};
+
+static void resolver_unref(struct resolver *res)
+{
+	if (atomic_fetch_sub(&res->refs, 1) != 1)
+		return;
+
+	close(res->fd);
+	l_free(res->host);
+	l_free(res->port);
+	l_free(res);
+}
+
+static int lookup(const char *host, const char *port, int flags,
+		  struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+	struct addrinfo hints;
+	struct addrinfo *info;
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags;
+
+	rc = getaddrinfo(host, port, &hints, &info);
+	if (rc == EAI_NONAME && (flags & AI_NUMERICHOST))
+		return -EAGAIN;
+	if (rc)
+		return -EHOSTUNREACH;
+
+	memcpy(addr, info->ai_addr, info->ai_addrlen);
+	*addr_len = info->ai_addrlen;
+	freeaddrinfo(info);
+
+	return 0;
+}
+
+static void *resolver_thread(void *user_data)
+{
+	struct resolver *res = user_data;
+	uint64_t val = 1;
+
+	res->err = lookup(res->host, res->port, 0, &res->addr,
+			  &res->addr_len);
+
+	if (write(res->fd, &val, sizeof(val)) < 0)
+		res->err = -errno;
+
+	resolver_unref(res);
+
+	return NULL;
+}
+
+/* Only outside the handlers of the resolver */
+static void resolver_release(struct tcp_connect *conn)
+{
+	if (!conn->resolver)
+		return;
+
+	/* A lookup still running finishes on its own */
+	l_io_destroy(conn->resolver->io);
+	resolver_unref(conn->resolver);
+	conn->resolver = NULL;
+	conn->resolving = false;
+}
+
+static int connect_socket(struct tcp_connect *conn);
+static void fail(struct tcp_connect *conn, int err);
+
+static bool on_resolved(struct l_io *io, void *user_data)
+{
+	struct tcp_connect *conn = user_data;
+	struct resolver *res = conn->resolver;
+	uint64_t val;
+	int err;
+
+	if (read(res->fd, &val, sizeof(val)) < 0)
+		return true;
+
+	conn->resolving = false;
+
+	err = res->err;
+	if (!err) {
+		memcpy(&conn->addr, &res->addr, res->addr_len);
+		conn->addr_len = res->addr_len;
+		conn->resolved = true;
+	}
+
+	if (!conn->waiting)
+		return false;
+
+	conn->waiting = false;
+
+	if (!err)
+		err = connect_socket(conn);
+
+	if (err < 0)
+		fail(conn, err);
+
+	return false;
+}
+
+static int resolver_start(struct tcp_connect *conn)
+{
+	struct resolver *res;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t mask;
+	sigset_t old_mask;
+	int err;
+
+	resolver_release(conn);
+
+	res = l_new(struct resolver, 1);
+	res->host = l_strdup(conn->host);
+	res->port = l_strdup(conn->port);
+	atomic_init(&res->refs, 2);
+
+	res->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (res->fd < 0) {
+		err = -errno;
+		goto free_res;
+	}
+
+	res->io = l_io_new(res->fd);
+	if (!res->io || !l_io_set_read_handler(res->io, on_resolved, conn,
+					       NULL)) {
+		err = -EIO;
+		goto destroy_io;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* Signals are handled by the main loop, never by the resolver */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	err = pthread_create(&thread, &attr, resolver_thread, res);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		err = -err;
+		goto destroy_io;
+	}
+
+	conn->resolver = res;
+	conn->resolving = true;
+
+	return 0;
+
+destroy_io:
+	l_io_destroy(res->io);
+	close(res->fd);
+free_res:
+	l_free(res->host);
+	l_free(res->port);
+	l_free(res);
+
+	return err;
+}
+
+/* The record of a host name may have moved: look it up on the next attempt */
+static void forget_address(struct tcp_connect *conn)
+{
+	if (!conn->resolved)
+		return;
+
+	conn->addr_len = 0;
+	conn->resolved = false;
+}
+
+/*
+ * Handlers of the socket can't destroy it, so a failed socket is only
+ * released by the next attempt or on cancel.
+ */
+static void fail(struct tcp_connect *conn, int err)
+{
+	l_timeout_remove(conn->timeout);
+	conn->timeout = NULL;
+	forget_address(conn);
+
+	conn->cb(NULL, err, conn->user_data);
+}
+
+static void on_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct tcp_connect *conn = user_data;
+	tcp_connect_cb_t cb = conn->cb;
+
+	tcp_connect_cancel(conn);
+	forget_address(conn);
+	cb(NULL, -ETIMEDOUT, conn->user_data);
+}
+
+static void on_disconnect(struct l_io *io, void *user_data)
+{
+	struct tcp_connect *conn = user_data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	fail(conn, -(err ? err : ECONNREFUSED));
+}
+
+static bool on_writable(struct l_io *io, void *user_data)
+{
+	struct tcp_connect *conn = user_data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	if (err) {
+		fail(conn, -err);
+		return false;
+	}
+
+	l_timeout_remove(conn->timeout);
+	conn->timeout = NULL;
+
+	/* Handed over: the callee may set its own write handler */
+	l_io_set_disconnect_handler(io, NULL, NULL, NULL);
+	l_io_set_write_handler(io, NULL, NULL, NULL);
+	conn->io = NULL;
+	conn->fd = -1;
+
+	conn->cb(io, 0, conn->user_data);
+
+	return true;
+}
+
+struct tcp_connect *tcp_connect_new(const char *host, const char *port)
+{
+	struct tcp_connect *conn;
+
+	conn = l_new(struct tcp_connect, 1);
+	conn->host = l_strdup(host);
+	conn->port = l_strdup(port);
+	conn->fd = -1;
+
+	return conn;
+}
+
+static int connect_socket(struct tcp_connect *conn)
+{
+	int option = 1;
+	int err;
+
+	conn->fd = socket(conn->addr.ss_family,
+			  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn->fd < 0)
+		return -errno;
+
+	/* Modbus requests are small and must not wait for each other */
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &option,
+		   sizeof(option));
+
+	if (connect(conn->fd, (struct sockaddr *) &conn->addr,
+		    conn->addr_len) < 0 && errno != EINPROGRESS) {
+		err = -errno;
+		goto close_fd;
+	}
+
+	conn->io = l_io_new(conn->fd);
+	if (!conn->io) {
+		err = -ENOMEM;
+		goto close_fd;
+	}
+
+	if (!l_io_set_disconnect_handler(conn->io, on_disconnect, conn,
+					 NULL) ||
+	    !l_io_set_write_handler(conn->io, on_writable, conn, NULL))
+		return -EIO;
+
+	return 0;
+
+close_fd:
+	close(conn->fd);
+	conn->fd = -1;
+
+	return err;
+}
+
+/*
+ * Numeric addresses are parsed right away. Host names are looked up by a
+ * helper thread, as getaddrinfo() blocks for as long as the resolver
+ * takes, and the result is kept until an attempt to it fails. The
+ * deadline covers the lookup as well.
+ */
+int tcp_connect_start(struct tcp_connect *conn, unsigned int timeout_ms,
+		      tcp_connect_cb_t cb, void *user_data)
+{
+	int err;
+
+	tcp_connect_cancel(conn);
+
+	if (!conn->addr_len) {
+		err = lookup(conn->host, conn->port,
+			     AI_NUMERICHOST | AI_NUMERICSERV, &conn->addr,
+			     &conn->addr_len);
+		if (err < 0 && err != -EAGAIN)
+			return err;
+	}
+
+	if (conn->addr_len) {
+		err = connect_socket(conn);
+	} else if (!conn->resolving) {
+		err = resolver_start(conn);
+		conn->waiting = err == 0;
+	} else {
+		err = 0;
+		conn->waiting = true;
+	}
+
+	if (err < 0)
+		goto cancel;
+
+	conn->cb = cb;
+	conn->user_data = user_data;
+	conn->timeout = l_timeout_create_ms(timeout_ms, on_timeout, conn,
+					    NULL);
+
+	return 0;
+
+cancel:
+	tcp_connect_cancel(conn);
+	forget_address(conn);
+
+	return err;
+}
+
+/*
+ * Drops the attempt in progress, if any, without calling back. A lookup
+ * still running is kept for the next attempt.
+ */
+void tcp_connect_cancel(struct tcp_connect *conn)
+{
+	conn->waiting = false;
+
+	l_timeout_remove(conn->timeout);
+	conn->timeout = NULL;
+
+	l_io_destroy(conn->io);
+	conn->io = NULL;
+
+	if (conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+}
+
+void tcp_connect_free(struct tcp_connect *conn)
+{
+	if (!conn)
+		return;
+
+	tcp_connect_cancel(conn);
+	resolver_release(conn);
+
+	l_free(conn->host);
+	l_free(conn->port);
+	l_free(conn);
+}
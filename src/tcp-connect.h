@@ -0,0 +1,35 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Non-blocking TCP connect header file
+ */
+
+struct tcp_connect;
+
+/*
+ * On success io is the connected socket, without handlers, and belongs
+ * to the callee, which also closes its descriptor. On failure io is NULL
+ * and err is a negative errno. The attempt must not be restarted from
+ * the callback.
+ */
+typedef void (*tcp_connect_cb_t) (struct l_io *io, int err, void *user_data);
+
+struct tcp_connect *tcp_connect_new(const char *host, const char *port);
+int tcp_connect_start(struct tcp_connect *conn, unsigned int timeout_ms,
+		      tcp_connect_cb_t cb, void *user_data);
+void tcp_connect_cancel(struct tcp_connect *conn);
+void tcp_connect_free(struct tcp_connect *conn);
@@ -0,0 +1,137 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <stdlib.h>
+#include <ell/ell.h>
+
+#include "src/backoff.h"
+
+#define INITIAL_MS	100
+#define MAX_MS		10000
+#define DRAWS		1000
+
+static struct backoff backoff;
+
+static void setup(void)
+{
+	backoff_init(&backoff, INITIAL_MS, MAX_MS, 2);
+}
+
+START_TEST(backoff_delay_within_bound)
+{
+	unsigned int bound = INITIAL_MS;
+	unsigned int delay;
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		delay = backoff_next(&backoff);
+		ck_assert_uint_ge(delay, 1);
+		ck_assert_uint_le(delay, bound);
+
+		bound = bound * 2 < MAX_MS ? bound * 2 : MAX_MS;
+	}
+
+	ck_assert_uint_eq(backoff.ceiling_ms, MAX_MS);
+	ck_assert_uint_eq(backoff.attempts, 20);
+}
+END_TEST
+
+START_TEST(backoff_delays_are_spread)
+{
+	unsigned int min = MAX_MS;
+	unsigned int max = 0;
+	unsigned int delay;
+	int i;
+
+	/* Full jitter: from almost nothing up to the bound */
+	for (i = 0; i < DRAWS; i++) {
+		backoff_reset(&backoff);
+		delay = backoff_next(&backoff);
+		if (delay < min)
+			min = delay;
+		if (delay > max)
+			max = delay;
+	}
+
+	ck_assert_uint_lt(min, INITIAL_MS / 10);
+	ck_assert_uint_gt(max, INITIAL_MS * 9 / 10);
+}
+END_TEST
+
+START_TEST(backoff_reset_restarts_from_initial)
+{
+	int i;
+
+	for (i = 0; i < 10; i++)
+		backoff_next(&backoff);
+
+	backoff_reset(&backoff);
+
+	ck_assert_uint_eq(backoff.ceiling_ms, INITIAL_MS);
+	ck_assert_uint_eq(backoff.attempts, 0);
+	ck_assert_uint_le(backoff_next(&backoff), INITIAL_MS);
+}
+END_TEST
+
+START_TEST(backoff_unit_multiplier_keeps_bound)
+{
+	int i;
+
+	backoff_init(&backoff, INITIAL_MS, MAX_MS, 1);
+
+	for (i = 0; i < 10; i++)
+		ck_assert_uint_le(backoff_next(&backoff), INITIAL_MS);
+
+	ck_assert_uint_eq(backoff.ceiling_ms, INITIAL_MS);
+}
+END_TEST
+
+Suite *backoff_suite(void)
+{
+	Suite *retry_suite;
+	TCase *tc_backoff;
+
+	retry_suite = suite_create("Backoff");
+
+	/* Reconnection backoff test case */
+	tc_backoff = tcase_create("Backoff");
+	tcase_add_checked_fixture(tc_backoff, setup, NULL);
+	tcase_add_test(tc_backoff, backoff_delay_within_bound);
+	tcase_add_test(tc_backoff, backoff_delays_are_spread);
+	tcase_add_test(tc_backoff, backoff_reset_restarts_from_initial);
+	tcase_add_test(tc_backoff, backoff_unit_multiplier_keeps_bound);
+
+	suite_add_tcase(retry_suite, tc_backoff);
+
+	return retry_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *retry_suite;
+	SRunner *retry_suite_runner;
+
+	retry_suite = backoff_suite();
+	retry_suite_runner = srunner_create(retry_suite);
+
+	srunner_run_all(retry_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(retry_suite_runner);
+	srunner_free(retry_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,217 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Register decode microbenchmark
+ *
+ *  Compares the per value endianness conversion the daemon used to do in
+ *  iface-modbus.c, the per data item decoders and the register image
+ *  conversion on each instruction set. Build with `make tests/decode_bench`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <knot/knot_protocol.h>
+#include <knot/knot_types.h>
+
+#include "src/conf-parameters.h"
+#include "src/iface-modbus.h"
+#include "src/decode.h"
+
+#define VALUES_COUNT		4096
+#define ROUNDS			2000
+
+static const char * const isa_names[] = {
+	[DECODE_ISA_SCALAR] = "scalar",
+	[DECODE_ISA_SSSE3] = "ssse3",
+	[DECODE_ISA_AVX2] = "avx2"
+};
+
+static const char * const endianness_names[] = {
+	[MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN] = "big",
+	[MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN] = "mid big",
+	[MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN] = "little",
+	[MODBUS_ENDIANNESS_TYPE_MID_LITTLE_ENDIAN] = "mid little"
+};
+
+static uint16_t regs[VALUES_COUNT * 4];
+static uint64_t out[VALUES_COUNT];
+static volatile uint64_t sink;
+
+/* The conversions done by iface-modbus.c before the decoders existed */
+static void legacy_recv_32_bits(uint32_t *src, int endianness_type)
+{
+	switch (endianness_type) {
+	case MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN:
+		*src = ((*src & 0xffff0000u) >> 16)|
+			((*src & 0x0000ffffu) << 16);
+		break;
+	case MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN:
+		*src = ((((*src) & 0xff000000u) >> 24)|
+			(((*src) & 0x00ff0000u) >> 8)|
+			(((*src) & 0x0000ff00u) << 8)|
+			(((*src) & 0x000000ffu) << 24));
+		break;
+	case MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN:
+		*src = ((((*src) & 0xff000000u) >> 8)|
+			(((*src) & 0x00ff0000u) << 8)|
+			(((*src) & 0x0000ff00u) >> 8)|
+			(((*src) & 0x000000ffu) << 8));
+		break;
+	default:
+		break;
+	}
+}
+
+static void legacy_recv_64_bits(uint64_t *src, int endianness_type)
+{
+	if (endianness_type == MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN ||
+		endianness_type == MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN){
+		*src = ((*src & 0xff00000000000000u) >> 8)|
+			((*src & 0x00ff000000000000u) << 8)|
+			((*src & 0x0000ff0000000000u) >> 8)|
+			((*src & 0x000000ff00000000u) << 8)|
+			((*src & 0x00000000ff000000u) >> 8)|
+			((*src & 0x0000000000ff0000u) << 8)|
+			((*src & 0x000000000000ff00u) >> 8)|
+			((*src & 0x00000000000000ffu) << 8);
+	}
+	if (endianness_type == MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN ||
+		endianness_type == MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN){
+		*src = ((*src & 0xffff000000000000u) >> 48)|
+			((*src & 0x0000ffff00000000u) >> 16)|
+			((*src & 0x00000000ffff0000u) << 16)|
+			((*src & 0x000000000000ffffu) << 48);
+	}
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, int bit_offset, int endianness,
+		   double start)
+{
+	printf("%-10s %2d bits %-10s %7.3f ns/value\n", name, bit_offset,
+	       endianness_names[endianness],
+	       (now_ns() - start) / ((double) ROUNDS * VALUES_COUNT));
+}
+
+static void bench_legacy(int bit_offset, int endianness)
+{
+	int width = bit_offset / TYPE_U16;
+	uint32_t val_32;
+	uint64_t val_64;
+	double start;
+	int round;
+	int i;
+
+	start = now_ns();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < VALUES_COUNT; i++) {
+			if (bit_offset == TYPE_U32) {
+				memcpy(&val_32, regs + i * width,
+				       sizeof(val_32));
+				legacy_recv_32_bits(&val_32, endianness);
+				out[i] = val_32;
+			} else {
+				memcpy(&val_64, regs + i * width,
+				       sizeof(val_64));
+				legacy_recv_64_bits(&val_64, endianness);
+				out[i] = val_64;
+			}
+		}
+		sink += out[round % VALUES_COUNT];
+	}
+	report("legacy", bit_offset, endianness, start);
+}
+
+static void bench_item(int bit_offset, int endianness)
+{
+	int width = bit_offset / TYPE_U16;
+	decode_func_t func;
+	knot_value_type value;
+	double start;
+	int round;
+	int i;
+
+	func = decode_get_func(bit_offset, endianness,
+			       KNOT_VALUE_TYPE_UINT64);
+
+	start = now_ns();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < VALUES_COUNT; i++) {
+			func(regs + i * width, &value);
+			out[i] = bit_offset == TYPE_U32 ? value.val_u :
+							  value.val_u64;
+		}
+		sink += out[round % VALUES_COUNT];
+	}
+	report("item", bit_offset, endianness, start);
+}
+
+static void bench_registers(enum decode_isa isa, int bit_offset,
+			    int endianness)
+{
+	double start;
+	int round;
+
+	if (decode_set_isa(isa) < 0)
+		return;
+
+	start = now_ns();
+	for (round = 0; round < ROUNDS; round++) {
+		decode_registers(bit_offset, endianness, regs, VALUES_COUNT,
+				 out);
+		sink += out[round % VALUES_COUNT];
+	}
+	report(isa_names[isa], bit_offset, endianness, start);
+}
+
+int main(void)
+{
+	const int bit_offsets[] = { TYPE_U32, TYPE_U64 };
+	int endianness;
+	int isa;
+	int i;
+
+	srand(1);
+	for (i = 0; i < VALUES_COUNT * 4; i++)
+		regs[i] = rand();
+
+	for (i = 0; i < 2; i++) {
+		for (endianness = MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN;
+		     endianness <= MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN;
+		     endianness++) {
+			bench_legacy(bit_offsets[i], endianness);
+			bench_item(bit_offsets[i], endianness);
+			for (isa = DECODE_ISA_SCALAR; isa <= DECODE_ISA_AVX2;
+					isa++)
+				bench_registers(isa, bit_offsets[i],
+						endianness);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,245 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <knot/knot_protocol.h>
+#include <knot/knot_types.h>
+
+#include "src/conf-parameters.h"
+#include "src/iface-modbus.h"
+#include "src/decode.h"
+
+static const uint16_t regs_32[] = { 0x1122, 0x3344 };
+static const uint16_t regs_64[] = { 0x1122, 0x3344, 0x5566, 0x7788 };
+
+static knot_value_type decode(int bit_offset, int endianness_type,
+			      int value_type, const void *src)
+{
+	decode_func_t func;
+	knot_value_type value;
+
+	func = decode_get_func(bit_offset, endianness_type, value_type);
+	ck_assert(func != NULL);
+
+	memset(&value, 0xff, sizeof(value));
+	func(src, &value);
+
+	return value;
+}
+
+START_TEST(decode_bool)
+{
+	const uint8_t bits[] = { 1 };
+	knot_value_type value;
+
+	value = decode(TYPE_BOOL, 0, KNOT_VALUE_TYPE_BOOL, bits);
+	ck_assert(value.val_b);
+}
+END_TEST
+
+START_TEST(decode_byte_packs_bits)
+{
+	const uint8_t bits[] = { 1, 0, 1, 0, 0, 0, 0, 1 };
+	knot_value_type value;
+
+	value = decode(TYPE_BYTE, 0, KNOT_VALUE_TYPE_UINT, bits);
+	ck_assert_uint_eq(value.val_u, 0x85);
+}
+END_TEST
+
+START_TEST(decode_u32_endianness)
+{
+	knot_value_type value;
+
+	value = decode(TYPE_U32, MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT, regs_32);
+	ck_assert_uint_eq(value.val_u, 0x11223344);
+
+	value = decode(TYPE_U32, MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT, regs_32);
+	ck_assert_uint_eq(value.val_u, 0x22114433);
+
+	value = decode(TYPE_U32, MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT, regs_32);
+	ck_assert_uint_eq(value.val_u, 0x44332211);
+
+	value = decode(TYPE_U32, MODBUS_ENDIANNESS_TYPE_MID_LITTLE_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT, regs_32);
+	ck_assert_uint_eq(value.val_u, 0x33441122);
+}
+END_TEST
+
+START_TEST(decode_u64_endianness)
+{
+	knot_value_type value;
+
+	value = decode(TYPE_U64, MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT64, regs_64);
+	ck_assert(value.val_u64 == 0x1122334455667788ULL);
+
+	value = decode(TYPE_U64, MODBUS_ENDIANNESS_TYPE_MID_BIG_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT64, regs_64);
+	ck_assert(value.val_u64 == 0x2211443366558877ULL);
+
+	value = decode(TYPE_U64, MODBUS_ENDIANNESS_TYPE_LITTLE_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT64, regs_64);
+	ck_assert(value.val_u64 == 0x8877665544332211ULL);
+
+	value = decode(TYPE_U64, MODBUS_ENDIANNESS_TYPE_MID_LITTLE_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT64, regs_64);
+	ck_assert(value.val_u64 == 0x7788556633441122ULL);
+}
+END_TEST
+
+START_TEST(decode_clears_unused_bytes)
+{
+	knot_value_type value;
+	uint8_t zero[sizeof(value)];
+
+	memset(zero, 0, sizeof(zero));
+
+	value = decode(TYPE_U32, MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT, regs_32);
+	ck_assert_mem_eq(value.raw + sizeof(uint32_t), zero,
+			 sizeof(value) - sizeof(uint32_t));
+
+	value = decode(TYPE_U64, MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN,
+		       KNOT_VALUE_TYPE_UINT64, regs_64);
+	ck_assert_mem_eq(value.raw + sizeof(uint64_t), zero,
+			 sizeof(value) - sizeof(uint64_t));
+}
+END_TEST
+
+START_TEST(decode_raw_keeps_wire_order)
+{
+	const uint16_t regs[] = { 0x0102, 0x0304, 0x0506 };
+	const uint8_t expected[KNOT_DATA_RAW_SIZE] = { 1, 2, 3, 4, 5, 6 };
+	knot_value_type value;
+
+	value = decode(3 * TYPE_U16, MODBUS_ENDIANNESS_TYPE_BIG_ENDIAN,
+		       KNOT_VALUE_TYPE_RAW, regs);
+	ck_assert_mem_eq(value.raw, expected, sizeof(expected));
+}
+END_TEST
+
+START_TEST(decode_invalid_width_has_no_decoder)
+{
+	ck_assert(!decode_get_func(12, 0, KNOT_VALUE_TYPE_INT));
+	ck_assert(!decode_get_func(TYPE_BYTE, 0, KNOT_VALUE_TYPE_RAW));
+	ck_assert(!decode_get_func(TYPE_RAW_MAX + TYPE_U16, 0,
+				   KNOT_VALUE_TYPE_RAW));
+}
+END_TEST
+
+/* Odd count so that every implementation also goes through its tail */
+#define REGISTERS_COUNT		37
+
+static void check_registers(enum decode_isa isa, int bit_offset)
+{
+	uint16_t regs[REGISTERS_COUNT * 4];
+	uint64_t out[REGISTERS_COUNT];
+	knot_value_type value;
+	decode_func_t func;
+	int width = bit_offset / TYPE_U16;
+	int endianness;
+	int i;
+
+	if (decode_set_isa(isa) < 0)
+		return;
+
+	for (i = 0; i < REGISTERS_COUNT * 4; i++)
+		regs[i] = i * 0x0101 + 0x1f2e;
+
+	for (endianness = 0; endianness <= 5; endianness++) {
+		func = decode_get_func(bit_offset, endianness,
+				       KNOT_VALUE_TYPE_UINT64);
+		ck_assert_int_eq(decode_registers(bit_offset, endianness,
+						  regs, REGISTERS_COUNT,
+						  out), 0);
+
+		for (i = 0; i < REGISTERS_COUNT; i++) {
+			func(regs + i * width, &value);
+			ck_assert_mem_eq((uint8_t *) out + i * width * 2,
+					 value.raw, width * 2);
+		}
+	}
+}
+
+START_TEST(decode_registers_matches_item_decode)
+{
+	check_registers(_i, TYPE_U32);
+	check_registers(_i, TYPE_U64);
+}
+END_TEST
+
+START_TEST(decode_registers_invalid_width)
+{
+	uint16_t regs[1] = { 0 };
+	uint16_t out[1];
+
+	ck_assert_int_lt(decode_registers(TYPE_U16, 0, regs, 1, out), 0);
+}
+END_TEST
+
+Suite *decode_suite(void)
+{
+	Suite *suite;
+	TCase *tc_decode;
+	TCase *tc_registers;
+
+	suite = suite_create("Decode");
+
+	/* Decoder selection and output test case */
+	tc_decode = tcase_create("Decode");
+	tcase_add_test(tc_decode, decode_bool);
+	tcase_add_test(tc_decode, decode_byte_packs_bits);
+	tcase_add_test(tc_decode, decode_u32_endianness);
+	tcase_add_test(tc_decode, decode_u64_endianness);
+	tcase_add_test(tc_decode, decode_clears_unused_bytes);
+	tcase_add_test(tc_decode, decode_raw_keeps_wire_order);
+	tcase_add_test(tc_decode, decode_invalid_width_has_no_decoder);
+
+	suite_add_tcase(suite, tc_decode);
+
+	/* Register image conversion test case, once per instruction set */
+	tc_registers = tcase_create("Registers");
+	tcase_add_loop_test(tc_registers, decode_registers_matches_item_decode,
+			    DECODE_ISA_SCALAR, DECODE_ISA_AVX2 + 1);
+	tcase_add_test(tc_registers, decode_registers_invalid_width);
+
+	suite_add_tcase(suite, tc_registers);
+
+	return suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *suite;
+	SRunner *suite_runner;
+
+	suite = decode_suite();
+	suite_runner = srunner_create(suite);
+
+	srunner_run_all(suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(suite_runner);
+	srunner_free(suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
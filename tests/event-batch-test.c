@@ -0,0 +1,313 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <knot/knot_protocol.h>
+#include <knot/knot_types.h>
+#include <ell/ell.h>
+
+#include "src/event.h"
+#include "src/event-batch.h"
+
+#define ITEMS_COUNT		300
+#define ROUNDS			400
+
+/* What the scalar path knows about an item */
+struct scalar_item {
+	int value_type;
+	knot_event event;
+	struct event_filter filter;
+	enum event_zone zone;
+	knot_value_type current;
+	knot_value_type sent;
+	bool dirty;
+};
+
+static struct scalar_item items[ITEMS_COUNT];
+static uint64_t publish[EVENT_BATCH_BITMAP_LEN(ITEMS_COUNT)];
+
+static const float hysteresis_pool[] = { 0, 0, 0.5, 1, 2.5, 10 };
+static const float deadband_abs_pool[] = { 0, 0, 1, 2.5 };
+static const float deadband_pct_pool[] = { 0, 0, 5, 50 };
+
+#define pick(pool) ((pool)[rand() % L_ARRAY_SIZE(pool)])
+
+static bool is_published(int slot)
+{
+	return publish[slot / 64] & (UINT64_C(1) << (slot % 64));
+}
+
+/* Values are zero filled past their width, as the decoders leave them */
+static knot_value_type random_value(int value_type, int around)
+{
+	knot_value_type value;
+	int offset = rand() % 7 - 3;
+	int i;
+
+	memset(&value, 0, sizeof(value));
+
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		value.val_i = rand() % 16 ? around + offset :
+			(rand() % 2 ? INT32_MAX : INT32_MIN);
+		break;
+	case KNOT_VALUE_TYPE_UINT:
+		value.val_u = rand() % 16 ? (uint32_t) (around + offset) :
+			UINT32_MAX - rand() % 3;
+		break;
+	case KNOT_VALUE_TYPE_INT64:
+		value.val_i64 = rand() % 16 ? around + offset :
+			(rand() % 2 ? INT64_MAX : INT64_MIN);
+		break;
+	case KNOT_VALUE_TYPE_UINT64:
+		value.val_u64 = rand() % 16 ? (uint64_t) (around + offset) :
+			UINT64_MAX - rand() % 3;
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		switch (rand() % 16) {
+		case 0:
+			value.val_f = NAN;
+			break;
+		case 1:
+			value.val_f = -0.0f;
+			break;
+		default:
+			value.val_f = around + offset * 0.75f;
+		}
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		value.val_b = rand() % 2;
+		break;
+	case KNOT_VALUE_TYPE_RAW:
+		for (i = 0; i < 4; i++)
+			value.raw[i] = rand() % 3;
+		break;
+	}
+
+	return value;
+}
+
+static void random_event(struct scalar_item *item)
+{
+	int lower = rand() % 40 - 20;
+	int upper = lower + rand() % 30;
+
+	memset(&item->event, 0, sizeof(item->event));
+	memset(&item->filter, 0, sizeof(item->filter));
+
+	item->value_type = KNOT_VALUE_TYPE_MIN +
+		rand() % (KNOT_VALUE_TYPE_MAX - KNOT_VALUE_TYPE_MIN + 1);
+	item->event.event_flags = rand() % 2 ? KNOT_EVT_FLAG_CHANGE : 0;
+	if (rand() % 2)
+		item->event.event_flags |= KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	if (rand() % 2)
+		item->event.event_flags |= KNOT_EVT_FLAG_LOWER_THRESHOLD;
+
+	item->event.lower_limit = random_value(item->value_type, lower);
+	item->event.upper_limit = random_value(item->value_type, upper);
+	item->filter.hysteresis = pick(hysteresis_pool);
+	item->filter.deadband_abs = pick(deadband_abs_pool);
+	item->filter.deadband_pct = pick(deadband_pct_pool);
+	item->filter.raw_len = rand() % 5;
+	item->zone = EVENT_ZONE_NORMAL;
+}
+
+static void teardown(void)
+{
+	event_batch_destroy();
+}
+
+START_TEST(event_batch_reports_changed_slots)
+{
+	knot_event event = { .event_flags = KNOT_EVT_FLAG_CHANGE };
+	struct event_filter filter = { 0 };
+	knot_value_type value = { .val_i = 7 };
+	int slot;
+
+	for (slot = 0; slot < 70; slot++)
+		ck_assert_int_eq(event_batch_add(KNOT_VALUE_TYPE_INT, &event,
+						 &filter), slot);
+
+	event_batch_set_value(3, &value);
+	event_batch_set_value(65, &value);
+
+	ck_assert_int_eq(event_batch_evaluate(publish), 2);
+	ck_assert(is_published(3));
+	ck_assert(is_published(65));
+	ck_assert(!is_published(4));
+
+	/* Same value again: already sent */
+	event_batch_set_value(3, &value);
+	ck_assert_int_eq(event_batch_evaluate(publish), 0);
+}
+END_TEST
+
+START_TEST(event_batch_skips_items_not_read)
+{
+	knot_event event = {
+		.event_flags = KNOT_EVT_FLAG_LOWER_THRESHOLD,
+		.lower_limit = { .val_i = 10 }
+	};
+	struct event_filter filter = { 0 };
+
+	event_batch_add(KNOT_VALUE_TYPE_INT, &event, &filter);
+
+	/* 0 is below the limit, but it was never read */
+	ck_assert_int_eq(event_batch_evaluate(publish), 0);
+}
+END_TEST
+
+START_TEST(event_batch_update_keeps_pending_value)
+{
+	knot_event event = {
+		.event_flags = KNOT_EVT_FLAG_UPPER_THRESHOLD,
+		.upper_limit = { .val_i = 100 }
+	};
+	struct event_filter filter = { 0 };
+	knot_value_type value = { .val_i = 50 };
+
+	event_batch_add(KNOT_VALUE_TYPE_INT, &event, &filter);
+	event_batch_set_value(0, &value);
+
+	/* Read before the update, above the new limit */
+	event.upper_limit.val_i = 40;
+	event_batch_update(0, KNOT_VALUE_TYPE_INT, &event, &filter);
+
+	ck_assert_int_eq(event_batch_evaluate(publish), 1);
+	ck_assert(is_published(0));
+}
+END_TEST
+
+START_TEST(event_batch_matches_scalar_path)
+{
+	struct scalar_item *item;
+	int old_type;
+	int expected;
+	int round;
+	int slot;
+	int rc;
+
+	srand(_i + 1);
+
+	for (slot = 0; slot < ITEMS_COUNT; slot++) {
+		item = &items[slot];
+		memset(item, 0, sizeof(*item));
+		random_event(item);
+		ck_assert_int_eq(event_batch_add(item->value_type,
+						 &item->event, &item->filter),
+				 slot);
+	}
+
+	for (round = 0; round < ROUNDS; round++) {
+		for (slot = 0; slot < ITEMS_COUNT; slot++) {
+			item = &items[slot];
+			if (rand() % 3)
+				continue;
+
+			item->current = random_value(item->value_type,
+						     rand() % 60 - 30);
+			item->dirty = true;
+			event_batch_set_value(slot, &item->current);
+		}
+
+		/*
+		 * Config updates restart from the normal zone. A pending value
+		 * is only dropped when it was read as another value type.
+		 */
+		if (round % 50 == 49) {
+			slot = rand() % ITEMS_COUNT;
+			item = &items[slot];
+			old_type = item->value_type;
+			random_event(item);
+			if (item->value_type != old_type)
+				item->dirty = false;
+			event_batch_update(slot, item->value_type,
+					   &item->event, &item->filter);
+		}
+
+		rc = event_batch_evaluate(publish);
+
+		expected = 0;
+		for (slot = 0; slot < ITEMS_COUNT; slot++) {
+			item = &items[slot];
+			if (!item->dirty) {
+				ck_assert(!is_published(slot));
+				continue;
+			}
+
+			item->dirty = false;
+			if (event_check_value(item->event, &item->filter,
+					      item->current, item->sent,
+					      item->value_type,
+					      &item->zone) > 0) {
+				item->sent = item->current;
+				expected++;
+				ck_assert_msg(is_published(slot),
+					      "round %d slot %d type %d",
+					      round, slot, item->value_type);
+			} else {
+				ck_assert_msg(!is_published(slot),
+					      "round %d slot %d type %d",
+					      round, slot, item->value_type);
+			}
+		}
+
+		ck_assert_int_eq(rc, expected);
+	}
+}
+END_TEST
+
+Suite *event_batch_suite(void)
+{
+	Suite *batch_suite;
+	TCase *tc_batch;
+
+	batch_suite = suite_create("Event batch");
+
+	/* Batch evaluation test case */
+	tc_batch = tcase_create("Batch");
+	tcase_add_checked_fixture(tc_batch, NULL, teardown);
+	tcase_add_test(tc_batch, event_batch_reports_changed_slots);
+	tcase_add_test(tc_batch, event_batch_skips_items_not_read);
+	tcase_add_test(tc_batch, event_batch_update_keeps_pending_value);
+	/* Differential test against event_check_value(), several seeds */
+	tcase_add_loop_test(tc_batch, event_batch_matches_scalar_path, 0, 8);
+
+	suite_add_tcase(batch_suite, tc_batch);
+
+	return batch_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *batch_suite;
+	SRunner *batch_suite_runner;
+
+	batch_suite = event_batch_suite();
+	batch_suite_runner = srunner_create(batch_suite);
+
+	srunner_run_all(batch_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(batch_suite_runner);
+	srunner_free(batch_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
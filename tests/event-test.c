@@ -0,0 +1,415 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <knot/knot_protocol.h>
+#include <knot/knot_types.h>
+#include <ell/ell.h>
+
+#include "src/event.h"
+
+static knot_event event;
+static struct event_filter filter;
+static enum event_zone zone;
+
+static int check_int(int val, int sent)
+{
+	knot_value_type current_val = { .val_i = val };
+	knot_value_type sent_val = { .val_i = sent };
+
+	return event_check_value(event, &filter, current_val, sent_val,
+				 KNOT_VALUE_TYPE_INT, &zone);
+}
+
+static void setup(void)
+{
+	memset(&event, 0, sizeof(event));
+	memset(&filter, 0, sizeof(filter));
+	zone = EVENT_ZONE_NORMAL;
+}
+
+START_TEST(event_upper_threshold_fires_on_entry_and_exit)
+{
+	event.event_flags = KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	event.upper_limit.val_i = 100;
+
+	ck_assert_int_eq(check_int(90, 0), 0);
+	ck_assert_int_eq(check_int(110, 0), 1);
+	ck_assert_int_eq(check_int(120, 0), 0);
+	ck_assert_int_eq(check_int(130, 0), 0);
+	ck_assert_int_eq(check_int(100, 0), 1);
+	ck_assert_int_eq(zone, EVENT_ZONE_NORMAL);
+}
+END_TEST
+
+START_TEST(event_lower_threshold_fires_on_entry_and_exit)
+{
+	event.event_flags = KNOT_EVT_FLAG_LOWER_THRESHOLD;
+	event.lower_limit.val_i = 10;
+
+	ck_assert_int_eq(check_int(5, 0), 1);
+	ck_assert_int_eq(check_int(4, 0), 0);
+	ck_assert_int_eq(check_int(11, 0), 1);
+}
+END_TEST
+
+START_TEST(event_hysteresis_delays_exit)
+{
+	event.event_flags = KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	event.upper_limit.val_i = 100;
+	filter.hysteresis = 10;
+
+	ck_assert_int_eq(check_int(101, 0), 1);
+	ck_assert_int_eq(check_int(99, 0), 0);
+	ck_assert_int_eq(check_int(91, 0), 0);
+	ck_assert_int_eq(check_int(101, 0), 0);
+	ck_assert_int_eq(check_int(90, 0), 1);
+	ck_assert_int_eq(check_int(101, 0), 1);
+}
+END_TEST
+
+START_TEST(event_jump_between_thresholds_fires)
+{
+	event.event_flags = KNOT_EVT_FLAG_LOWER_THRESHOLD |
+			    KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	event.lower_limit.val_i = 10;
+	event.upper_limit.val_i = 100;
+
+	ck_assert_int_eq(check_int(200, 0), 1);
+	ck_assert_int_eq(check_int(0, 0), 1);
+	ck_assert_int_eq(zone, EVENT_ZONE_BELOW);
+}
+END_TEST
+
+START_TEST(event_hysteresis_on_float)
+{
+	knot_value_type current_val = { .val_f = 24.6 };
+	knot_value_type sent_val = { .val_f = 0 };
+
+	event.event_flags = KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	event.upper_limit.val_f = 25.0;
+	filter.hysteresis = 0.5;
+	zone = EVENT_ZONE_ABOVE;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_FLOAT,
+					   &zone), 0);
+
+	current_val.val_f = 24.5;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_FLOAT,
+					   &zone), 1);
+}
+END_TEST
+
+START_TEST(event_change_fires_inside_zone)
+{
+	event.event_flags = KNOT_EVT_FLAG_CHANGE |
+			    KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	event.upper_limit.val_i = 100;
+
+	ck_assert_int_eq(check_int(110, 0), 1);
+	ck_assert_int_eq(check_int(110, 110), 0);
+	ck_assert_int_eq(check_int(120, 110), 1);
+}
+END_TEST
+
+START_TEST(event_change_within_abs_deadband_is_ignored)
+{
+	event.event_flags = KNOT_EVT_FLAG_CHANGE;
+	filter.deadband_abs = 5;
+
+	ck_assert_int_eq(check_int(105, 100), 0);
+	ck_assert_int_eq(check_int(95, 100), 0);
+	ck_assert_int_eq(check_int(106, 100), 1);
+}
+END_TEST
+
+START_TEST(event_change_within_pct_deadband_is_ignored)
+{
+	event.event_flags = KNOT_EVT_FLAG_CHANGE;
+	filter.deadband_abs = 1;
+	filter.deadband_pct = 10;
+
+	ck_assert_int_eq(check_int(1100, 1000), 0);
+	ck_assert_int_eq(check_int(1101, 1000), 1);
+	/* The absolute band wins near zero */
+	ck_assert_int_eq(check_int(1, 0), 0);
+	ck_assert_int_eq(check_int(-2, 0), 1);
+}
+END_TEST
+
+START_TEST(event_deadband_ignored_for_bool)
+{
+	knot_value_type current_val = { .val_b = true };
+	knot_value_type sent_val = { .val_b = false };
+
+	event.event_flags = KNOT_EVT_FLAG_CHANGE;
+	filter.deadband_abs = 5;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_BOOL,
+					   &zone), 1);
+}
+END_TEST
+
+START_TEST(event_uint_compares_above_int_max)
+{
+	knot_value_type current_val = { .val_u = 3000000000U };
+	knot_value_type sent_val = { .val_u = 0 };
+
+	event.event_flags = KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	event.upper_limit.val_u = 2000000000U;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT,
+					   &zone), 1);
+	ck_assert_int_eq(zone, EVENT_ZONE_ABOVE);
+}
+END_TEST
+
+START_TEST(event_uint_hysteresis_saturates)
+{
+	knot_value_type current_val = { .val_u = 6 };
+	knot_value_type sent_val = { .val_u = 0 };
+
+	/* upper_limit - hysteresis would wrap around without saturation */
+	event.event_flags = KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	event.upper_limit.val_u = 5;
+	filter.hysteresis = 10;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT,
+					   &zone), 1);
+
+	current_val.val_u = 1;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT,
+					   &zone), 0);
+
+	current_val.val_u = 0;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT,
+					   &zone), 1);
+
+	/* lower_limit + hysteresis would wrap around to a small value */
+	event.event_flags = KNOT_EVT_FLAG_LOWER_THRESHOLD;
+	event.lower_limit.val_u = UINT32_MAX - 5;
+	current_val.val_u = UINT32_MAX - 6;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT,
+					   &zone), 1);
+
+	current_val.val_u = UINT32_MAX - 1;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT,
+					   &zone), 0);
+
+	current_val.val_u = UINT32_MAX;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT,
+					   &zone), 1);
+}
+END_TEST
+
+START_TEST(event_int64_hysteresis_saturates)
+{
+	knot_value_type current_val = { .val_i64 = INT64_MAX - 6 };
+	knot_value_type sent_val = { .val_i64 = 0 };
+
+	/* lower_limit + hysteresis would overflow without saturation */
+	event.event_flags = KNOT_EVT_FLAG_LOWER_THRESHOLD;
+	event.lower_limit.val_i64 = INT64_MAX - 5;
+	filter.hysteresis = 10;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT64,
+					   &zone), 1);
+
+	current_val.val_i64 = INT64_MAX - 1;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT64,
+					   &zone), 0);
+
+	current_val.val_i64 = INT64_MAX;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT64,
+					   &zone), 1);
+}
+END_TEST
+
+START_TEST(event_int_hysteresis_saturates)
+{
+	knot_value_type current_val = { .val_i = INT32_MIN + 6 };
+	knot_value_type sent_val = { .val_i = 0 };
+
+	/* upper_limit - hysteresis would overflow without saturation */
+	event.event_flags = KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	event.upper_limit.val_i = INT32_MIN + 5;
+	filter.hysteresis = 10;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT,
+					   &zone), 1);
+
+	current_val.val_i = INT32_MIN + 1;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT,
+					   &zone), 0);
+
+	current_val.val_i = INT32_MIN;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT,
+					   &zone), 1);
+
+	/* Past the range of the value type */
+	filter.hysteresis = 1e30;
+	current_val.val_i = INT32_MAX;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT,
+					   &zone), 1);
+
+	current_val.val_i = INT32_MIN + 1;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT,
+					   &zone), 0);
+}
+END_TEST
+
+START_TEST(event_int64_below_lower_threshold)
+{
+	knot_value_type current_val = { .val_i64 = -5000000000LL };
+	knot_value_type sent_val = { .val_i64 = 0 };
+
+	event.event_flags = KNOT_EVT_FLAG_LOWER_THRESHOLD;
+	event.lower_limit.val_i64 = -4000000000LL;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT64,
+					   &zone), 1);
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_INT64,
+					   &zone), 0);
+}
+END_TEST
+
+START_TEST(event_uint64_unchanged_is_not_reported)
+{
+	knot_value_type current_val = { .val_u64 = 18000000000000000000ULL };
+	knot_value_type sent_val = { .val_u64 = 18000000000000000000ULL };
+
+	event.event_flags = KNOT_EVT_FLAG_CHANGE;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT64,
+					   &zone), 0);
+
+	current_val.val_u64++;
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_UINT64,
+					   &zone), 1);
+}
+END_TEST
+
+START_TEST(event_raw_compares_meaningful_bytes)
+{
+	knot_value_type current_val;
+	knot_value_type sent_val;
+
+	memset(&current_val, 0, sizeof(current_val));
+	memset(&sent_val, 0, sizeof(sent_val));
+	memcpy(current_val.raw, "SN0042", 6);
+	memcpy(sent_val.raw, "SN0042", 6);
+	/* Past raw_len, differences are not part of the value */
+	current_val.raw[6] = 0xFF;
+
+	event.event_flags = KNOT_EVT_FLAG_CHANGE;
+	filter.raw_len = 6;
+
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_RAW,
+					   &zone), 0);
+
+	current_val.raw[5] = '3';
+	ck_assert_int_eq(event_check_value(event, &filter, current_val,
+					   sent_val, KNOT_VALUE_TYPE_RAW,
+					   &zone), 1);
+}
+END_TEST
+
+Suite *event_suite(void)
+{
+	Suite *evt_suite;
+	TCase *tc_threshold;
+	TCase *tc_change;
+	TCase *tc_types;
+
+	evt_suite = suite_create("Event");
+
+	/* Threshold events test case */
+	tc_threshold = tcase_create("Threshold");
+	tcase_add_checked_fixture(tc_threshold, setup, NULL);
+	tcase_add_test(tc_threshold,
+		       event_upper_threshold_fires_on_entry_and_exit);
+	tcase_add_test(tc_threshold,
+		       event_lower_threshold_fires_on_entry_and_exit);
+	tcase_add_test(tc_threshold, event_hysteresis_delays_exit);
+	tcase_add_test(tc_threshold, event_jump_between_thresholds_fires);
+	tcase_add_test(tc_threshold, event_hysteresis_on_float);
+	tcase_add_test(tc_threshold, event_change_fires_inside_zone);
+
+	/* Change events test case */
+	tc_change = tcase_create("Change");
+	tcase_add_checked_fixture(tc_change, setup, NULL);
+	tcase_add_test(tc_change, event_change_within_abs_deadband_is_ignored);
+	tcase_add_test(tc_change, event_change_within_pct_deadband_is_ignored);
+	tcase_add_test(tc_change, event_deadband_ignored_for_bool);
+
+	/* Value types test case */
+	tc_types = tcase_create("Types");
+	tcase_add_checked_fixture(tc_types, setup, NULL);
+	tcase_add_test(tc_types, event_uint_compares_above_int_max);
+	tcase_add_test(tc_types, event_uint_hysteresis_saturates);
+	tcase_add_test(tc_types, event_int_hysteresis_saturates);
+	tcase_add_test(tc_types, event_int64_hysteresis_saturates);
+	tcase_add_test(tc_types, event_int64_below_lower_threshold);
+	tcase_add_test(tc_types, event_uint64_unchanged_is_not_reported);
+	tcase_add_test(tc_types, event_raw_compares_meaningful_bytes);
+
+	suite_add_tcase(evt_suite, tc_threshold);
+	suite_add_tcase(evt_suite, tc_change);
+	suite_add_tcase(evt_suite, tc_types);
+
+	return evt_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *evt_suite;
+	SRunner *evt_suite_runner;
+
+	evt_suite = event_suite();
+	evt_suite_runner = srunner_create(evt_suite);
+
+	srunner_run_all(evt_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(evt_suite_runner);
+	srunner_free(evt_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
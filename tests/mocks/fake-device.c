@@ -24,6 +24,8 @@ int start_event_rc;
 int schema_change_rc;
 int cred_rc;
 int store_cred_rc;
+int stored_data_count;
+int stop_replay_count;
 
 int device_start_event(void)
 {
@@ -75,6 +77,11 @@ int device_clear_credentials_on_file(void)
 	return 0;
 }
 
+int device_store_schema_on_file(void)
+{
+	return 0;
+}
+
 void device_publish_data_list(struct l_queue *sensor_id_list)
 {
 	/* purposely left empty as no behaviour expected/required */
@@ -85,6 +92,21 @@ void device_publish_data_all(void)
 	/* purposely left empty as no behaviour expected/required */
 }
 
+void device_store_data_list(struct l_queue *sensor_id_list)
+{
+	stored_data_count += l_queue_length(sensor_id_list);
+}
+
+void device_start_offline_replay(void)
+{
+	/* purposely left empty as no behaviour expected/required */
+}
+
+void device_stop_offline_replay(void)
+{
+	stop_replay_count++;
+}
+
 void device_set_schema_change_rc(int rc)
 {
 	schema_change_rc = rc;
@@ -104,3 +126,19 @@ void device_set_store_cred_rc(int rc)
 {
 	store_cred_rc = rc;
 }
+
+int device_get_stored_data_count(void)
+{
+	return stored_data_count;
+}
+
+int device_get_stop_replay_count(void)
+{
+	return stop_replay_count;
+}
+
+void device_reset_counts(void)
+{
+	stored_data_count = 0;
+	stop_replay_count = 0;
+}
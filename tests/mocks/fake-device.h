@@ -18,3 +18,6 @@ void device_set_schema_change_rc(int rc);
 void device_set_start_config_rc(int rc);
 void device_set_has_cred_rc(int rc);
 void device_set_store_cred_rc(int rc);
+int device_get_stored_data_count(void);
+int device_get_stop_replay_count(void);
+void device_reset_counts(void);
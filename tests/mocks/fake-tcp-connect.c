@@ -0,0 +1,83 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <ell/ell.h>
+
+#include "src/tcp-connect.h"
+#include "fake-tcp-connect.h"
+
+struct tcp_connect {
+	tcp_connect_cb_t cb;
+	void *user_data;
+	bool started;
+};
+
+/* Descriptor handed to the next connection attempt, as if connected */
+static int connect_fd = -1;
+
+void tcp_connect_set_fd(int fd)
+{
+	connect_fd = fd;
+}
+
+static void on_connect_idle(void *user_data)
+{
+	struct tcp_connect *conn = user_data;
+	struct l_io *io;
+
+	if (!conn->started)
+		return;
+
+	conn->started = false;
+
+	if (connect_fd < 0) {
+		conn->cb(NULL, -ECONNREFUSED, conn->user_data);
+		return;
+	}
+
+	io = l_io_new(connect_fd);
+	connect_fd = -1;
+	conn->cb(io, 0, conn->user_data);
+}
+
+struct tcp_connect *tcp_connect_new(const char *host, const char *port)
+{
+	return l_new(struct tcp_connect, 1);
+}
+
+int tcp_connect_start(struct tcp_connect *conn, unsigned int timeout_ms,
+		      tcp_connect_cb_t cb, void *user_data)
+{
+	conn->cb = cb;
+	conn->user_data = user_data;
+	conn->started = true;
+
+	/* Completed from the main loop, as a real connection */
+	l_idle_oneshot(on_connect_idle, conn, NULL);
+
+	return 0;
+}
+
+void tcp_connect_cancel(struct tcp_connect *conn)
+{
+	conn->started = false;
+}
+
+void tcp_connect_free(struct tcp_connect *conn)
+{
+	l_free(conn);
+}
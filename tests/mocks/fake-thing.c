@@ -0,0 +1,190 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "src/device.h"
+#include "fake-thing.h"
+
+#define FAKE_ITEMS_MAX	16
+
+/* What the properties set, as device.c would keep it */
+struct knot_thing {
+	char name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
+	char **slave_urls;
+	int slaves_len;
+	int sensor_ids[FAKE_ITEMS_MAX];
+	int items_len;
+	char *offline_path;
+	char *user_token;
+	char *rabbitmq_url;
+};
+
+/* Data items with this sensor id are rejected, as a newer build would */
+static int reject_sensor_id = -1;
+
+struct knot_thing *fake_thing_new(void)
+{
+	return l_new(struct knot_thing, 1);
+}
+
+void fake_thing_free(struct knot_thing *thing)
+{
+	device_clear_thing_items(thing);
+	l_free(thing->user_token);
+	l_free(thing->rabbitmq_url);
+	l_free(thing);
+	reject_sensor_id = -1;
+}
+
+void fake_thing_reject_sensor_id(int sensor_id)
+{
+	reject_sensor_id = sensor_id;
+}
+
+const char *fake_thing_get_name(struct knot_thing *thing)
+{
+	return thing->name;
+}
+
+int fake_thing_get_slaves_len(struct knot_thing *thing)
+{
+	return thing->slaves_len;
+}
+
+int fake_thing_get_items_len(struct knot_thing *thing)
+{
+	return thing->items_len;
+}
+
+int fake_thing_get_sensor_id(struct knot_thing *thing, int index)
+{
+	return thing->sensor_ids[index];
+}
+
+void device_set_thing_name(struct knot_thing *thing, const char *name)
+{
+	strcpy(thing->name, name);
+}
+
+void device_set_thing_user_token(struct knot_thing *thing, char *token)
+{
+	l_free(thing->user_token);
+	thing->user_token = token;
+}
+
+int device_add_thing_modbus_slave(struct knot_thing *thing, int slave_id,
+				  char *url)
+{
+	thing->slave_urls = l_realloc(thing->slave_urls,
+				      sizeof(char *) * (thing->slaves_len + 1));
+	thing->slave_urls[thing->slaves_len] = url;
+
+	return thing->slaves_len++;
+}
+
+void device_set_thing_read_max_gap(struct knot_thing *thing, int max_gap)
+{
+}
+
+void device_set_thing_modbus_tcp_window(struct knot_thing *thing, int window)
+{
+}
+
+void device_set_thing_modbus_reconnect(struct knot_thing *thing,
+				       int initial_ms, int max_ms,
+				       float multiplier)
+{
+}
+
+void device_set_thing_publish_window(struct knot_thing *thing, int window_ms)
+{
+}
+
+void device_set_thing_offline_store(struct knot_thing *thing, char *path,
+				    int capacity, int replay_rate)
+{
+	thing->offline_path = path;
+}
+
+void device_clear_thing_items(struct knot_thing *thing)
+{
+	int i;
+
+	for (i = 0; i < thing->slaves_len; i++)
+		l_free(thing->slave_urls[i]);
+	l_free(thing->slave_urls);
+	thing->slave_urls = NULL;
+	thing->slaves_len = 0;
+
+	thing->items_len = 0;
+
+	l_free(thing->offline_path);
+	thing->offline_path = NULL;
+}
+
+int device_set_new_data_item(struct knot_thing *thing, int sensor_id,
+			     knot_schema schema, knot_event event,
+			     const struct event_filter *filter, int slave,
+			     int reg_addr, int bit_offset,
+			     int endianness_type, int polling_interval_ms)
+{
+	if (sensor_id == reject_sensor_id ||
+			thing->items_len == FAKE_ITEMS_MAX)
+		return -EINVAL;
+
+	thing->sensor_ids[thing->items_len++] = sensor_id;
+
+	return 0;
+}
+
+void device_update_config_data_item(struct knot_thing *thing,
+				    knot_msg_config *config)
+{
+}
+
+void *device_data_item_lookup(struct knot_thing *thing, int sensor_id)
+{
+	return NULL;
+}
+
+void device_set_thing_rabbitmq_url(struct knot_thing *thing, char *url)
+{
+	l_free(thing->rabbitmq_url);
+	thing->rabbitmq_url = url;
+}
+
+void device_set_thing_credentials(struct knot_thing *thing, const char *id,
+				  const char *token)
+{
+}
+
+void device_set_thing_schema_hash(struct knot_thing *thing,
+				  uint64_t schema_hash)
+{
+}
+
+void device_clear_thing_id(struct knot_thing *thing)
+{
+}
+
+void device_clear_thing_token(struct knot_thing *thing)
+{
+}
@@ -0,0 +1,23 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+struct knot_thing *fake_thing_new(void);
+void fake_thing_free(struct knot_thing *thing);
+void fake_thing_reject_sensor_id(int sensor_id);
+const char *fake_thing_get_name(struct knot_thing *thing);
+int fake_thing_get_slaves_len(struct knot_thing *thing);
+int fake_thing_get_items_len(struct knot_thing *thing);
+int fake_thing_get_sensor_id(struct knot_thing *thing, int index);
@@ -0,0 +1,319 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <modbus/modbus.h>
+#include <ell/ell.h>
+
+#include "src/modbus-worker.h"
+#include "src/modbus-tcp.h"
+#include "mocks/fake-tcp-connect.h"
+
+#define WINDOW		4
+#define REQUEST_LEN	12
+#define REQUESTS	(2 * WINDOW)
+#define COUNT		2
+/* Past the 500 ms response timeout of the client */
+#define WAIT_MS		2000
+
+static struct modbus_tcp *tcp;
+static int peer_fd;
+/* The client end, owned by the client once connected */
+static int client_fd;
+static int connect_rc;
+static int disconnects;
+static struct modbus_worker_msg done[REQUESTS];
+static int done_len;
+static uint16_t regs[REQUESTS][COUNT];
+
+static void on_complete(struct modbus_worker_msg *msg, void *user_data)
+{
+	if (msg->op == MODBUS_WORKER_OP_CONNECT) {
+		connect_rc = msg->rc;
+		return;
+	}
+
+	done[done_len++] = *msg;
+}
+
+static void on_disconnect(void *user_data)
+{
+	disconnects++;
+}
+
+static void iterate_until(const int *counter, int target)
+{
+	uint64_t end = l_time_now() + WAIT_MS * L_USEC_PER_MSEC;
+
+	while (*counter < target && l_time_before(l_time_now(), end))
+		l_main_iterate(10);
+
+	ck_assert_int_ge(*counter, target);
+}
+
+static void setup(void)
+{
+	struct modbus_worker_msg msg = { .op = MODBUS_WORKER_OP_CONNECT };
+	int fds[2];
+	uint64_t end;
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+				    fds), 0);
+	client_fd = fds[0];
+	peer_fd = fds[1];
+	tcp_connect_set_fd(client_fd);
+
+	l_main_init();
+
+	connect_rc = 1;
+	disconnects = 0;
+	done_len = 0;
+	memset(regs, 0, sizeof(regs));
+
+	tcp = modbus_tcp_new("127.0.0.1", "502", WINDOW, 1000, on_complete,
+			     on_disconnect, NULL);
+	ck_assert_ptr_nonnull(tcp);
+	ck_assert_int_eq(modbus_tcp_submit(tcp, &msg), 0);
+
+	end = l_time_now() + WAIT_MS * L_USEC_PER_MSEC;
+	while (connect_rc > 0 && l_time_before(l_time_now(), end))
+		l_main_iterate(10);
+
+	ck_assert_int_eq(connect_rc, 0);
+}
+
+static void teardown(void)
+{
+	modbus_tcp_free(tcp);
+	if (peer_fd >= 0)
+		close(peer_fd);
+	l_main_exit();
+}
+
+static void submit_read(int i)
+{
+	struct modbus_worker_msg msg = {
+		.op = MODBUS_WORKER_OP_READ_REGISTERS,
+		.slave_id = 1,
+		.addr = 10 * i,
+		.count = COUNT,
+		.dest = regs[i],
+		.done_data = L_INT_TO_PTR(i)
+	};
+
+	ck_assert_int_eq(modbus_tcp_submit(tcp, &msg), 0);
+}
+
+/* Reads len bytes sent by the client, running the loop meanwhile */
+static void peer_recv(uint8_t *buf, size_t len)
+{
+	uint64_t end = l_time_now() + WAIT_MS * L_USEC_PER_MSEC;
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < len && l_time_before(l_time_now(), end)) {
+		n = recv(peer_fd, buf + off, len - off, 0);
+		if (n > 0)
+			off += n;
+		else
+			l_main_iterate(10);
+	}
+
+	ck_assert_uint_eq(off, len);
+}
+
+static void peer_reply(const uint8_t *req)
+{
+	uint8_t rsp[9 + 2 * COUNT];
+	uint16_t addr = req[8] << 8 | req[9];
+	int i;
+
+	/* Same transaction and unit, the register value is its address */
+	memcpy(rsp, req, 4);
+	rsp[4] = 0;
+	rsp[5] = 3 + 2 * COUNT;
+	rsp[6] = req[6];
+	rsp[7] = req[7];
+	rsp[8] = 2 * COUNT;
+	for (i = 0; i < COUNT; i++) {
+		rsp[9 + 2 * i] = (addr + i) >> 8;
+		rsp[10 + 2 * i] = addr + i;
+	}
+
+	ck_assert_int_eq(send(peer_fd, rsp, sizeof(rsp), 0), sizeof(rsp));
+}
+
+static void assert_read(const struct modbus_worker_msg *msg)
+{
+	int i = L_PTR_TO_INT(msg->done_data);
+
+	ck_assert_int_eq(msg->rc, COUNT);
+	ck_assert_uint_eq(regs[i][0], 10 * i);
+	ck_assert_uint_eq(regs[i][1], 10 * i + 1);
+}
+
+START_TEST(modbus_tcp_pipelines_requests)
+{
+	uint8_t reqs[3][REQUEST_LEN];
+	int i;
+
+	for (i = 0; i < 3; i++)
+		submit_read(i);
+
+	/* All of them are sent before any response */
+	peer_recv(reqs[0], sizeof(reqs));
+
+	for (i = 0; i < 3; i++) {
+		ck_assert_uint_eq(reqs[i][7], MODBUS_FC_READ_HOLDING_REGISTERS);
+		ck_assert_uint_eq(reqs[i][8] << 8 | reqs[i][9], 10 * i);
+	}
+
+	/* Matched by transaction id, whatever the order */
+	for (i = 2; i >= 0; i--)
+		peer_reply(reqs[i]);
+
+	iterate_until(&done_len, 3);
+
+	ck_assert_int_eq(L_PTR_TO_INT(done[0].done_data), 2);
+	for (i = 0; i < 3; i++)
+		assert_read(&done[i]);
+}
+END_TEST
+
+START_TEST(modbus_tcp_maps_exceptions)
+{
+	uint8_t req[REQUEST_LEN];
+	uint8_t rsp[9];
+
+	submit_read(0);
+	peer_recv(req, sizeof(req));
+
+	memcpy(rsp, req, 4);
+	rsp[4] = 0;
+	rsp[5] = 3;
+	rsp[6] = req[6];
+	rsp[7] = req[7] | 0x80;
+	rsp[8] = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+	ck_assert_int_eq(send(peer_fd, rsp, sizeof(rsp), 0), sizeof(rsp));
+
+	iterate_until(&done_len, 1);
+	ck_assert_int_eq(done[0].rc, -EMBXILADD);
+}
+END_TEST
+
+START_TEST(modbus_tcp_times_out_with_unsent_requests)
+{
+	uint8_t reqs[REQUESTS][REQUEST_LEN];
+	uint8_t junk[4096];
+	size_t filled = 0;
+	ssize_t n;
+	int i;
+
+	/* The peer stops reading: the socket buffer is full */
+	memset(junk, 0, sizeof(junk));
+	while ((n = send(client_fd, junk, sizeof(junk), 0)) > 0)
+		filled += n;
+
+	for (i = 0; i < REQUESTS; i++)
+		submit_read(i);
+
+	/* The first window times out with its requests still unsent */
+	iterate_until(&done_len, WINDOW);
+	for (i = 0; i < WINDOW; i++)
+		ck_assert_int_eq(done[i].rc, -ETIMEDOUT);
+
+	/* The peer reads again: the rest are sent after the expired ones */
+	while (filled) {
+		n = recv(peer_fd, junk, filled < sizeof(junk) ?
+			 filled : sizeof(junk), 0);
+		if (n > 0)
+			filled -= n;
+		else
+			l_main_iterate(10);
+	}
+
+	peer_recv(reqs[0], sizeof(reqs));
+
+	for (i = 0; i < REQUESTS; i++)
+		ck_assert_uint_eq(reqs[i][8] << 8 | reqs[i][9], 10 * i);
+
+	for (i = WINDOW; i < REQUESTS; i++)
+		peer_reply(reqs[i]);
+
+	iterate_until(&done_len, REQUESTS);
+	for (i = WINDOW; i < REQUESTS; i++)
+		assert_read(&done[i]);
+}
+END_TEST
+
+START_TEST(modbus_tcp_fails_requests_on_disconnect)
+{
+	int i;
+
+	for (i = 0; i < REQUESTS; i++)
+		submit_read(i);
+
+	close(peer_fd);
+	peer_fd = -1;
+
+	iterate_until(&done_len, REQUESTS);
+	for (i = 0; i < REQUESTS; i++)
+		ck_assert_int_eq(done[i].rc, -ECONNRESET);
+
+	ck_assert_int_eq(disconnects, 1);
+}
+END_TEST
+
+Suite *modbus_tcp_suite(void)
+{
+	Suite *tcp_suite;
+	TCase *tc_tcp;
+
+	tcp_suite = suite_create("Modbus TCP");
+
+	/* Native client over a socket pair test case */
+	tc_tcp = tcase_create("Client");
+	tcase_add_checked_fixture(tc_tcp, setup, teardown);
+	tcase_add_test(tc_tcp, modbus_tcp_pipelines_requests);
+	tcase_add_test(tc_tcp, modbus_tcp_maps_exceptions);
+	tcase_add_test(tc_tcp, modbus_tcp_times_out_with_unsent_requests);
+	tcase_add_test(tc_tcp, modbus_tcp_fails_requests_on_disconnect);
+
+	suite_add_tcase(tcp_suite, tc_tcp);
+
+	return tcp_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *tcp_suite;
+	SRunner *tcp_suite_runner;
+
+	tcp_suite = modbus_tcp_suite();
+	tcp_suite_runner = srunner_create(tcp_suite);
+
+	srunner_run_all(tcp_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(tcp_suite_runner);
+	srunner_free(tcp_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,171 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <knot/knot_protocol.h>
+#include <knot/knot_types.h>
+#include <ell/ell.h>
+
+#include "src/offline-store.h"
+
+#define STORE_PATH	"offline-store-test.bin"
+
+static int collect_ids(const struct offline_record *record, void *user_data)
+{
+	struct l_queue *ids = user_data;
+
+	l_queue_push_tail(ids, L_INT_TO_PTR(record->sensor_id));
+
+	return 0;
+}
+
+static int reject_record(const struct offline_record *record, void *user_data)
+{
+	return -EIO;
+}
+
+static void push_int(int sensor_id, int val)
+{
+	knot_value_type value = { .val_i = val };
+
+	offline_store_push(sensor_id, KNOT_VALUE_TYPE_INT, sizeof(value.val_i),
+			   &value);
+}
+
+static void setup(void)
+{
+	unlink(STORE_PATH);
+	ck_assert_int_eq(offline_store_open(STORE_PATH, 4), 0);
+}
+
+static void teardown(void)
+{
+	offline_store_close();
+	unlink(STORE_PATH);
+}
+
+START_TEST(offline_store_drains_in_order)
+{
+	struct l_queue *ids = l_queue_new();
+
+	push_int(1, 10);
+	push_int(2, 20);
+	push_int(3, 30);
+
+	ck_assert_int_eq(offline_store_drain(2, collect_ids, ids), 2);
+	ck_assert_int_eq(offline_store_count(), 1);
+	ck_assert_int_eq(L_PTR_TO_INT(l_queue_pop_head(ids)), 1);
+	ck_assert_int_eq(L_PTR_TO_INT(l_queue_pop_head(ids)), 2);
+
+	l_queue_destroy(ids, NULL);
+}
+END_TEST
+
+START_TEST(offline_store_full_drops_oldest)
+{
+	struct l_queue *ids = l_queue_new();
+	int i;
+
+	for (i = 0; i < 6; i++)
+		push_int(i, i);
+
+	ck_assert_int_eq(offline_store_count(), 4);
+	ck_assert_int_eq(offline_store_dropped(), 2);
+
+	ck_assert_int_eq(offline_store_drain(10, collect_ids, ids), 4);
+	ck_assert_int_eq(L_PTR_TO_INT(l_queue_peek_head(ids)), 2);
+	ck_assert_int_eq(L_PTR_TO_INT(l_queue_peek_tail(ids)), 5);
+
+	l_queue_destroy(ids, NULL);
+}
+END_TEST
+
+START_TEST(offline_store_failed_record_is_kept)
+{
+	push_int(1, 10);
+
+	ck_assert_int_eq(offline_store_drain(1, reject_record, NULL), 0);
+	ck_assert_int_eq(offline_store_count(), 1);
+}
+END_TEST
+
+START_TEST(offline_store_survives_reopen)
+{
+	struct l_queue *ids = l_queue_new();
+
+	push_int(7, 70);
+	push_int(8, 80);
+	offline_store_close();
+
+	ck_assert_int_eq(offline_store_open(STORE_PATH, 4), 0);
+	ck_assert_int_eq(offline_store_count(), 2);
+	ck_assert_int_eq(offline_store_drain(1, collect_ids, ids), 1);
+	ck_assert_int_eq(L_PTR_TO_INT(l_queue_peek_head(ids)), 7);
+
+	l_queue_destroy(ids, NULL);
+}
+END_TEST
+
+START_TEST(offline_store_capacity_change_discards)
+{
+	push_int(1, 10);
+	offline_store_close();
+
+	ck_assert_int_eq(offline_store_open(STORE_PATH, 8), 0);
+	ck_assert_int_eq(offline_store_count(), 0);
+}
+END_TEST
+
+Suite *offline_store_suite(void)
+{
+	Suite *store_suite;
+	TCase *tc_ring;
+
+	store_suite = suite_create("Offline store");
+
+	/* Offline store ring test case */
+	tc_ring = tcase_create("Ring");
+	tcase_add_checked_fixture(tc_ring, setup, teardown);
+	tcase_add_test(tc_ring, offline_store_drains_in_order);
+	tcase_add_test(tc_ring, offline_store_full_drops_oldest);
+	tcase_add_test(tc_ring, offline_store_failed_record_is_kept);
+	tcase_add_test(tc_ring, offline_store_survives_reopen);
+	tcase_add_test(tc_ring, offline_store_capacity_change_discards);
+
+	suite_add_tcase(store_suite, tc_ring);
+
+	return store_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *store_suite;
+	SRunner *store_suite_runner;
+
+	store_suite = offline_store_suite();
+	store_suite_runner = srunner_create(store_suite);
+
+	srunner_run_all(store_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(store_suite_runner);
+	srunner_free(store_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
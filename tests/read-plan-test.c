@@ -0,0 +1,195 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <stdlib.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "src/iface-modbus.h"
+#include "src/read-plan.h"
+
+static int entry_offset(struct read_plan_block *block, int id)
+{
+	const struct l_queue_entry *entry;
+	struct read_plan_entry *plan_entry;
+
+	for (entry = l_queue_get_entries(block->entries); entry;
+						entry = entry->next) {
+		plan_entry = entry->data;
+		if (plan_entry->id == id)
+			return plan_entry->offset;
+	}
+
+	return -1;
+}
+
+static void teardown(void)
+{
+	read_plan_destroy();
+}
+
+START_TEST(read_plan_contiguous_registers_is_one_block)
+{
+	struct read_plan_block *block;
+
+	read_plan_add_item(0, 0, 100, TYPE_U16, 1000);
+	read_plan_add_item(1, 0, 101, TYPE_U32, 1000);
+	read_plan_add_item(2, 0, 103, TYPE_U64, 1000);
+
+	ck_assert_int_eq(read_plan_build(0), 1);
+
+	block = read_plan_get_block(0);
+	ck_assert_int_eq(block->space, READ_PLAN_SPACE_REGISTERS);
+	ck_assert_int_eq(block->addr, 100);
+	ck_assert_int_eq(block->count, 7);
+	ck_assert_int_eq(entry_offset(block, 2), 3);
+}
+END_TEST
+
+START_TEST(read_plan_gap_larger_than_max_splits_block)
+{
+	read_plan_add_item(0, 0, 100, TYPE_U16, 1000);
+	read_plan_add_item(1, 0, 105, TYPE_U16, 1000);
+
+	ck_assert_int_eq(read_plan_build(3), 2);
+}
+END_TEST
+
+START_TEST(read_plan_gap_within_max_is_one_block)
+{
+	struct read_plan_block *block;
+
+	read_plan_add_item(0, 0, 105, TYPE_U16, 1000);
+	read_plan_add_item(1, 0, 100, TYPE_U16, 1000);
+
+	ck_assert_int_eq(read_plan_build(4), 1);
+
+	block = read_plan_get_block(0);
+	ck_assert_int_eq(block->addr, 100);
+	ck_assert_int_eq(block->count, 6);
+	ck_assert_int_eq(entry_offset(block, 0), 5);
+}
+END_TEST
+
+START_TEST(read_plan_bits_and_registers_are_split)
+{
+	read_plan_add_item(0, 0, 0, TYPE_BOOL, 1000);
+	read_plan_add_item(1, 0, 1, TYPE_U16, 1000);
+
+	ck_assert_int_eq(read_plan_build(0), 2);
+	ck_assert_int_eq(read_plan_get_block(0)->space, READ_PLAN_SPACE_BITS);
+}
+END_TEST
+
+START_TEST(read_plan_respects_register_limit)
+{
+	int i;
+
+	for (i = 0; i < 130; i++)
+		read_plan_add_item(i, 0, i, TYPE_U16, 1000);
+
+	ck_assert_int_eq(read_plan_build(0), 2);
+	ck_assert_int_eq(read_plan_get_block(0)->count, 125);
+	ck_assert_int_eq(read_plan_get_block(1)->count, 5);
+}
+END_TEST
+
+START_TEST(read_plan_different_intervals_are_split)
+{
+	read_plan_add_item(0, 0, 100, TYPE_U16, 100);
+	read_plan_add_item(1, 0, 101, TYPE_U16, 1000);
+
+	ck_assert_int_eq(read_plan_build(0), 2);
+	ck_assert_int_eq(read_plan_get_block(0)->interval_ms, 100);
+	ck_assert_int_eq(read_plan_get_block(1)->interval_ms, 1000);
+}
+END_TEST
+
+START_TEST(read_plan_different_slaves_are_split)
+{
+	read_plan_add_item(0, 1, 100, TYPE_U16, 1000);
+	read_plan_add_item(1, 0, 101, TYPE_U16, 1000);
+
+	ck_assert_int_eq(read_plan_build(0), 2);
+	ck_assert_int_eq(read_plan_get_block(0)->slave, 0);
+	ck_assert_int_eq(read_plan_get_block(1)->slave, 1);
+}
+END_TEST
+
+START_TEST(read_plan_invalid_bit_offset_is_rejected)
+{
+	ck_assert_int_lt(read_plan_add_item(0, 0, 0, 12, 1000), 0);
+	ck_assert_int_lt(read_plan_add_item(0, 0, 0, TYPE_RAW_MAX + TYPE_U16,
+					    1000), 0);
+}
+END_TEST
+
+START_TEST(read_plan_raw_spans_its_registers)
+{
+	struct read_plan_block *block;
+
+	read_plan_add_item(0, 0, 10, 5 * TYPE_U16, 1000);
+	read_plan_add_item(1, 0, 15, TYPE_U16, 1000);
+
+	ck_assert_int_eq(read_plan_build(0), 1);
+
+	block = read_plan_get_block(0);
+	ck_assert_int_eq(block->count, 6);
+	ck_assert_int_eq(entry_offset(block, 1), 5);
+}
+END_TEST
+
+Suite *read_plan_suite(void)
+{
+	Suite *plan_suite;
+	TCase *tc_build;
+
+	plan_suite = suite_create("Read plan");
+
+	/* Build read plan test case */
+	tc_build = tcase_create("Build");
+	tcase_add_checked_fixture(tc_build, NULL, teardown);
+	tcase_add_test(tc_build, read_plan_contiguous_registers_is_one_block);
+	tcase_add_test(tc_build, read_plan_gap_larger_than_max_splits_block);
+	tcase_add_test(tc_build, read_plan_gap_within_max_is_one_block);
+	tcase_add_test(tc_build, read_plan_bits_and_registers_are_split);
+	tcase_add_test(tc_build, read_plan_respects_register_limit);
+	tcase_add_test(tc_build, read_plan_different_intervals_are_split);
+	tcase_add_test(tc_build, read_plan_different_slaves_are_split);
+	tcase_add_test(tc_build, read_plan_invalid_bit_offset_is_rejected);
+	tcase_add_test(tc_build, read_plan_raw_spans_its_registers);
+
+	suite_add_tcase(plan_suite, tc_build);
+
+	return plan_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *plan_suite;
+	SRunner *plan_suite_runner;
+
+	plan_suite = read_plan_suite();
+	plan_suite_runner = srunner_create(plan_suite);
+
+	srunner_run_all(plan_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(plan_suite_runner);
+	srunner_free(plan_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
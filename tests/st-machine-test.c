@@ -16,6 +16,8 @@
 
 #include <check.h>
 #include <stdlib.h>
+#include <ell/ell.h>
+#include <knot/knot_protocol.h>
 
 #include "src/sm-pvt.h"
 #include "mocks/fake-device.h"
@@ -675,6 +677,80 @@ START_TEST(error_get_next_event_reg_perm_is_error)
 }
 END_TEST
 
+static struct l_queue *new_sensor_id_list(void)
+{
+	struct l_queue *list = l_queue_new();
+
+	l_queue_push_tail(list, L_INT_TO_PTR(1));
+	l_queue_push_tail(list, L_INT_TO_PTR(2));
+
+	return list;
+}
+
+static struct l_queue *new_config_list(void)
+{
+	struct l_queue *list = l_queue_new();
+	knot_msg_config *config = l_new(knot_msg_config, 1);
+
+	config->sensor_id = 1;
+	l_queue_push_tail(list, config);
+
+	return list;
+}
+
+START_TEST(offline_publish_data_is_stored)
+{
+	struct l_queue *list = new_sensor_id_list();
+
+	device_reset_counts();
+	ck_assert_int_eq(get_next_disconnected(EVT_PUB_DATA, list),
+			 ST_DISCONNECTED);
+	ck_assert_int_eq(get_next_auth(EVT_PUB_DATA, list), ST_AUTH);
+	ck_assert_int_eq(get_next_register(EVT_PUB_DATA, list), ST_REGISTER);
+	ck_assert_int_eq(get_next_config(EVT_PUB_DATA, list), ST_CONFIG);
+	ck_assert_int_eq(device_get_stored_data_count(), 8);
+
+	l_queue_destroy(list, NULL);
+}
+END_TEST
+
+START_TEST(offline_reg_ok_with_token_is_not_stored)
+{
+	char token[] = "a1b2c3d4e5f6a1b2c3d4e5f6a1b2c3d4e5f6a1b2";
+
+	device_reset_counts();
+	ck_assert_int_eq(get_next_disconnected(EVT_REG_OK, token),
+			 ST_DISCONNECTED);
+	ck_assert_int_eq(get_next_auth(EVT_REG_OK, token), ST_AUTH);
+	ck_assert_int_eq(get_next_config(EVT_REG_OK, token), ST_CONFIG);
+	ck_assert_int_eq(device_get_stored_data_count(), 0);
+}
+END_TEST
+
+START_TEST(offline_cfg_upt_ok_with_config_is_not_stored)
+{
+	struct l_queue *list = new_config_list();
+
+	device_reset_counts();
+	ck_assert_int_eq(get_next_disconnected(EVT_CFG_UPT_OK, list),
+			 ST_DISCONNECTED);
+	ck_assert_int_eq(get_next_auth(EVT_CFG_UPT_OK, list), ST_AUTH);
+	ck_assert_int_eq(get_next_register(EVT_CFG_UPT_OK, list),
+			 ST_REGISTER);
+	ck_assert_int_eq(device_get_stored_data_count(), 0);
+
+	l_queue_destroy(list, l_free);
+}
+END_TEST
+
+START_TEST(online_unreg_req_stops_offline_replay)
+{
+	device_reset_counts();
+	ck_assert_int_eq(get_next_online(EVT_UNREG_REQ, NULL), ST_UNREGISTER);
+	ck_assert_int_eq(device_get_stop_replay_count(), 1);
+}
+END_TEST
+
 static void add_disconnected_state_test_case(Suite *sm_suite)
 {
 	TCase *tc_disconnected;
@@ -838,6 +914,20 @@ static void add_error_state_test_case(Suite *sm_suite)
 	suite_add_tcase(sm_suite, tc_error);
 }
 
+static void add_offline_test_case(Suite *sm_suite)
+{
+	TCase *tc_offline;
+
+	/* Offline store test case */
+	tc_offline = tcase_create("Offline");
+	tcase_add_test(tc_offline, offline_publish_data_is_stored);
+	tcase_add_test(tc_offline, offline_reg_ok_with_token_is_not_stored);
+	tcase_add_test(tc_offline, offline_cfg_upt_ok_with_config_is_not_stored);
+	tcase_add_test(tc_offline, online_unreg_req_stops_offline_replay);
+
+	suite_add_tcase(sm_suite, tc_offline);
+}
+
 Suite *state_machine_suite(void)
 {
 	Suite *sm_suite;
@@ -851,6 +941,7 @@ Suite *state_machine_suite(void)
 	add_online_state_test_case(sm_suite);
 	add_unregister_state_test_case(sm_suite);
 	add_error_state_test_case(sm_suite);
+	add_offline_test_case(sm_suite);
 
 	return sm_suite;
 }
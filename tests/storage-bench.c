@@ -0,0 +1,147 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Device file startup benchmark
+ *
+ *  Loads synthetic device files with a growing number of data items and
+ *  times the steps the daemon goes through on startup: parsing the file,
+ *  listing the DataItem groups and reading the keys of every item. Build
+ *  with `make tests/storage_bench`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ell/ell.h>
+
+#include "src/conf-parameters.h"
+#include "src/storage.h"
+
+static const int items_counts[] = { 1000, 10000, 50000 };
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int write_device_file(const char *path, int items_count)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "[%s]\n%s = Bench\n%s = 1\n%s = tcp://127.0.0.1:502\n\n",
+		THING_GROUP, THING_NAME, THING_MODBUS_SLAVE_ID,
+		THING_MODBUS_URL);
+
+	for (i = 0; i < items_count; i++) {
+		fprintf(fp, "[%s%d]\n", DATA_ITEM_GROUP, i);
+		fprintf(fp, "%s = %d\n", SCHEMA_SENSOR_ID, i);
+		fprintf(fp, "%s = Sensor_%d\n", SCHEMA_SENSOR_NAME, i);
+		fprintf(fp, "%s = 65521\n%s = 0\n%s = 1\n", SCHEMA_TYPE_ID,
+			SCHEMA_UNIT, SCHEMA_VALUE_TYPE);
+		fprintf(fp, "%s = %d\n%s = 32\n", MODBUS_REG_ADDRESS, i * 2,
+			MODBUS_BIT_OFFSET);
+		fprintf(fp, "%s = 5\n%s = 1\n%s = 1000\n\n", EVENT_TIME_SEC,
+			EVENT_CHANGE, POLLING_INTERVAL_MS);
+	}
+
+	return fclose(fp);
+}
+
+static void bench(const char *path, int items_count)
+{
+	char **groups;
+	double start;
+	double opened;
+	double listed;
+	int value;
+	int fd;
+	int i;
+
+	start = now_ms();
+
+	fd = storage_open(path);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return;
+	}
+	opened = now_ms();
+
+	groups = get_data_item_groups(fd);
+	if (!groups) {
+		fprintf(stderr, "Invalid DataItem groups\n");
+		storage_close(fd);
+		return;
+	}
+	listed = now_ms();
+
+	for (i = 0; groups[i] != NULL; i++) {
+		storage_read_key_int(fd, groups[i], SCHEMA_SENSOR_ID, &value);
+		storage_read_key_int(fd, groups[i], SCHEMA_VALUE_TYPE, &value);
+		storage_read_key_int(fd, groups[i], MODBUS_REG_ADDRESS,
+				     &value);
+		storage_read_key_int(fd, groups[i], MODBUS_BIT_OFFSET, &value);
+		storage_read_key_int(fd, groups[i], EVENT_TIME_SEC, &value);
+	}
+
+	printf("%6d items: parse %9.2f ms, groups %9.2f ms, keys %9.2f ms\n",
+	       items_count, opened - start, listed - opened,
+	       now_ms() - listed);
+
+	l_strfreev(groups);
+	storage_close(fd);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/storage-bench-XXXXXX";
+	char *path;
+	unsigned int i;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	path = l_strdup_printf("%s/device.conf", dir);
+
+	for (i = 0; i < L_ARRAY_SIZE(items_counts); i++) {
+		if (write_device_file(path, items_counts[i]) < 0) {
+			perror("write");
+			break;
+		}
+
+		bench(path, items_counts[i]);
+	}
+
+	unlink(path);
+	rmdir(dir);
+	l_free(path);
+
+	return EXIT_SUCCESS;
+}